@@ -0,0 +1,74 @@
+/*
+ *  checkpoint.h
+ *  mplp
+ *
+ *  File helpers for MPLPAlg::WriteCheckpoint and MPLPAlg::ReadCheckpoint. A CheckpointWriter
+ *  writes a buffer from a thread of its own, into a temporary file which is then renamed over
+ *  the target, so that the target always holds a complete checkpoint (the previous one until
+ *  the new one is on disk). Buffers handed over during a write wait for it to finish, and only
+ *  the newest of them is then written. A MappedFile maps a whole file read-only into memory.
+ *
+ */
+#ifndef MPLP_CHECKPOINT_H
+#define MPLP_CHECKPOINT_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+
+#include <MPLP/mplp_config.h>
+
+namespace mplpLib {
+
+class CheckpointWriter
+{
+public:
+    CheckpointWriter() : m_busy(false), m_pending(false), m_ok(true) {}
+    // Copies do not share the writing thread
+    CheckpointWriter(const CheckpointWriter &) : m_busy(false), m_pending(false), m_ok(true) {}
+    CheckpointWriter & operator=(const CheckpointWriter &) {return *this;}
+    ~CheckpointWriter() {Wait();}
+
+    // Writes data (which is taken over, leaving data empty) to fname: at once, or else as soon as
+    // the current write is done, unless Start is called again before that.
+    void Start(const std::string & fname, std::vector<char> & data);
+    // Waits until everything handed to Start is written. Returns false if the last write failed.
+    bool Wait();
+
+private:
+    static bool WriteFile(const std::string & fname, const std::vector<char> & data);
+    // Body of the writing thread: writes the pending buffers until there are none left
+    void Run();
+
+    std::thread m_thread;
+    std::mutex m_mutex;    // guards the fields below
+    bool m_busy, m_pending, m_ok;
+    std::string m_fname, m_pending_fname;
+    std::vector<char> m_data, m_pending_data;
+};
+
+class MappedFile
+{
+public:
+    MappedFile() : m_data(NULL), m_size(0) {}
+    ~MappedFile() {Close();}
+
+    // Returns false if the file cannot be opened or is empty
+    bool Open(const std::string & fname);
+    void Close();
+
+    const char *Data() const {return m_data;}
+    MPLPIndexType Size() const {return m_size;}
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile & operator=(const MappedFile &);
+
+    char *m_data;
+    MPLPIndexType m_size;
+};
+
+} // namespace mplpLib
+
+#endif
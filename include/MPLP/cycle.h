@@ -9,6 +9,8 @@
 #define MPLP_CYCLE_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <vector>
 #include <algorithm>
 #include <set>
@@ -18,6 +20,7 @@
 
 #include <MPLP/mplp_config.h>
 #include <MPLP/mplp_alg.h>
+#include <MPLP/simd_kernels.h>
 
 namespace mplpLib {
 
@@ -26,9 +29,54 @@ namespace mplpLib {
 #define MPLP_Inf 9999999999.9
 #define MPLP_CYCLE_THRESH .00001  // TODO: Figure out how to set this
 #define MPLP_CLUSTER_THR .0000001
+#define MPLP_TRIANGLES_PER_TASK 256  // triangles handed to a thread at a time by TightenTriplet
 
-typedef std::map<std::pair<MPLPIndexType, MPLPIndexType>, MPLPIndexType> mapType;
-typedef std::vector<std::vector<std::pair<MPLPIndexType, double> > > adj_type;
+typedef std::vector<std::pair<std::pair<MPLPIndexType, MPLPIndexType>, MPLPIndexType> > edgeList;
+
+// Edge (a, b) of the projection graph with weight s_ab, as found while building the graph
+struct ProjectionEdge {
+    MPLPIndexType a, b;
+    double smn;
+};
+
+// Projection graph in compressed sparse row form. The edges of node m are begin[m] to begin[m+1]-1,
+// each with its other end in nbr and its weight s_mn in weight. Every edge is kept for both its ends.
+struct ProjectionGraph {
+    std::vector<MPLPIndexType> begin;
+    std::vector<MPLPIndexType> nbr;
+    std::vector<double> weight;
+
+    MPLPIndexType NumNodes() const {return begin.empty() ? 0 : begin.size() - 1;}
+    MPLPIndexType Degree(MPLPIndexType m) const {return begin[m+1] - begin[m];}
+
+    // Builds the graph on num_nodes nodes: counts the degrees, then places every edge in the rows of
+    // both its ends. Each row keeps the order of the edges in the list, a before b for each edge.
+    void Build(MPLPIndexType num_nodes, const std::vector<ProjectionEdge> & edges) {
+        begin.assign(num_nodes + 1, 0);
+        for (MPLPIndexType e=0; e < edges.size(); e++) {
+            begin[edges[e].a + 1]++;
+            begin[edges[e].b + 1]++;
+        }
+        for (MPLPIndexType m=0; m < num_nodes; m++)
+            begin[m+1] += begin[m];
+        nbr.resize(begin[num_nodes]);
+        weight.resize(begin[num_nodes]);
+        std::vector<MPLPIndexType> next(begin.begin(), begin.end() - 1);
+        for (MPLPIndexType e=0; e < edges.size(); e++) {
+            const ProjectionEdge & edge = edges[e];
+            nbr[next[edge.a]] = edge.b; weight[next[edge.a]++] = edge.smn;
+            nbr[next[edge.b]] = edge.a; weight[next[edge.b]++] = edge.smn;
+        }
+    }
+
+    // Weight of the edge (m, n), or 0 if there is none
+    double Weight(MPLPIndexType m, MPLPIndexType n) const {
+        for (MPLPIndexType k=begin[m]; k < begin[m+1]; k++)
+            if (nbr[k] == n)
+                return weight[k];
+        return 0;
+    }
+};
 
 // Structure for storing a candidate triplet cluster for tightening
 struct TripletCluster {
@@ -96,6 +144,50 @@ Node* merge(Node* x, Node* y) {
     }
 }
 
+// Union-find over the nodes 0..n-1 that also keeps the parity of the path from every node to its
+// root (used by find_optimal_R_parity). Parity 1 stands for a negative sign.
+struct ParityUnionFind {
+    std::vector<MPLPIndexType> parent;
+    std::vector<unsigned char> rank;
+    std::vector<unsigned char> parity;   // parity of the edge to the parent
+
+    ParityUnionFind(MPLPIndexType n) : parent(n), rank(n, 0), parity(n, 0) {
+        for (MPLPIndexType m=0; m < n; m++)
+            parent[m] = m;
+    }
+
+    // Root of m, with the parity of the path from m to it in p. Halves the paths on the way.
+    MPLPIndexType find(MPLPIndexType m, unsigned char & p) {
+        p = 0;
+        while (parent[m] != m) {
+            const MPLPIndexType up = parent[m];
+            if (parent[up] != up) {
+                parity[m] ^= parity[up];
+                parent[m] = parent[up];
+            }
+            p ^= parity[m];
+            m = parent[m];
+        }
+        return m;
+    }
+
+    // Adds the edge (a, b) with parity p. Returns false, changing nothing, if a and b are already
+    // joined with the other parity: the edge closes an odd-signed cycle.
+    bool join(MPLPIndexType a, MPLPIndexType b, unsigned char p) {
+        unsigned char pa, pb;
+        MPLPIndexType ra = find(a, pa), rb = find(b, pb);
+        if (ra == rb)
+            return (pa ^ pb) == p;
+        if (rank[ra] < rank[rb])
+            std::swap(ra, rb);
+        parent[rb] = ra;
+        parity[rb] = pa ^ pb ^ p;
+        if (rank[ra] == rank[rb])
+            rank[ra]++;
+        return true;
+    }
+};
+
 /////////////////////////////////////////////////////////////////////////////////
 // Code to evaluate how good a cycle cluster is
 
@@ -195,162 +287,150 @@ double maximizeCycle(std::vector<MulDimArr*> & beliefs, std::vector<bool> & b_tr
     return max_val;
 }
 
-/////////////////////////////////////////////////////////////////////////////////
-// Implementation of UAI 2008 algorithm (just for triplets; square functionality removed)
-
-MPLPIndexType TightenTriplet(MPLPAlg & mplp, MPLPIndexType nclus_to_add_min, MPLPIndexType nclus_to_add_max, std::map<std::vector<MPLPIndexType>, bool >& triplet_set, double & promised_bound) {
+// Work space of scoreTriangle, kept between calls so that scoring does not allocate
+struct TriangleScratch {
+    std::vector<double> jk;       // the jk edge belief over (j, k), k fastest
+    std::vector<double> field;    // best value of the ij and jk edges for every k
+};
 
-    MPLPIndexType nClustersAdded = 0;
-    MPLPIndexType nNewClusters = 0;
+// How much the triangle t would tighten the relaxation: the sum of the maxima of its three edge
+// beliefs less their joint maximum, or 0 if the current decoding attains that sum. These are the
+// values maximizeIndependently, getValCycle and maximizeCycle give for a triangle, bit for bit,
+// read straight from the tables.
+double scoreTriangle(MPLPAlg & mplp, const MPLPTriangle & t, TriangleScratch & scratch)
+{
+    const MulDimArr & ij = mplp.m_sum_into_intersects[t.ij_intersect_loc];
+    const MulDimArr & jk = mplp.m_sum_into_intersects[t.jk_intersect_loc];
+    const MulDimArr & ki = mplp.m_sum_into_intersects[t.ki_intersect_loc];
 
-    if(MPLP_DEBUG_MODE)
-        std::cout << "Doing pre-processing for adding triplet clusters." << std::endl;
+    MPLPIndexType max_at; // not actually needed
+    double bound_indep = 0.0;
+    bound_indep += ij.Max(max_at);
+    bound_indep += jk.Max(max_at);
+    bound_indep += ki.Max(max_at);
+
+    // Strides of the variables in the edge tables, which are row-major over the variables of
+    // their intersection sets, in either order
+    const MPLPIndexType ni = mplp.m_var_sizes[t.i], nj = mplp.m_var_sizes[t.j], nk = mplp.m_var_sizes[t.k];
+    const bool ij_t = mplp.m_all_intersects[t.ij_intersect_loc][0] != t.i;
+    const bool jk_t = mplp.m_all_intersects[t.jk_intersect_loc][0] != t.j;
+    const bool ki_t = mplp.m_all_intersects[t.ki_intersect_loc][0] != t.k;
+    const MPLPIndexType ij_si = ij_t ? 1 : nj, ij_sj = ij_t ? ni : 1;
+    const MPLPIndexType jk_sj = jk_t ? 1 : nk, jk_sk = jk_t ? nj : 1;
+    const MPLPIndexType ki_sk = ki_t ? 1 : ni, ki_si = ki_t ? nk : 1;
+
+    // Before doing expensive joint maximization, see if we can quickly find optimal assignment
+    const MPLPIndexType di = mplp.m_decoded_res[t.i], dj = mplp.m_decoded_res[t.j], dk = mplp.m_decoded_res[t.k];
+    double bound_quick = 0.0;
+    bound_quick += ij[di*ij_si + dj*ij_sj];
+    bound_quick += jk[dj*jk_sj + dk*jk_sk];
+    bound_quick += ki[dk*ki_sk + di*ki_si];
+    if(bound_indep == bound_quick)
+        return 0;
 
-    // Initialize adjacency list (filled in later) TODO: only do this when needed
-    std::vector<MPLPIndexType>* adjacency_list = new std::vector<MPLPIndexType>[mplp.m_var_sizes.size()];
+    // Joint maximization, as in maximizeCycle: over k of the best ij and jk values for (i, k),
+    // plus the ki value. The jk table is copied with k fastest so that the inner loop is contiguous.
+    scratch.jk.resize(nj*nk);
+    for(MPLPIndexType xj=0; xj < nj; xj++)
+        for(MPLPIndexType xk=0; xk < nk; xk++)
+            scratch.jk[xj*nk + xk] = jk[xj*jk_sj + xk*jk_sk];
+    scratch.field.resize(nk);
 
-    // Construct adjacency list for the graph
-    // Iterate over all of the edges (we do this by looking at the edge intersection sets)
-    for(mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it)
+    const SimdKernels & simd = GetSimdKernels();
+    double max_val = -MPLP_Inf;
+    for(MPLPIndexType xi=0; xi < ni; xi++)
     {
-        // Get the two nodes i & j
-        MPLPIndexType i=it->first.first; MPLPIndexType j=it->first.second;
-        adjacency_list[i].push_back(j);
-        adjacency_list[j].push_back(i);
-    }
+        std::fill(scratch.field.begin(), scratch.field.end(), -MPLP_Inf);
+        for(MPLPIndexType xj=0; xj < nj; xj++)
+            simd.max_add(&scratch.field[0], ij[xi*ij_si + xj*ij_sj], &scratch.jk[xj*nk], nk);
 
-    // Sort the adjacency list, for fast intersections later
-    for(MPLPIndexType i=0; i < sizeof(adjacency_list)/sizeof(std::vector<MPLPIndexType>); i++)
-    {
-        sort(adjacency_list[i].begin(), adjacency_list[i].end());
+        double tmp_max_val = -MPLP_Inf;
+        for(MPLPIndexType xk=0; xk < nk; xk++)
+            tmp_max_val = std::max(tmp_max_val, scratch.field[xk] + ki[xk*ki_sk + xi*ki_si]);
+        max_val = std::max(max_val, tmp_max_val);
     }
+    return bound_indep - max_val;
+}
 
-    // Count the number of triangles
-    std::vector<MPLPIndexType>::iterator intersects_iter_end;
-    std::vector<MPLPIndexType> commonNodes(mplp.m_var_sizes.size());
-    for(mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it)
-    {
+/////////////////////////////////////////////////////////////////////////////////
+// Implementation of UAI 2008 algorithm (just for triplets; square functionality removed)
 
-        // Get the two nodes i & j
-        MPLPIndexType i=it->first.first; MPLPIndexType j=it->first.second;
+MPLPIndexType TightenTriplet(MPLPAlg & mplp, MPLPIndexType nclus_to_add_min, MPLPIndexType nclus_to_add_max, VarSetMap & triplet_set, double & promised_bound) {
 
-        // Now find all neighbors of both i and j to see where the triangles are
-        intersects_iter_end = set_intersection(adjacency_list[i].begin(), adjacency_list[i].end(), adjacency_list[j].begin(), adjacency_list[j].end(), commonNodes.begin());
+    MPLPIndexType nClustersAdded = 0;
+    MPLPIndexType nNewClusters = 0;
 
-        for(std::vector<MPLPIndexType>::const_iterator n=commonNodes.begin(); n != intersects_iter_end; ++n)
-        {
-            // Since a triplet shows up three times as an edge plus
-            // a node, we only consider it for the case when n<i and n<j
-            if(*n < i && *n < j)
-                nNewClusters++;
-        }
-    }
+    // The triangles come from the index kept by MPLPAlg, in increasing order of the edges (i,j)
+    // and then of k
+    const std::vector<MPLPTriangle> & triangles = mplp.Triangles();
+    nNewClusters = triangles.size();
 
     if(nNewClusters == 0) {
         if(MPLP_DEBUG_MODE)
             std::cout << "nNewClusters = 0. Returning." << std::endl;
 
-        delete []adjacency_list;
         return 0;
     }
 
     if(MPLP_DEBUG_MODE)
         std::cout << "Looking for triangle clusters to add (" << nNewClusters << " triplets) " << std::endl;
 
-    // TODO: put this elsewhere so that the space isn't re-allocated continuously?
-    // Enumerate over all of the edges
-    TripletCluster* newCluster = new TripletCluster[nNewClusters];
-
-    MPLPIndexType index=0;
-
-    // Iterate over all of the edge intersection sets
-    std::vector<MPLPIndexType> tripAssignment; tripAssignment.push_back(-1); tripAssignment.push_back(-1); tripAssignment.push_back(-1);
-    for(mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it)
+    // Score the triangles, in parallel if mplp has several threads
+    std::vector<double> bounds(nNewClusters);
+    mplp.m_pool.ParallelFor(nNewClusters, MPLP_TRIANGLES_PER_TASK, [&](MPLPIndexType begin, MPLPIndexType end){
+        TriangleScratch scratch;
+        for(MPLPIndexType index=begin; index < end; index++)
+            bounds[index] = scoreTriangle(mplp, triangles[index], scratch);
+    });
+
+    // Only the best nclus_to_add_max triangles can be added, after skipping those already in
+    // triplet_set. Keep that many in a heap with the worst on top (larger bounds are better,
+    // then earlier triangles), instead of sorting them all.
+    const MPLPIndexType nTop = std::min(nNewClusters, MPLPIndexType(nclus_to_add_max + triplet_set.Size()));
+    typedef std::pair<double, MPLPIndexType> Candidate;
+    struct Better {
+        bool operator()(const Candidate & a, const Candidate & b) const {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        }
+    } better;
+    std::vector<Candidate> top;
+    top.reserve(nTop);
+    for(MPLPIndexType index=0; index < nNewClusters; index++)
     {
-
-        // Get the two nodes i & j, and the edge intersection index
-        MPLPIndexType i=it->first.first; MPLPIndexType j=it->first.second;
-        MPLPIndexType ij_intersect_loc = it->second;
-
-        // Now find all neighbors of both i and j to see where the triangles are
-        // TEMP TEMP -- fails at i=0, j=1, on i==3.
-        intersects_iter_end = set_intersection(adjacency_list[i].begin(), adjacency_list[i].end(), adjacency_list[j].begin(), adjacency_list[j].end(), commonNodes.begin());
-
-        for(std::vector<MPLPIndexType>::const_iterator n=commonNodes.begin(); n != intersects_iter_end; ++n)
-        {
-            MPLPIndexType k = *n;
-
-            // Since a triplet shows up three times as an edge plus
-            // a node, we only consider it for the case when k<i and k<j
-            if(!(k < i && k < j))
-                continue;
-
-            newCluster[index].i = i;
-            newCluster[index].j = j;
-            newCluster[index].k = k;
-
-            // Find the intersection sets for this triangle
-            newCluster[index].ij_intersect_loc = ij_intersect_loc;
-            std::vector<MPLPIndexType> jk_edge; jk_edge.push_back(newCluster[index].j); jk_edge.push_back(newCluster[index].k);
-            newCluster[index].jk_intersect_loc = mplp.FindIntersectionSet(jk_edge);
-            std::vector<MPLPIndexType> ki_edge; ki_edge.push_back(newCluster[index].k); ki_edge.push_back(newCluster[index].i);
-            newCluster[index].ki_intersect_loc = mplp.FindIntersectionSet(ki_edge);
-
-            // Construct the beliefs for each edge, which will be maximized below
-            std::vector<MulDimArr*> beliefs;
-            std::vector<bool> b_transpose;
-            beliefs.push_back(&mplp.m_sum_into_intersects[newCluster[index].ij_intersect_loc]);
-            b_transpose.push_back(mplp.m_all_intersects[newCluster[index].ij_intersect_loc][0] != newCluster[index].i); // i first
-            beliefs.push_back(&mplp.m_sum_into_intersects[newCluster[index].jk_intersect_loc]);
-            b_transpose.push_back(mplp.m_all_intersects[newCluster[index].jk_intersect_loc][0] != newCluster[index].j); // then 'j'
-            beliefs.push_back(&mplp.m_sum_into_intersects[newCluster[index].ki_intersect_loc]);
-            b_transpose.push_back(mplp.m_all_intersects[newCluster[index].ki_intersect_loc][0] != newCluster[index].k); // then 'k'
-
-            double bound_indep = maximizeIndependently(beliefs);
-
-            // Before doing expensive joint maximization, see if we can quickly find optimal assignment
-            tripAssignment[0] = mplp.m_decoded_res[i]; tripAssignment[1] = mplp.m_decoded_res[j]; tripAssignment[2] = mplp.m_decoded_res[k];
-            double bound_quick = getValCycle(beliefs, b_transpose, tripAssignment);
-            if(bound_indep == bound_quick)
-            {
-                newCluster[index].bound = 0;
-            } else {
-                // Do expensive joint maximization
-                newCluster[index].bound = bound_indep - maximizeCycle(beliefs, b_transpose);
-            }
-
-            index++;
+        const Candidate c(bounds[index], index);
+        if(top.size() < nTop) {
+            top.push_back(c);
+            std::push_heap(top.begin(), top.end(), better);
+        } else if(better(c, top.front())) {
+            std::pop_heap(top.begin(), top.end(), better);
+            top.back() = c;
+            std::push_heap(top.begin(), top.end(), better);
         }
     }
+    // Best first
+    std::sort_heap(top.begin(), top.end(), better);
 
-    // TODO opt: have a class for a cluster, so we can have different types and sort by bound,
-    //       choosing best one by bound.
-    //       Make the sorting and adding independent of the type of graph...
-
-    // Sort the clusters by the bound
-    std::sort(newCluster, newCluster+nNewClusters);
+    // Nothing to add (nclus_to_add_max is 0 and triplet_set is empty)
+    if(top.empty()) {
+        promised_bound = 0;
+        return 0;
+    }
 
     if(MPLP_DEBUG_MODE)
-        std::cout << " -- Considered " << nNewClusters << " clusters, smallest bound " << newCluster[std::max(static_cast<int>(nNewClusters)-static_cast<int>(nclus_to_add_max), 0)].bound << ", largest bound " << newCluster[nNewClusters-1].bound << std::endl;
+        std::cout << " -- Considered " << nNewClusters << " clusters, smallest bound kept " << top.back().first << ", largest bound " << top.front().first << std::endl;
 
-    promised_bound = newCluster[nNewClusters-1].bound;
+    promised_bound = top.front().first;
 
     // Add the top nclus_to_add clusters to the relaxation
     assert(nNewClusters > 0);
-    for(MPLPIndexType iter = nNewClusters; iter > 0 && nClustersAdded < nclus_to_add_max && (nClustersAdded < nclus_to_add_min || ((newCluster[iter - 1].bound >= newCluster[nNewClusters-1].bound/5) && newCluster[iter - 1].bound >= MPLP_CLUSTER_THR)) ; iter--)
+    for(MPLPIndexType rank = 0; rank < top.size() && nClustersAdded < nclus_to_add_max && (nClustersAdded < nclus_to_add_min || ((top[rank].first >= top.front().first/5) && top[rank].first >= MPLP_CLUSTER_THR)) ; rank++)
     {
-        const MPLPIndexType clusterId = iter - 1;
+        const MPLPTriangle & cluster = triangles[top[rank].second];
         // Check to see if this triplet is already being used
-        std::vector<MPLPIndexType> temp;
-        temp.push_back(newCluster[clusterId].i);
-        temp.push_back(newCluster[clusterId].j);
-        temp.push_back(newCluster[clusterId].k);
-        sort(temp.begin(), temp.end());
-
-        std::map<std::vector<MPLPIndexType>, bool >::iterator t_itr = triplet_set.find(temp);
-        if (t_itr == triplet_set.end())
-            triplet_set.insert(std::pair<std::vector<MPLPIndexType>, bool >(temp, true));
-        else {
+        MPLPIndexType temp[3] = {cluster.i, cluster.j, cluster.k};
+        std::sort(temp, temp + 3);
+
+        if (!triplet_set.Insert(temp, 3, triplet_set.Size())) {
             //	if(MPLP_DEBUG_MODE)
             //	  cout << "   Triplet was already present. Skipping..." << endl;
             continue;
@@ -358,25 +438,22 @@ MPLPIndexType TightenTriplet(MPLPAlg & mplp, MPLPIndexType nclus_to_add_min, MPL
 
         // Now add cluster ijk
         std::vector<MPLPIndexType> ijk_inds;
-        ijk_inds.push_back(newCluster[clusterId].i); ijk_inds.push_back(newCluster[clusterId].j); ijk_inds.push_back(newCluster[clusterId].k);
+        ijk_inds.push_back(cluster.i); ijk_inds.push_back(cluster.j); ijk_inds.push_back(cluster.k);
 
         std::vector<MPLPIndexType> ijk_intersect_inds;
-        ijk_intersect_inds.push_back(newCluster[clusterId].ij_intersect_loc);
-        ijk_intersect_inds.push_back(newCluster[clusterId].jk_intersect_loc);
-        ijk_intersect_inds.push_back(newCluster[clusterId].ki_intersect_loc);
+        ijk_intersect_inds.push_back(cluster.ij_intersect_loc);
+        ijk_intersect_inds.push_back(cluster.jk_intersect_loc);
+        ijk_intersect_inds.push_back(cluster.ki_intersect_loc);
 
         mplp.AddRegion(ijk_inds, ijk_intersect_inds);
 
         if(MPLP_DEBUG_MODE)
-            std::cout << "Cluster added on nodes " << newCluster[clusterId].i << ", " << newCluster[clusterId].j << ", " << newCluster[clusterId].k << std::endl;
+            std::cout << "Cluster added on nodes " << cluster.i << ", " << cluster.j << ", " << cluster.k << std::endl;
         // TODO: log which clusters are chosen...
 
         nClustersAdded++;
     }
 
-    delete []newCluster;
-    delete []adjacency_list;
-
     return nClustersAdded;
 }
 
@@ -385,6 +462,18 @@ MPLPIndexType TightenTriplet(MPLPAlg & mplp, MPLPIndexType nclus_to_add_min, MPL
 // Everything that follows is for the UAI 2012 cycle finding algorithm which
 // can find arbitrary-length cycles to use in tightening the relaxation.
 
+// The edge intersection sets of mplp as ((i, j), index) with i < j, in increasing order of (i, j)
+edgeList sortedEdges(MPLPAlg & mplp)
+{
+    edgeList edges;
+    const std::vector<std::vector<std::pair<MPLPIndexType, MPLPIndexType> > > & adjacency = mplp.EdgeAdjacency();
+    for (MPLPIndexType i=0; i < adjacency.size(); i++)
+        for (MPLPIndexType k=0; k < adjacency[i].size(); k++)
+            if (adjacency[i][k].first > i)
+                edges.push_back(std::make_pair(std::make_pair(i, adjacency[i][k].first), adjacency[i][k].second));
+    return edges;
+}
+
 bool edge_sorting(std::list<MPLPIndexType> i, std::list<MPLPIndexType> j) {
     return i.back() > j.back();
 }
@@ -393,18 +482,37 @@ bool edge_sorting3(std::pair<std::pair<MPLPIndexType, MPLPIndexType>, double> i,
     return i.second > j.second;
 }
 
-// De-allocate memory relating to the projection graph (TODO: finish writing this)
-void delete_projection_graph(/*MPLPIndexType num_vars, std::vector<std::vector<MPLPIndexType> > &projection_map, std::vector<MPLPIndexType> &projection_imap_var, adj_type &projection_adjacency_list,*/ double* &array_of_sij) {
-
-    //for(MPLPIndexType node=0; node < num_vars; node++)
-    //  delete []projection_map[node];
-    //delete []projection_map;
-
-    //delete projection_imap_var;
-
-    //delete []projection_adjacency_list;
+// Sorts the edge weight thresholds |s_mn| in increasing order and removes duplicates. They are all
+// positive, and positive doubles are ordered as their bit patterns, so this is a radix sort of those,
+// 16 bits at a time (skipping the digits all thresholds share).
+void sort_unique_thresholds(std::vector<double> & thresholds) {
+    const MPLPIndexType n = thresholds.size();
+    std::vector<uint64_t> keys(n), tmp(n);
+    if (n > 0)
+        memcpy(&keys[0], &thresholds[0], n*sizeof(double));
+
+    std::vector<MPLPIndexType> count(1 << 16);
+    for (unsigned int shift = 0; shift < 64; shift += 16) {
+        std::fill(count.begin(), count.end(), 0);
+        for (MPLPIndexType k=0; k < n; k++)
+            count[(keys[k] >> shift) & 0xffff]++;
+        if (n == 0 || count[(keys[0] >> shift) & 0xffff] == n)
+            continue;
+        MPLPIndexType sum = 0;
+        for (MPLPIndexType d=0; d < count.size(); d++) {
+            const MPLPIndexType c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (MPLPIndexType k=0; k < n; k++)
+            tmp[count[(keys[k] >> shift) & 0xffff]++] = keys[k];
+        keys.swap(tmp);
+    }
 
-    delete []array_of_sij;
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    thresholds.resize(keys.size());
+    if (!keys.empty())
+        memcpy(&thresholds[0], &keys[0], keys.size()*sizeof(double));
 }
 
 // Compute a single edge weight in the projection graph
@@ -677,13 +785,14 @@ void find_partition(std::vector<std::map<std::vector<MPLPIndexType>, MPLPIndexTy
 
 // Create the expanded projection graph by including all singleton partitions and also
 // all partitions found by calling FindPartition on all edges.
-MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIndexType>& projection_imap_var, std::vector<std::vector<std::pair<MPLPIndexType, double> > >& projection_adjacency_list, std::map<std::pair<MPLPIndexType, MPLPIndexType>, double>&projection_edge_weights, double* &array_of_sij, MPLPIndexType& array_of_sij_size, std::vector<std::vector<MPLPIndexType> >& partition_imap) {
+MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIndexType>& projection_imap_var, ProjectionGraph& projection_graph, std::vector<std::vector<MPLPIndexType> >& partition_imap) {
     // projection_imap_var maps from projection node to variable
     // partition_imap maps from projection node to vector of states
 
     MPLPIndexType num_of_vars = mplp.m_var_sizes.size();
+    const edgeList edges = sortedEdges(mplp);
     std::vector<std::map<std::vector<MPLPIndexType>,MPLPIndexType> > partition_set;
-    std::set<double> set_of_sij;
+    std::vector<ProjectionEdge> projection_edges;
     MPLPIndexType num_projection_nodes = 0;
 
     for (MPLPIndexType i = 0; i < num_of_vars; i++) {
@@ -704,7 +813,7 @@ MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIn
         find_partition_start_time = clock();
         //THIS IS THE NEW PARTITIONING ALGORITHM
 
-        for (mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it) {
+        for (edgeList::const_iterator it = edges.begin(); it != edges.end(); ++it) {
             MPLPIndexType i=it->first.first; MPLPIndexType j=it->first.second;
             MPLPIndexType ij_intersect_loc = it->second;
 
@@ -735,16 +844,13 @@ MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIn
             it->second = num_projection_nodes++;
             projection_imap_var.push_back(i);
             partition_imap.push_back(it->first);
-
-            std::vector<std::pair<MPLPIndexType, double> > temp;
-            projection_adjacency_list.push_back(temp);
         }
     }
 
     clock_t find_smn_start_time = clock();
 
     // Create projection graph edges for each edge of original graph and each pair of partitions
-    for (mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it) {
+    for (edgeList::const_iterator it = edges.begin(); it != edges.end(); ++it) {
         MPLPIndexType i = it->first.first; MPLPIndexType j = it->first.second;
         MPLPIndexType ij_intersect_loc = it->second;
 
@@ -898,13 +1004,8 @@ MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIn
                 }
 
                 if (smn != 0) {
-                    set_of_sij.insert(fabs(smn));
-
-                    projection_adjacency_list[m].push_back(std::make_pair(n, smn));
-                    projection_adjacency_list[n].push_back(std::make_pair(m, smn));
-
-                    projection_edge_weights.insert(std::pair<std::pair<MPLPIndexType, MPLPIndexType>, double>(std::pair<MPLPIndexType, MPLPIndexType>(n, m), smn));
-                    projection_edge_weights.insert(std::pair<std::pair<MPLPIndexType, MPLPIndexType>, double>(std::pair<MPLPIndexType, MPLPIndexType>(m, n), smn));
+                    ProjectionEdge edge = {m, n, smn};
+                    projection_edges.push_back(edge);
                 }
 
             }
@@ -916,32 +1017,26 @@ MPLPIndexType create_expanded_projection_graph(MPLPAlg& mplp, std::vector<MPLPIn
         std::cout << " -- find_smn. Took " << find_smn_total_time << " seconds" << std::endl;
     }
 
-    array_of_sij = new double[set_of_sij.size()];
-    array_of_sij_size = 0;
-
-    for (std::set<double>::iterator set_iter = set_of_sij.begin(); set_iter != set_of_sij.end(); set_iter++) {  //NOTE: PASSED AS FUNCTION ARG, DO NOT DELETE HERE!!
-        array_of_sij[array_of_sij_size++] = *set_iter;
-    }
+    projection_graph.Build(num_projection_nodes, projection_edges);
 
     return num_projection_nodes;
 }
 
 
 // Creates the k-projection graph (just a single partition per variable)
-void create_k_projection_graph(MPLPAlg& mplp, std::vector<std::vector<MPLPIndexType> > &projection_map, MPLPIndexType& num_projection_nodes, std::vector<MPLPIndexType> &projection_imap_var, std::vector<std::vector<MPLPIndexType> > &partition_imap, std::map<std::pair<MPLPIndexType, MPLPIndexType>, double>& projection_edge_weights, adj_type &projection_adjacency_list, double* &array_of_sij, MPLPIndexType& array_of_sij_size) {
+void create_k_projection_graph(MPLPAlg& mplp, std::vector<std::vector<MPLPIndexType> > &projection_map, MPLPIndexType& num_projection_nodes, std::vector<MPLPIndexType> &projection_imap_var, std::vector<std::vector<MPLPIndexType> > &partition_imap, ProjectionGraph &projection_graph) {
 
     // TODO: make sure for binary variables that there is only one node per variable (rather than 2).
-    // TODO: projection_edge_weights can likely be removed from this function and elsewhere.
     // TODO: most of these ints can be changed to be unsigned and/or fewer bits. Look into memory allocation.
 
+    const edgeList edges = sortedEdges(mplp);
+
     // Initialize the projection graph
     MPLPIndexType projection_node_iter = 0;
     for(MPLPIndexType node=0; node < mplp.m_var_sizes.size(); node++) {
         std::vector<MPLPIndexType> i;
 
         for(MPLPIndexType state=0; state < mplp.m_var_sizes[node]; state++) {
-            std::vector<std::pair<MPLPIndexType, double> > temp;
-            projection_adjacency_list.push_back(temp);
             i.push_back(projection_node_iter++);
         }
         projection_map.push_back(i);
@@ -963,8 +1058,8 @@ void create_k_projection_graph(MPLPAlg& mplp, std::vector<std::vector<MPLPIndexT
     }
 
     // Iterate over all of the edges (we do this by looking at the edge intersection sets)
-    std::set<double> set_of_sij;
-    for(mapType::const_iterator it = mplp.m_intersect_map.begin(); it != mplp.m_intersect_map.end(); ++it) {
+    std::vector<ProjectionEdge> projection_edges;
+    for(edgeList::const_iterator it = edges.begin(); it != edges.end(); ++it) {
         // Get the two nodes i & j and the edge intersection set. Put in right order.
         MPLPIndexType i=it->first.first; MPLPIndexType j=it->first.second;
         MPLPIndexType ij_intersect_loc = it->second;
@@ -1100,55 +1195,50 @@ void create_k_projection_graph(MPLPAlg& mplp, std::vector<std::vector<MPLPIndexT
 
                 // TODO: use threshold here, to make next stage faster
                 if(val_s != 0) {
-                    projection_adjacency_list[m].push_back(std::make_pair(n, val_s));
-                    projection_adjacency_list[n].push_back(std::make_pair(m, val_s));
-                    set_of_sij.insert(fabs(val_s));
+                    ProjectionEdge edge = {m, n, val_s};
+                    projection_edges.push_back(edge);
                 }
-
-                // Insert into edge weight map
-                projection_edge_weights.insert(std::pair<std::pair<MPLPIndexType,MPLPIndexType>,double>(std::pair<MPLPIndexType,MPLPIndexType>(n, m), val_s));
-                projection_edge_weights.insert(std::pair<std::pair<MPLPIndexType,MPLPIndexType>,double>(std::pair<MPLPIndexType,MPLPIndexType>(m, n), val_s));
             }
         }
 
     }
 
-    // Sort list_of_sij and remove duplicates
-    array_of_sij = new double[set_of_sij.size()];
-    array_of_sij_size = 0;
-
-    for(std::set<double>::iterator set_iter = set_of_sij.begin(); set_iter != set_of_sij.end(); ++set_iter) {
-        array_of_sij[array_of_sij_size++] = *set_iter;
-    }
+    projection_graph.Build(num_projection_nodes, projection_edges);
 }
 
 
+// The distinct edge weight thresholds |s_mn| of the projection graph, in increasing order
+std::vector<double> projection_thresholds(const ProjectionGraph &projection_graph) {
+    std::vector<double> thresholds(projection_graph.weight.size());
+    for (MPLPIndexType k=0; k < thresholds.size(); k++)
+        thresholds[k] = fabs(projection_graph.weight[k]);
+    sort_unique_thresholds(thresholds);
+    return thresholds;
+}
+
 // Does binary search over the edge weights to find largest edge weight
-// such that there is an odd-signed cycle.
-double find_optimal_R(adj_type &projection_adjacency_list, double* &array_of_sij, MPLPIndexType array_of_sij_size) {
+// such that there is an odd-signed cycle. TightenCycle uses find_optimal_R_parity, which finds
+// the same value; this one is kept to check it.
+double find_optimal_R(const ProjectionGraph &projection_graph, const std::vector<double> &array_of_sij) {
 
-    // Do binary search over sij
+    // Do binary search over sij, in [lower, upper)
     MPLPIndexType bin_search_lower_bound = 0;
-    MPLPIndexType bin_search_upper_bound = array_of_sij_size;
+    MPLPIndexType bin_search_upper_bound = array_of_sij.size();
     double sij_min = -1;
-    MPLPIndexType num_projection_nodes = projection_adjacency_list.size();
+    MPLPIndexType num_projection_nodes = projection_graph.NumNodes();
+    std::vector<int> node_sign(num_projection_nodes);
 
-    while(bin_search_lower_bound <= bin_search_upper_bound) {
+    while(bin_search_lower_bound < bin_search_upper_bound) {
 
         // Compute mid-point
-        MPLPIndexType R_pos = floor((bin_search_lower_bound + bin_search_upper_bound)/2);
+        MPLPIndexType R_pos = bin_search_lower_bound + (bin_search_upper_bound - bin_search_lower_bound)/2;
         double R = array_of_sij[R_pos];
 
         // Does there exist an odd signed cycle using just edges with sij >= R? If so, go up. If not, go down.
         bool found_odd_signed_cycle = false;
 
         // Initialize
-        // TODO: do not allocate memory for this every time! Just re-initialize.
-
-        std::vector<int> node_sign(num_projection_nodes);
-        for(MPLPIndexType m=0; m<num_projection_nodes; m++) {
-            node_sign[m] = 0; // denotes "not yet seen"
-        }
+        std::fill(node_sign.begin(), node_sign.end(), 0); // denotes "not yet seen"
 
         // Graph may be disconnected, so check from all nodes
         for(MPLPIndexType i = 0; i < num_projection_nodes && !found_odd_signed_cycle; i++) {
@@ -1161,13 +1251,13 @@ double find_optimal_R(adj_type &projection_adjacency_list, double* &array_of_sij
                     MPLPIndexType current = q.front();
                     q.pop();
 
-                    for (MPLPIndexType j = 0; j < projection_adjacency_list[current].size(); j++) {
-                        double smn = projection_adjacency_list[current][j].second;
+                    for (MPLPIndexType j = projection_graph.begin[current]; j < projection_graph.begin[current+1]; j++) {
+                        double smn = projection_graph.weight[j];
                         // Ignore edges with weight less than R
                         if (fabs(smn) < R)
                             continue;
 
-                        MPLPIndexType next = projection_adjacency_list[current][j].first;
+                        MPLPIndexType next = projection_graph.nbr[j];
                         int sign_of_smn = (smn > 0) - (smn < 0);
 
                         if (node_sign[next] == 0) {
@@ -1189,18 +1279,44 @@ double find_optimal_R(adj_type &projection_adjacency_list, double* &array_of_sij
             bin_search_lower_bound = R_pos+1;
         }
         else
-            bin_search_upper_bound = R_pos-1;
+            bin_search_upper_bound = R_pos;
     }
 
     return sij_min;
 }
 
 
+// Finds the same edge weight as find_optimal_R in one pass: adds the edges to a parity union-find
+// in decreasing order of |s_mn|, until one closes an odd-signed cycle. The cycle then uses only
+// edges at least as heavy as that one, and no lighter threshold has been reached yet.
+double find_optimal_R_parity(const ProjectionGraph &projection_graph) {
+
+    // Every edge once, from its smaller end, heaviest first
+    std::vector<ProjectionEdge> edges;
+    for (MPLPIndexType m=0; m < projection_graph.NumNodes(); m++)
+        for (MPLPIndexType k=projection_graph.begin[m]; k < projection_graph.begin[m+1]; k++)
+            if (m < projection_graph.nbr[k]) {
+                ProjectionEdge edge = {m, projection_graph.nbr[k], projection_graph.weight[k]};
+                edges.push_back(edge);
+            }
+    std::sort(edges.begin(), edges.end(), [](const ProjectionEdge & x, const ProjectionEdge & y){
+        return fabs(x.smn) > fabs(y.smn);
+    });
+
+    ParityUnionFind uf(projection_graph.NumNodes());
+    for (MPLPIndexType e=0; e < edges.size(); e++) {
+        if (!uf.join(edges[e].a, edges[e].b, edges[e].smn < 0))
+            return fabs(edges[e].smn);
+    }
+    return -1;
+}
+
+
 // Returns an array which is a random permutation of the numbers 0 through n-1.
 MPLPIndexType* random_permutation(MPLPIndexType n) {
     MPLPIndexType *p = new MPLPIndexType[n];
     for (MPLPIndexType i = 0; i < n; ++i) {
-        MPLPIndexType j = rand() % (i + 1);
+        MPLPIndexType j = Rand() % (i + 1);
         p[i] = p[j];
         p[j] = i;
     }
@@ -1211,10 +1327,10 @@ MPLPIndexType* random_permutation(MPLPIndexType n) {
 // Given an undirected graph, finds an odd-signed cycle.
 // This works by breath-first search. Better might be to find minimal depth tree.
 // NOTE: this function depends on the random seed becase it creates a random spanning tree.
-void FindCycles(std::vector<std::list<MPLPIndexType> > &cycle_set, double optimal_R, MPLPIndexType ncycles_to_add, adj_type &projection_adjacency_list) {
+void FindCycles(std::vector<std::list<MPLPIndexType> > &cycle_set, double optimal_R, MPLPIndexType ncycles_to_add, const ProjectionGraph &projection_graph) {
 
     double R = optimal_R;
-    MPLPIndexType num_projection_nodes = projection_adjacency_list.size();
+    MPLPIndexType num_projection_nodes = projection_graph.NumNodes();
 
     // Initialize  (NOTE: uses heap allocation)
     int *node_sign = new int[num_projection_nodes];
@@ -1247,12 +1363,13 @@ void FindCycles(std::vector<std::list<MPLPIndexType> > &cycle_set, double optima
                 q.pop();
 
                 // Randomize the adjacency list
-                MPLPIndexType* random_nbrs = random_permutation(projection_adjacency_list[current].size());
-                for (MPLPIndexType rj = 0; rj < projection_adjacency_list[current].size(); rj++) {
+                const MPLPIndexType row = projection_graph.begin[current];
+                MPLPIndexType* random_nbrs = random_permutation(projection_graph.Degree(current));
+                for (MPLPIndexType rj = 0; rj < projection_graph.Degree(current); rj++) {
                     MPLPIndexType j = random_nbrs[rj];
-                    MPLPIndexType next = projection_adjacency_list[current][j].first;
+                    MPLPIndexType next = projection_graph.nbr[row + j];
                     if (node_sign[next] == 0) {
-                        double smn = projection_adjacency_list[current][j].second;
+                        double smn = projection_graph.weight[row + j];
                         if (fabs(smn) < R) {
                             ;
                         }
@@ -1277,16 +1394,17 @@ void FindCycles(std::vector<std::list<MPLPIndexType> > &cycle_set, double optima
     std::map<std::pair<MPLPIndexType, MPLPIndexType>, MPLPIndexType> edge_map;
 
     for (MPLPIndexType i = 0; i < num_projection_nodes; i++) {
-        for (MPLPIndexType j = 0; j < projection_adjacency_list[i].size(); j++) {
+        const MPLPIndexType row = projection_graph.begin[i];
+        for (MPLPIndexType j = 0; j < projection_graph.Degree(i); j++) {
             if (node_parent[i] == j || node_parent[j] == i) {
                 continue;
             }
-            double smn = projection_adjacency_list[i][j].second;
+            double smn = projection_graph.weight[row + j];
 
             if (fabs(smn) < R) {
                 continue;
             }
-            MPLPIndexType jj = projection_adjacency_list[i][j].first;
+            MPLPIndexType jj = projection_graph.nbr[row + j];
             int sign_of_smn = (smn > 0) - (smn < 0);
 
             if (node_sign[i] == -node_sign[jj] * sign_of_smn) { //cycle found
@@ -1397,7 +1515,7 @@ void FindCycles(std::vector<std::list<MPLPIndexType> > &cycle_set, double optima
 
 // Check to see if there are any duplicate variables, and, if so, shortcut
 // NOTE: this is not currently being used.
-void shortcut(std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &projection_imap_var, std::map<std::pair<MPLPIndexType, MPLPIndexType>, double>& projection_edge_weights/*, MPLPIndexType& num_projection_nodes*/) {
+void shortcut(std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &projection_imap_var, const ProjectionGraph& projection_graph/*, MPLPIndexType& num_projection_nodes*/) {
 
     bool exist_duplicates = true;
     std::vector<MPLPIndexType> cycle_array(cycle.size()); MPLPIndexType tmp_ind = 0;
@@ -1425,9 +1543,7 @@ void shortcut(std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &proje
         for(MPLPIndexType i=cycle_start+1; i <= cycle_end; i++) {
 
             // Get edge weight
-            std::map< std::pair<MPLPIndexType,MPLPIndexType>, double>::iterator weights_iter = projection_edge_weights.find(std::make_pair(cycle_array[i-1], cycle_array[i]));
-
-            double smn = weights_iter->second;
+            double smn = projection_graph.Weight(cycle_array[i-1], cycle_array[i]);
             int sign_of_smn = (smn > 0) - (smn < 0);
             cycle_sign[i] = cycle_sign[i-1]*sign_of_smn;
 
@@ -1437,8 +1553,7 @@ void shortcut(std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &proje
                 MPLPIndexType first_occurence_index = dups_iter->second;
 
                 // Look to see if the first half of the cycle is violated.
-                weights_iter = projection_edge_weights.find(std::make_pair(cycle_array[first_occurence_index], cycle_array[i-1]));
-                double edge_weight = weights_iter->second;
+                double edge_weight = projection_graph.Weight(cycle_array[first_occurence_index], cycle_array[i-1]);
                 int sign_of_edge = (edge_weight > 0) - (edge_weight < 0);
 
                 // NOTE: Bound decrease could be LESS than promised!
@@ -1476,7 +1591,7 @@ void shortcut(std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &proje
 }
 
 
-MPLPIndexType add_cycle(MPLPAlg& mplp, std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &projection_imap_var, std::map<std::vector<MPLPIndexType>, bool >& triplet_set/*, MPLPIndexType& num_projection_nodes*/) {
+MPLPIndexType add_cycle(MPLPAlg& mplp, std::list<MPLPIndexType> &cycle, std::vector<MPLPIndexType> &projection_imap_var, VarSetMap & triplet_set/*, MPLPIndexType& num_projection_nodes*/) {
 
     MPLPIndexType nClustersAdded = 0;
 
@@ -1521,11 +1636,8 @@ MPLPIndexType add_cycle(MPLPAlg& mplp, std::list<MPLPIndexType> &cycle, std::vec
     // Add the top nclus_to_add clusters to the relaxation
     for(MPLPIndexType clusterId = 0; clusterId < nNewClusters; clusterId++) {
         // Check that these clusters and intersection sets haven't already been added
-        std::vector<MPLPIndexType> temp;
-        temp.push_back(newCluster[clusterId].i);
-        temp.push_back(newCluster[clusterId].j);
-        temp.push_back(newCluster[clusterId].k);
-        sort(temp.begin(), temp.end());
+        MPLPIndexType temp[3] = {newCluster[clusterId].i, newCluster[clusterId].j, newCluster[clusterId].k};
+        std::sort(temp, temp + 3);
 
         // Check to see if this cluster involves two of the same variables
         // (could happen because we didn't shortcut)
@@ -1535,10 +1647,7 @@ MPLPIndexType add_cycle(MPLPAlg& mplp, std::list<MPLPIndexType> &cycle, std::vec
             continue;
         }
 
-        std::map<std::vector<MPLPIndexType>, bool >::iterator t_itr = triplet_set.find(temp);
-        if (t_itr == triplet_set.end())
-            triplet_set.insert(std::pair<std::vector<MPLPIndexType>, bool >(temp, true));
-        else {
+        if (!triplet_set.Insert(temp, 3, triplet_set.Size())) {
             //	if(MPLP_DEBUG_MODE)
             //	  cout << "   Triplet was already present. Skipping..." << endl;
             continue;
@@ -1598,36 +1707,38 @@ MPLPIndexType add_cycle(MPLPAlg& mplp, std::list<MPLPIndexType> &cycle, std::vec
  * method=1: use create_k_projection_graph
  * method=2: use create_expanded_projection_graph
  */
-MPLPIndexType TightenCycle(MPLPAlg & mplp, MPLPIndexType nclus_to_add,  std::map<std::vector<MPLPIndexType>, bool >& triplet_set, double & promised_bound, MPLPIndexType method) {
+MPLPIndexType TightenCycle(MPLPAlg & mplp, MPLPIndexType nclus_to_add,  VarSetMap & triplet_set, double & promised_bound, MPLPIndexType method) {
 
     MPLPIndexType nClustersAdded = 0;
     //MPLPIndexType nNewClusters;
 
     if (MPLP_DEBUG_MODE) std::cout << "Finding the most violated cycle...." << std::endl;
 
-    // This map allows us to quickly look up the edge weights
-    std::map<std::pair<MPLPIndexType, MPLPIndexType>, double> projection_edge_weights;
     MPLPIndexType num_projection_nodes;
     std::vector<std::vector<MPLPIndexType> > projection_map;
     std::vector<MPLPIndexType> projection_imap_var;
-    std::vector<std::vector<std::pair<MPLPIndexType, double> > > projection_adjacency_list;
+    ProjectionGraph projection_graph;
     std::vector<std::vector<MPLPIndexType> > partition_imap;
 
-    double* array_of_sij; MPLPIndexType array_of_sij_size;
-
     // Define the projection graph and all edge weights
     if(method == 2)
-        num_projection_nodes = create_expanded_projection_graph(mplp, projection_imap_var, projection_adjacency_list, projection_edge_weights, array_of_sij, array_of_sij_size, partition_imap);
+        num_projection_nodes = create_expanded_projection_graph(mplp, projection_imap_var, projection_graph, partition_imap);
     else if(method == 1)
-        create_k_projection_graph(mplp, projection_map, num_projection_nodes, projection_imap_var, partition_imap, projection_edge_weights, projection_adjacency_list, array_of_sij, array_of_sij_size);
+        create_k_projection_graph(mplp, projection_map, num_projection_nodes, projection_imap_var, partition_imap, projection_graph);
     else {
         std::cout << "ERROR: method not defined." << std::endl;
         return 0;
     }
 
     std::vector<std::list<MPLPIndexType> > cycle_set;
-    double optimal_R = find_optimal_R(projection_adjacency_list, array_of_sij, array_of_sij_size);
-    if (MPLP_DEBUG_MODE) std::cout << "R_optimal = " << optimal_R << std::endl;
+    double optimal_R = find_optimal_R_parity(projection_graph);
+    if (MPLP_DEBUG_MODE) {
+        std::cout << "R_optimal = " << optimal_R << std::endl;
+        // The thresholds are only needed for this check
+        const std::vector<double> array_of_sij = projection_thresholds(projection_graph);
+        if (find_optimal_R(projection_graph, array_of_sij) != optimal_R)
+            std::cout << "find_optimal_R finds " << find_optimal_R(projection_graph, array_of_sij) << std::endl;
+    }
 
     promised_bound = optimal_R;
 
@@ -1637,14 +1748,14 @@ MPLPIndexType TightenCycle(MPLPAlg & mplp, MPLPIndexType nclus_to_add,  std::map
     if (optimal_R > 0) {
         // TODO: this is almost certainly doing more computation than necessary. Might want to change
         // nclus_to_add*10 to nclus_to_add, and comment out all but the top 3.
-        FindCycles(cycle_set, optimal_R, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/2, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/4, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/8, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/16, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/32, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/64, nclus_to_add*10, projection_adjacency_list);
-        FindCycles(cycle_set, optimal_R/128, nclus_to_add*10, projection_adjacency_list);
+        FindCycles(cycle_set, optimal_R, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/2, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/4, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/8, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/16, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/32, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/64, nclus_to_add*10, projection_graph);
+        FindCycles(cycle_set, optimal_R/128, nclus_to_add*10, projection_graph);
     }
 
     clock_t end_time = clock();
@@ -1659,7 +1770,7 @@ MPLPIndexType TightenCycle(MPLPAlg & mplp, MPLPIndexType nclus_to_add,  std::map
     for (MPLPIndexType z = 0; z < cycle_set.size() && nClustersAdded < nclus_to_add; z++) {
 
         // Check to see if there are any duplicate nodes, and, if so, shortcut
-        //    shortcut(cycle_set[z], projection_imap_var, projection_edge_weights, num_projection_nodes);
+        //    shortcut(cycle_set[z], projection_imap_var, projection_graph, num_projection_nodes);
 
         // Output the cycle
         if (MPLP_DEBUG_MODE){
@@ -1684,7 +1795,6 @@ MPLPIndexType TightenCycle(MPLPAlg & mplp, MPLPIndexType nclus_to_add,  std::map
         std::cout << " -- shortcut + add_cycles. Took " << total_time << " seconds" << std::endl;
     }
 
-    delete_projection_graph(/*mplp.m_var_sizes.size(), projection_map, projection_imap_var, projection_adjacency_list,*/ array_of_sij);
     return nClustersAdded;
 }
 
@@ -0,0 +1,61 @@
+/*
+ *  indexed_heap.h
+ *  mplp
+ *
+ *  Binary min-heap over the items 0..n-1, each in the heap at most once, with its position
+ *  kept so that the key of an item can be changed in place (see MPLPAlg::RunGlobalDecoding2).
+ *  Items with equal keys come out in increasing order of a second key, the tie, given when
+ *  the item is pushed.
+ *
+ */
+#ifndef MPLP_INDEXED_HEAP_H
+#define MPLP_INDEXED_HEAP_H
+
+#include <vector>
+
+#include <MPLP/mplp_config.h>
+
+namespace mplpLib {
+
+class IndexedMinHeap
+{
+public:
+    // Empties the heap, for items 0..n-1
+    void Reset(MPLPIndexType n);
+
+    bool Empty() const {return m_heap.empty();}
+    MPLPIndexType Size() const {return m_heap.size();}
+    bool Contains(MPLPIndexType item) const {return m_pos[item] != NOT_IN_HEAP;}
+
+    // Item with the smallest key, and that key
+    MPLPIndexType Top() const {return m_heap[0].item;}
+    double TopKey() const {return m_heap[0].key;}
+
+    // Push adds an item that is not in the heap. Update changes the key of one that is, keeping its tie.
+    void Push(MPLPIndexType item, double key, unsigned int tie = 0);
+    void Update(MPLPIndexType item, double key);
+    void Pop();
+    void Remove(MPLPIndexType item);
+
+private:
+    static const MPLPIndexType NOT_IN_HEAP = (MPLPIndexType)-1;
+
+    struct Entry
+    {
+        double key;
+        unsigned int tie;
+        MPLPIndexType item;
+        bool operator<(const Entry & e) const {return key < e.key || (key == e.key && tie < e.tie);}
+    };
+
+    void SiftUp(MPLPIndexType pos);
+    void SiftDown(MPLPIndexType pos);
+    void Place(MPLPIndexType pos, const Entry & e) {m_heap[pos] = e; m_pos[e.item] = pos;}
+
+    std::vector<Entry> m_heap;
+    std::vector<MPLPIndexType> m_pos;    // position of every item in m_heap, or NOT_IN_HEAP
+};
+
+} // namespace mplpLib
+
+#endif
@@ -14,42 +14,162 @@
 #include <fstream>
 #include <set>
 #include <map>
+#include <deque>
 
 #include <MPLP/mplp_config.h>
 #include <MPLP/muldim_arr.h>
 #include <MPLP/read_model_file.h>
+#include <MPLP/thread_pool.h>
+#include <MPLP/checkpoint.h>
+#include <MPLP/set_map.h>
 
 namespace mplpLib {
 
+// rand(), counting the draws. The solver draws all of its random numbers with it, so that
+// MPLPAlg::ReadCheckpoint can put the generator where it was when the checkpoint was written.
+int Rand();
+unsigned long RandDraws();
+
 #define MPLP_MIN_APP_TIME .0001  //amount of time reserved for appending an answer into a file (to prevent any partially written answers)
 
-class Region
+struct MPLPTopology;
+
+// Read-only view of n consecutive entries of an array owned elsewhere
+template <typename T> struct ArrayView
 {
-public:
-    // The variables in the region
-    std::vector<MPLPIndexType> m_region_inds;
+    const T *m_ptr;
+    MPLPIndexType m_n;
+
+    ArrayView() : m_ptr(NULL), m_n(0) {}
+    ArrayView(const T *ptr, MPLPIndexType n) : m_ptr(ptr), m_n(n) {}
+    MPLPIndexType size() const {return m_n;}
+    bool empty() const {return m_n == 0;}
+    const T & operator[](MPLPIndexType i) const {return m_ptr[i];}
+    const T *begin() const {return m_ptr;}
+    const T *end() const {return m_ptr + m_n;}
+};
+
+// Read-only view of n lists stored one after the other: list i is m_dat[m_begin[i]] up to
+// m_dat[m_begin[i+1]-1]
+struct ListsView
+{
+    const MPLPCompactIndexType *m_begin, *m_dat;
+    MPLPIndexType m_n;
 
-    // Specifies the indices of the intersection sets
-    std::vector<MPLPIndexType> m_intersect_inds;
+    ListsView() : m_begin(NULL), m_dat(NULL), m_n(0) {}
+    ListsView(const MPLPCompactIndexType *begin, const MPLPCompactIndexType *dat, MPLPIndexType n) : m_begin(begin), m_dat(dat), m_n(n) {}
+    MPLPIndexType size() const {return m_n;}
+    ArrayView<MPLPCompactIndexType> operator[](MPLPIndexType i) const {return ArrayView<MPLPCompactIndexType>(m_dat + m_begin[i], m_begin[i+1] - m_begin[i]);}
+};
 
-    // Specifies the indices corresponding to the position of each
-    // intersection set in the region
-    std::vector<std::vector<MPLPIndexType> > m_inds_of_intersects;
+class Region
+{
+public:
+    // The variables in the region, their sizes, the indices of its intersection sets, and the
+    // positions in the region of the variables of each intersection set. These are views of the
+    // arrays of MPLPTopology (see Bind).
+    ArrayView<MPLPCompactIndexType> m_region_inds;
+    ArrayView<MPLPLabelType> m_var_sizes;
+    ArrayView<MPLPCompactIndexType> m_intersect_inds;
+    ListsView m_inds_of_intersects;
 
     // Every region has a corresponding intersection set. What is its index?
     MPLPIndexType m_region_intersect;
 
-    // Contains the messages from each region to its intersection sets
-    std::vector<MulDimArr> m_msgs_from_region;
-    std::vector<MPLPIndexType> m_var_sizes;
+    // Precomputed strides for expanding each intersection set into the region
+    std::vector<ExpandPlan> m_expand_plans;
+
+    // Precomputed strides for maximizing the region into all of its intersection sets
+    MarginalPlan m_marginal_plan;
+
+    // Region ri of topology
+    Region(const MPLPTopology & topology, MPLPIndexType ri);
+
+    // Points the views at region ri of topology. Needed again whenever the arrays of the
+    // topology move (see MPLPTopology::AddRegion).
+    void Bind(const MPLPTopology & topology, MPLPIndexType ri);
+
+    // Adds the intersection sets which region ri of topology has beyond those of this region
+    // (see MPLPTopology::AddRegionIntersectionSets)
+    void AddIntersectionSets(const MPLPTopology & topology, MPLPIndexType ri);
+
+    // The updates only read the region, so that several instances can update it at once (see
+    // MPLPAlg::InitTrial). msgs are the messages from the region to each of its intersection sets
+    // (see MPLPAlg::m_msgs). The work space is kept per thread. UpdateMsgs picks one of the updates
+    // below according to the kind of the region (see MarginalPlan).
+    void UpdateMsgs(std::vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const;
+    // With a positive temperature, the max-marginals are replaced by soft-max marginals at that
+    // temperature (see MPLPAlg::m_temperature)
+    void UpdateMsgsGeneric(std::vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs, double temperature = 0) const;
+    void UpdateMsgsPair(std::vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const;     // edge -> its two nodes
+    void UpdateMsgsTriplet(std::vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const;  // triplet -> its three edges
+    MPLPIndexType Get_nVars() const {return m_var_sizes.size();};
+};
 
-    Region(const std::vector<MPLPIndexType> & region_inds, const std::vector<std::vector<MPLPIndexType> > & all_intersects, const std::vector<MPLPIndexType> & intersect_inds, const std::vector<MPLPIndexType> & var_sizes, MPLPIndexType region_intersect);
+// The region graph in flat (CSR) arrays with 32-bit indices. The variables of region r are
+// m_vars[m_var_begin[r]] up to m_vars[m_var_begin[r+1]-1], with their sizes at the same places of
+// m_region_var_sizes, and likewise for its intersection sets in m_intersects. The k-th entry of
+// m_intersects has the positions of its variables in the region at m_positions[m_position_begin[k]]
+// up to m_positions[m_position_begin[k+1]-1]. The Region objects only hold views of these arrays.
+//
+// Regions are also colored so that no two regions of one color touch the same intersection set
+// (their own, or one they send messages to). The updates of the regions of one color then do
+// not read or write each other's tables, and can run in any order or at the same time.
+// Coloring is greedy in region order: each added region takes the smallest free color.
+struct MPLPTopology
+{
+    std::vector<MPLPCompactIndexType> m_var_begin, m_vars;
+    std::vector<MPLPLabelType> m_region_var_sizes;
+    std::vector<MPLPCompactIndexType> m_intersect_begin, m_intersects;
+    std::vector<MPLPCompactIndexType> m_position_begin, m_positions;
+    std::vector<MPLPCompactIndexType> m_region_intersect;
+    std::vector<unsigned char> m_kind;                    // MarginalPlan::Kind of each region
+    std::vector<MPLPLabelType> m_var_sizes;
+    std::vector<MPLPCompactIndexType> m_singleton_var;    // per intersection set; MPLP_NOT_SINGLETON if not a single variable
+    std::vector<MPLPCompactIndexType> m_color;            // per region
+    std::vector<std::vector<MPLPCompactIndexType> > m_color_classes;     // regions of each color, in increasing order
+    std::vector<std::vector<MPLPCompactIndexType> > m_intersect_regions; // regions touching each intersection set
+    // Factors (regions with a potential) containing each variable, and the stride of the variable in
+    // the factor's table: m_factors[m_factor_begin[v]] up to m_factors[m_factor_begin[v+1]-1]. The
+    // strides are full-width, as tables may have more than 2^32 entries.
+    std::vector<MPLPCompactIndexType> m_factor_begin, m_factors;
+    std::vector<MPLPIndexType> m_factor_strides;
+    // Edge regions (of kind PAIR) covered by chains whose variables increase along the chain (see
+    // BuildChains): m_in_chain marks the edges in a chain, and m_var_chains counts the chains
+    // through each variable.
+    std::vector<unsigned char> m_in_chain;
+    std::vector<MPLPCompactIndexType> m_var_chains;
+
+    // Starts over with no intersection sets and no regions
+    void Reset(const std::vector<MPLPIndexType> & var_sizes);
+    // Adds a region on the variables region_inds, sending messages to the intersection sets
+    // intersect_inds. Returns true if the arrays viewed by the Region objects moved.
+    bool AddRegion(const std::vector<MPLPIndexType> & region_inds, const std::vector<MPLPIndexType> & intersect_inds, MPLPIndexType region_intersect, const std::vector<std::vector<MPLPIndexType> > & all_intersects);
+    // Adds the intersection sets added[r] to every region r, after those it has, and colors all
+    // regions again. The arrays viewed by the Region objects move.
+    void AddRegionIntersectionSets(const std::vector<std::vector<MPLPIndexType> > & added, const std::vector<std::vector<MPLPIndexType> > & all_intersects);
+    void AddIntersectionSet(const std::vector<MPLPIndexType> & inds_of_vars);
+    void BuildFactorIndex(const std::vector<MulDimArr> & region_lambdas);
+    void BuildChains();
+private:
+    void AppendIntersectionSet(const std::vector<MPLPIndexType> & region_inds, const std::vector<MPLPIndexType> & inds_of_vars);
+    void ColorRegion(MPLPIndexType ri);
+    MPLPIndexType RegionKind(MPLPIndexType ri) const;
+};
 
-    // Adds intersection set to the region
-    void AddIntersectionSet(MPLPIndexType intersect_loc, std::vector<std::vector<MPLPIndexType> > & all_intersects, std::vector<MPLPIndexType> & var_sizes);
+#define MPLP_NOT_SINGLETON 0xffffffffu
+
+// A triangle of edge intersection sets (see MPLPAlg::Triangles), on the variables k < i < j, with
+// the indices of the intersection sets of its edges ij, jk and ki
+struct MPLPTriangle
+{
+    MPLPIndexType i, j, k;
+    MPLPIndexType ij_intersect_loc, jk_intersect_loc, ki_intersect_loc;
 
-    void UpdateMsgs(std::vector<MulDimArr> & sum_into_intersects);
-    MPLPIndexType Get_nVars() {return m_var_sizes.size();};
+    bool operator<(const MPLPTriangle & t) const
+    {
+        return i < t.i || (i == t.i && (j < t.j || (j == t.j && k < t.k)));
+    }
 };
 
 class MPLPAlg
@@ -76,12 +196,27 @@ public:
     std::vector<Region> m_all_regions;
     //	vector<vector<MPLPIndexType> > m_all_region_inds;
     std::vector<MulDimArr> m_sum_into_intersects;
+    // Messages from the regions into their intersection sets, in the order of m_topology.m_intersects
+    // (see Msgs)
+    std::vector<MulDimArr> m_msgs;
     //	vector<MulDimArr> m_all_lambdas;
     //	vector<vector<MPLPIndexType> > m_all_region_intersects;
     std::map<MPLPIndexType, MPLPIndexType> evidence;
+    std::vector<unsigned char> m_is_evidence;    // per variable, set from evidence by MarkEvidence
     std::vector<MPLPIndexType> m_var_sizes;
-    std::vector<MPLPIndexType> m_decoded_res;
-    std::vector<MPLPIndexType> m_best_decoded_res;
+    std::vector<MPLPLabelType> m_decoded_res;    // change with SetDecodedLabel, which keeps the fields below
+    std::vector<MPLPLabelType> m_best_decoded_res;
+
+    bool m_initialized;    // see Initialized
+
+    // Value of m_decoded_res (updated by delta scoring, see SetDecodedLabel), its position in the
+    // table of every factor, and a 64-bit hash of it. m_scored_hash and m_scored_val are those of
+    // the last assignment scored from scratch by UpdateResult.
+    double m_decoded_val;
+    bool m_decoded_val_exact;
+    std::vector<MPLPIndexType> m_decoded_flat;
+    uint64_t m_decoded_hash, m_scored_hash;
+    double m_scored_val;
     std::vector<double> m_objhist;
     std::vector<double> m_inthist;
     std::vector<double> m_timehist;
@@ -91,8 +226,58 @@ public:
     // Is this a CSP instance?
     bool CSP_instance;
 
-    // This map allows us to quickly look up the index of edge intersection sets
-    std::map<std::pair<MPLPIndexType, MPLPIndexType>, MPLPIndexType> m_intersect_map;
+    // Compact copy of the regions and intersection sets, kept up to date as they are added
+    MPLPTopology m_topology;
+
+    // Holds the data of m_sum_into_intersects, the messages and m_region_lambdas (see PackTables)
+    MulDimArrArena m_arena;
+
+    // Threads used by RunMPLP (MPLP_NUM_THREADS, default 1). With more than one, the regions
+    // are updated one color class at a time (see MPLPTopology), each class in parallel.
+    ThreadPool m_pool;
+
+    // Order of the updates in RunMPLP, from the environmental MPLP_SCHEDULE:
+    //  SWEEP    (default) every region in turn, or by color class on several threads
+    //  RESIDUAL ("residual") see m_residual below
+    //  CHAINS   ("chains") a forward and a backward pass over the chains of m_topology (see
+    //           UpdateChains), then every region in turn
+    enum Schedule {SWEEP, RESIDUAL, CHAINS};
+    Schedule m_schedule;
+
+    // Residual scheduling. Instead of sweeping over all regions, RunMPLP updates the regions
+    // whose incoming beliefs changed the most since their last update.
+    // m_residual holds that change for every region (0 once it is up to date). Waiting regions are
+    // queued in buckets by powers of two of their residual, bucket 0 being the largest; an entry is
+    // stale, and skipped, if the region has since moved to another bucket or been updated.
+    std::vector<double> m_residual;
+    std::vector<std::deque<MPLPCompactIndexType> > m_residual_buckets;
+    std::vector<MPLPValueType> m_old_msgs;    // work space
+
+    // Smoothing. While m_temperature is positive, RunMPLP updates every region in turn with the
+    // max-marginals replaced by soft-max marginals at that temperature, which moves the messages
+    // across the plateaus where the max updates are stuck. The temperature starts at the
+    // environmental MPLP_SMOOTHING (default 0: no smoothing) and is lowered each time the dual
+    // decrease per iteration falls below it (times MPLP_ANNEAL_DEL), until it drops to 0 and the
+    // usual updates take over. Reported objectives are always those of the (hard) dual.
+    double m_temperature;
+
+    // Propagation after a clamp in the global decoders. With m_decoding_radius 0 (the default), all
+    // regions are swept MPLP_DECODING_SWEEPS times. Otherwise only the regions within that many steps
+    // of the clamped variables are (from the environmental MPLP_DECODING_RADIUS), until their messages
+    // settle. See PropagateClamps.
+    MPLPIndexType m_decoding_radius;
+
+    // Maximum of each intersection set as of the last LocalDecode, and their sum (the dual
+    // objective). Intersection sets changed since then are listed in m_changed_intersects, so
+    // that LocalDecode(true) only has to look at those. Only valid within one RunMPLP call.
+    std::vector<double> m_intersect_max;
+    double m_dual_obj;
+    bool m_intersect_max_valid;
+    std::vector<MPLPCompactIndexType> m_changed_intersects;
+    std::vector<unsigned char> m_intersect_changed;
+
+    // Whether AddAllEdgeIntersections has been called
+    bool m_all_edge_intersections;
 
     //create an MPLP instance from the model file and evidence file (if any)
     MPLPAlg(clock_t, clock_t, const std::string, const std::string, FILE *, bool uaiCompetition);
@@ -100,23 +285,50 @@ public:
     // create an MPLP instance from the model given by var_sizes, all_factors and all_lambdas
     MPLPAlg(clock_t start, clock_t time_limit, const std::vector<MPLPIndexType>& var_sizes, const std::vector< std::vector<MPLPIndexType> >& all_factors, const std::vector< std::vector<double> >& all_lambdas, FILE *log_file, bool uaiCompetition);
 
-    MPLPAlg(void){};     //for decoding purpose only
+    MPLPAlg(void) : m_initialized(false), m_decoded_val(0), m_decoded_val_exact(false), m_decoded_hash(0), m_scored_hash(0), m_scored_val(0), m_schedule(SWEEP), m_temperature(0), m_decoding_radius(0), m_dual_obj(0), m_intersect_max_valid(false), m_all_edge_intersections(false), m_undo_count(0), m_trial_parent(NULL), m_trial_seed(0), m_triangles_sorted(true) {};     //for decoding purpose only
 
-    void Init(const std::string, const std::string = "");
+    // The Init functions return false, and build nothing, if a variable has more than MPLP_MAX_LABELS states
+    bool Init(const std::string, const std::string = "");
 
-    void Init2(const std::string, const std::string = "");
+    bool Init2(const std::string, const std::string = "");
 
-    void Init(const std::vector<MPLPIndexType> & var_sizes, const std::vector<std::vector<MPLPIndexType> > & all_region_inds, const std::vector<std::vector<double> > & all_lambdas);
+    bool Init(const std::vector<MPLPIndexType> & var_sizes, const std::vector<std::vector<MPLPIndexType> > & all_region_inds, const std::vector<std::vector<double> > & all_lambdas);
+
+    // Whether the constructor could build the model (see Init)
+    bool Initialized() const {return m_initialized;}
 
     void RunMPLP(MPLPIndexType, double, double);
 
-    double IntVal(std::vector<MPLPIndexType> & assignment) const;
+    double IntVal(const std::vector<MPLPLabelType> & assignment) const;
+
+    // Values of n assignments at once, each summed exactly as by IntVal. labels is column-major:
+    // the label of variable v in assignment a is labels[v*n + a].
+    void IntValBatch(const MPLPLabelType *labels, MPLPIndexType n, double *values) const;
+
+    // Sets the label of var in m_decoded_res, re-scoring only the factors that contain it
+    void SetDecodedLabel(MPLPIndexType var, MPLPLabelType label);
+    // Recomputes m_decoded_val, m_decoded_flat and m_decoded_hash from m_decoded_res
+    void ResetDecodedScore();
 
     double gap(MPLPIndexType, MPLPIndexType &) const;
 
+    // Undo log for the global decoders, which change the messages and beliefs for a while and then
+    // put them back. BeginUndo opens a level. Before a table is changed, TouchRegion (for the messages
+    // of a region and all the intersection sets its update writes) or TouchIntersectionSet must be
+    // called; a table is saved the first time it is touched within the innermost level. Undo puts
+    // back what was saved since the matching BeginUndo and closes the level. Levels nest.
+    void BeginUndo();
+    void TouchRegion(MPLPIndexType ri);
+    void TouchIntersectionSet(MPLPIndexType si);
+    void Undo();
+
     // argument specifies whether to go one by one (true) or to do in blocks (false), which is faster
     void RunGlobalDecoding(bool);
     void RunGlobalDecoding2(bool);
+    // Runs both decoders on randomly perturbed copies of the beliefs (MPLP_DECODING_TRIALS of them,
+    // the last one exhaustive). Every trial decodes on its own copy of the messages and beliefs
+    // (see InitTrial) with its own random numbers, so that the trials run on all threads of m_pool.
+    // The result of a trial is merged, and written, once all earlier trials are.
     void RunGlobalDecoding3(void);
 
     // returns false if no more variables are left to decimate
@@ -129,13 +341,35 @@ public:
     // intersect with it
     MPLPIndexType AddIntersectionSet(std::vector<MPLPIndexType> & inds_of_vars);
 
+    // Moves tables added since the last call into m_arena. Called by RunMPLP.
+    void PackTables();
+
     // For regions of size >2, remove single node intersection sets and add all edge intersection sets
     void AddAllEdgeIntersections();
 
-    // Find the index number into m_all_intersects of a given set of variables' intersection set.
-    // Returns -1 if not found.
+    // All triangles of edge intersection sets, sorted by i, j, then k. Kept up to date as edge
+    // intersection sets are added (sorting again only after new ones).
+    const std::vector<MPLPTriangle> & Triangles();
+
+    // For every variable, its neighbours through edge intersection sets in increasing order, each
+    // with the index of the (first) intersection set of the edge
+    const std::vector<std::vector<std::pair<MPLPIndexType, MPLPIndexType> > > & EdgeAdjacency() const {return m_edge_adjacency;}
+
+    // Find the index number into m_all_intersects of a given set of variables' intersection set
+    // (the first one, if there are several). Returns -1 if not found.
     int FindIntersectionSet(std::vector<MPLPIndexType> & inds_of_vars);
 
+    // Checkpoints. WriteCheckpoint takes a snapshot of the intersection sets, the regions and their
+    // messages, m_sum_into_intersects, the evidence and the incumbent, and writes it to fname in the
+    // background (see CheckpointWriter). While the previous checkpoint is still being written, the
+    // snapshot waits for it, replacing any older snapshot that is waiting too. WaitCheckpoint returns
+    // once every snapshot is written, and false if the last write failed. ReadCheckpoint restores a
+    // checkpoint of the same model into an instance that has just been built from it. It returns
+    // false, and changes nothing, if the file is not such a checkpoint.
+    void WriteCheckpoint(const std::string & fname);
+    bool WaitCheckpoint();
+    bool ReadCheckpoint(const std::string & fname);
+
     void Write(/*const char *res_fname, const char *msgs_fname = "msgs.txt", const char *suminto_fname = "suminto.txt", const char *objhist_fname = "objhist.txt", const char *inthist_fname = "inthist.txt", const char *timehist_fname = "timehist.txt"*/);
 private:
     std::string _res_fname;
@@ -144,8 +378,85 @@ private:
     std::ifstream rnd_seed;
     clock_t start;
     clock_t time_limit;
-    double LocalDecode(void);      //single node decoding
+    CheckpointWriter m_checkpoint_writer;
+
+    // Undo log (see BeginUndo). Every saved table has an entry pointing at its copy in m_undo_values.
+    // m_undo_stamp holds, for every intersection set and then every region, the level it was last saved
+    // in (levels are numbered as they are opened, starting from 1); entries keep the stamp they replaced.
+    struct UndoEntry
+    {
+        MPLPIndexType table, offset, prev_stamp;
+    };
+    std::vector<UndoEntry> m_undo_entries;
+    std::vector<MPLPValueType> m_undo_values;
+    std::vector<MPLPIndexType> m_undo_stamp;
+    std::vector<std::pair<MPLPIndexType, MPLPIndexType> > m_undo_levels;    // number of entries when opened, and the level's number
+    MPLPIndexType m_undo_count;    // levels opened so far
+    std::vector<char> m_checkpoint_buf;    // work space for WriteCheckpoint
+
+    // Decoding trials (see RunGlobalDecoding3). A trial is an instance made by InitTrial: it has its
+    // own messages, beliefs, evidence and decoding, and reads the regions, the topology and the
+    // potentials of its parent. A trial keeps the best assignment it finds; the trials go to the
+    // parent through MergeIncumbent in trial order, so the incumbent does not depend on the threads.
+    // TrialRand draws from rand_r(m_trial_seed) in trials and is Rand() otherwise.
+    MPLPAlg *m_trial_parent;
+    unsigned int m_trial_seed;
+    MulDimArrArena m_trial_arena;    // holds the tables of a trial
+    void InitTrial(MPLPAlg & parent, unsigned int seed, double best_val);
+    int TrialRand();
+    void MergeIncumbent(const std::vector<MPLPLabelType> & res, double val);
+
+    // Updates the regions around the variables just clamped by a global decoder (see m_decoding_radius),
+    // decoding after every sweep. Returns the number of sweeps; the regions updated are left in
+    // m_propagated, in increasing order.
+    MPLPIndexType PropagateClamps(const std::vector<MPLPIndexType> & clamped);
+    std::vector<MPLPCompactIndexType> m_propagated;
+    std::vector<unsigned char> m_propagate_mark;    // work space
+
+    // The regions and their topology, which a trial reads from its parent
+    const std::vector<Region> & Regions() const {return m_trial_parent != NULL ? m_trial_parent->m_all_regions : m_all_regions;}
+    const MPLPTopology & Topology() const {return m_trial_parent != NULL ? m_trial_parent->m_topology : m_topology;}
+    // The messages of region ri, one for each of its intersection sets
+    MulDimArr *Msgs(MPLPIndexType ri) {return &m_msgs[Topology().m_intersect_begin[ri]];}
+    // Sets m_is_evidence from evidence
+    void MarkEvidence();
+
+    // Adds a region to m_topology and to m_all_regions, with zero messages, pointing the views of
+    // all regions at the topology again if its arrays moved
+    void PushRegion(const std::vector<MPLPIndexType> & region_inds, const std::vector<MPLPIndexType> & intersect_inds, MPLPIndexType region_intersect);
+    // Adds the intersection sets added[r], with zero messages, to every region r (see
+    // MPLPTopology::AddRegionIntersectionSets)
+    void AddRegionIntersectionSets(const std::vector<std::vector<MPLPIndexType> > & added);
+    // Appends a zero message into the intersection set si to m_msgs
+    void PushZeroMsg(MPLPIndexType si);
+
+    // Every intersection set, with its variables sorted, mapped to its index (the first one if a
+    // set is added twice). Kept up to date by IndexIntersectionSet.
+    VarSetMap m_intersect_index;
+    // Adds the intersection set si to m_intersect_index and, if it is a new edge, to the triangle index
+    void IndexIntersectionSet(MPLPIndexType si);
+
+    // Triangle index (see Triangles), with m_edge_adjacency as returned by EdgeAdjacency
+    std::vector<std::vector<std::pair<MPLPIndexType, MPLPIndexType> > > m_edge_adjacency;
+    std::vector<MPLPTriangle> m_triangles;
+    bool m_triangles_sorted;
+    // Adds the edge a < b, whose intersection set is loc, to the index
+    void IndexEdge(MPLPIndexType a, MPLPIndexType b, MPLPIndexType loc);
+    // Single node decoding. Returns the dual objective. With only_changed, only the intersection sets
+    // recorded by MarkIntersectionChanged are looked at again (if the cached maxima are valid).
+    double LocalDecode(bool only_changed = false);
+    void MarkIntersectionChanged(MPLPIndexType si);
+    // TRW-S passes over the chain edges of m_topology, in increasing and then decreasing variable order
+    void UpdateChains();
     double UpdateResult(void);   //returns primal objective of this mplp instance
+
+    // Updates up to max_updates regions in order of residual. Returns the number updated,
+    // which is 0 when all regions are up to date.
+    MPLPIndexType RunResidualUpdates(MPLPIndexType max_updates);
+    // Updates region ri and queues the regions reading what it wrote. Returns how much its messages moved.
+    double UpdateResidualRegion(MPLPIndexType ri);
+    // Queues the regions reading intersection set si, whose beliefs changed by about residual
+    void ScheduleIntersectionSet(MPLPIndexType si, double residual);
 };
 
 } // namespace mplpLib
@@ -1,10 +1,30 @@
 #ifndef MPLP_MPLP_CONFIG_H_
 #define MPLP_MPLP_CONFIG_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 namespace mplpLib {
 
 typedef size_t MPLPIndexType;
 
+// Compact types for the flat copy of the region graph (MPLPTopology) and for assignments
+typedef uint32_t MPLPCompactIndexType;
+typedef uint16_t MPLPLabelType;
+#define MPLP_MAX_LABELS 65535
+
+// Type of the entries of messages and beliefs. Building with MPLP_FLOAT_MESSAGES halves the
+// memory traffic of the message updates; objectives and assignment scores are still summed
+// in double. MPLP_VALUE_HUGE replaces MPLP_huge (1e40) for entries which must be ruled out,
+// since 1e40 does not fit in a float.
+#ifdef MPLP_FLOAT_MESSAGES
+typedef float MPLPValueType;
+#define MPLP_VALUE_HUGE 1e30
+#else
+typedef double MPLPValueType;
+#define MPLP_VALUE_HUGE 1e40
+#endif
+
 } // namespace mplpLib
 
 #endif /* MPLP_MPLP_CONFIG_H_ */
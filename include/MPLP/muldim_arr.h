@@ -21,14 +21,94 @@ namespace mplpLib {
 
 #define MPLP_huge 1e40
 #define MPLP_BASE2DEC_PAIR(x1,x2,base1,base2) (x1*base2+x2)
+#define MPLP_MAX_PLAN_DIMS 32  // more variables than this would never fit in memory anyway
+#define MPLP_MAXMARG_FLOOR -1e9  // max-marginals into intersection sets are never below this value
+
+// Precomputed walk over a big (region) array together with one of its sub-arrays
+// (an intersection set). For each dimension of the big array we keep the stride of
+// that variable in the small array, which is 0 if the variable is not in the subset.
+// Adjacent dimensions that can be walked as one are merged, so that the innermost
+// loop is either a contiguous run (stride 1) or a broadcast of a single value (stride 0).
+// Works for subsets of any size and in any order.
+class ExpandPlan
+{
+public:
+    std::vector<MPLPIndexType> m_sizes;     // sizes of the (merged) dimensions of the big array
+    std::vector<MPLPIndexType> m_strides;   // stride of each of these dimensions in the small array
+    MPLPIndexType m_big_prodsize;
+    MPLPIndexType m_small_prodsize;
+
+    ExpandPlan() : m_big_prodsize(0), m_small_prodsize(0) {}
+    ExpandPlan(const std::vector<MPLPIndexType> & var_sizes_big, const std::vector<MPLPIndexType> & inds_of_small_in_big);
+
+    // True if the small array is the big array with the variables in the same order
+    bool IsIdentity() const {return m_big_prodsize == m_small_prodsize && m_sizes.size() == 1 && m_strides[0] == 1;}
+};
+
+// Precomputed layout for maximizing a region table into all of its intersection sets in a single
+// sweep. m_strides[si][d] is the stride of region variable d in intersection set si (0 if absent).
+// Pairwise regions whose intersection sets are their two variables, and triplet regions whose
+// intersection sets are their three edges (as added by the tightening code), get special kernels.
+class MarginalPlan
+{
+public:
+    enum Kind {GENERIC, PAIR, TRIPLET};
+
+    Kind m_kind;
+    std::vector<MPLPIndexType> m_sizes;    // variable sizes of the region
+    std::vector<std::vector<MPLPIndexType> > m_strides;
+    std::vector<bool> m_is_copy;           // intersection set is the region itself, in the same order
+    // PAIR: intersection sets holding variables 0 and 1. TRIPLET: those holding edges 01, 12 and 02.
+    MPLPIndexType m_slot[3];
+
+    MarginalPlan() : m_kind(GENERIC) {}
+    MarginalPlan(const std::vector<MPLPIndexType> & var_sizes_big, const std::vector<std::vector<MPLPIndexType> > & all_subset_inds);
+};
+
+class MulDimArr;
+
+// One 64-byte aligned buffer holding the data of many MulDimArrs, so that the tables used
+// together sit next to each other in memory. Tables of a cache line or more start on a
+// cache-line boundary. Growing the buffer moves it; the caller then re-points its tables
+// (see MPLPAlg::PackTables). Copies of an arena start out empty.
+class MulDimArrArena
+{
+public:
+    MulDimArrArena() : m_raw(NULL), m_base(NULL), m_size(0), m_capacity(0) {}
+    MulDimArrArena(const MulDimArrArena &) : m_raw(NULL), m_base(NULL), m_size(0), m_capacity(0) {}
+    MulDimArrArena & operator=(const MulDimArrArena &) {return *this;}
+    ~MulDimArrArena() {delete [] m_raw;}
+
+    // Room needed for a table of n values, including alignment padding
+    static MPLPIndexType Padded(MPLPIndexType n);
+
+    // Makes room for n more values. Returns the previous start of the buffer if it had
+    // to be moved, and NULL otherwise.
+    MPLPValueType *Reserve(MPLPIndexType n);
+
+    // Copies arr into the arena and makes arr use it. There must be room for it.
+    void Place(MulDimArr & arr);
+    // Makes the empty array arr a copy of from, with its data in the arena. There must be room for it.
+    void PlaceCopy(MulDimArr & arr, const MulDimArr & from);
+
+    MPLPValueType *Data() const {return m_base;}
+    MPLPIndexType Size() const {return m_size;}
+    bool Contains(const MPLPValueType *p) const {return p >= m_base && p < m_base + m_size;}
+
+private:
+    char *m_raw;
+    MPLPValueType *m_base;
+    MPLPIndexType m_size, m_capacity;
+};
 
 class MulDimArr 
 {
 public:
     std::vector<MPLPIndexType> m_base_sizes;
     MPLPIndexType m_n_prodsize;
-    double *m_dat;
-    double *m_ep;
+    MPLPValueType *m_dat;
+    MPLPValueType *m_ep;
+    bool m_owns_data;    // false if m_dat lives in a MulDimArrArena
 
     // Initialize to all zero
     MulDimArr(std::vector<MPLPIndexType> & base_sizes);
@@ -36,24 +116,41 @@ public:
     // Copy constructor
     MulDimArr(const MulDimArr & v);
 
+    // Move constructor. Leaves v empty.
+    MulDimArr(MulDimArr && v) noexcept : m_base_sizes(std::move(v.m_base_sizes)), m_n_prodsize(v.m_n_prodsize), m_dat(v.m_dat), m_ep(v.m_ep), m_owns_data(v.m_owns_data)
+    {
+        v.m_n_prodsize = 0;
+        v.m_dat = NULL;
+        v.m_ep = NULL;
+        v.m_owns_data = true;
+    }
+
     MulDimArr()
     {
         m_n_prodsize = 0;
         m_dat = NULL;
+        m_ep = NULL;
+        m_owns_data = true;
     };
     ~MulDimArr()
     {
-        if (m_dat!=NULL)
+        if (m_dat!=NULL && m_owns_data)
             delete [] m_dat;
     }
 
+    // Points the array at p, which must hold m_n_prodsize values that outlive the array.
+    // If the array owned its data, it is copied to p first and released.
+    void UseExternalData(MPLPValueType *p);
+
+    // Reuses the current buffer if it already has the right size (also if it lives in an arena)
     MulDimArr & operator=(const MulDimArr & v);
+    MulDimArr & operator=(MulDimArr && v) noexcept;
     MulDimArr & operator=(double val);
     MulDimArr & operator*=(double val);
     MulDimArr & operator+=(MulDimArr & v);
     MulDimArr & operator-=(MulDimArr & v);
-    double & operator[](MPLPIndexType i) {return m_dat[i];}
-    const double & operator[](MPLPIndexType i) const {return m_dat[i];}
+    MPLPValueType & operator[](MPLPIndexType i) {return m_dat[i];}
+    const MPLPValueType & operator[](MPLPIndexType i) const {return m_dat[i];}
     double Max(MPLPIndexType &max_at) const;
     double Entropy(void) const;
     double Entropy_over_free_variables(const std::vector<MPLPIndexType> &, const std::vector<MPLPIndexType> &) const;
@@ -71,15 +168,26 @@ public:
     void ExpandAndAdd(MulDimArr & big_to_add_to, std::vector<MPLPIndexType> & inds_of_small_in_big);
     void ExpandAndSubtract(MulDimArr & big_to_add_to, std::vector<MPLPIndexType> & inds_of_small_in_big);
 
+    // Same as above, but using a plan precomputed for this (big, small) pair
+    MulDimArr Expand(std::vector<MPLPIndexType> & var_sizes_big, const ExpandPlan & plan) const;
+    void ExpandAndAdd(MulDimArr & big_to_add_to, const ExpandPlan & plan) const;
+    void ExpandAndSubtract(MulDimArr & big_to_sub_from, const ExpandPlan & plan) const;
+
     inline void BaseInc(std::vector<MPLPIndexType> & inds) const;
     inline void BaseIncSpecial(std::vector<MPLPIndexType> & inds) const;
 
     void GetInds(MPLPIndexType, std::vector<MPLPIndexType> &) const;    //for decoding purposes
 
     void  max_into_multiple_subsets_special(std::vector<std::vector<MPLPIndexType> > & all_subset_inds, std::vector<MulDimArr> & all_maxes) const;
+    void  max_into_multiple_subsets(const MarginalPlan & plan, MulDimArr *all_maxes) const;
+    // Same, with max replaced by temperature * log(sum(exp(./temperature))). work is scratch space.
+    void  softmax_into_multiple_subsets(const MarginalPlan & plan, MulDimArr *all_maxes, double temperature, std::vector<double> & work) const;
     double max_over_free_variables(const std::vector<MPLPIndexType> &, std::vector<MPLPIndexType> &) const;
     double gap_over_free_variables(const std::vector<MPLPIndexType> &, std::vector<MPLPIndexType> &, double &, double &) const;
 private:
+    void _max_into_pair(const MarginalPlan & plan, MulDimArr *all_maxes) const;
+    void _max_into_triplet_edges(const MarginalPlan & plan, MulDimArr *all_maxes) const;
+    void _max_into_generic(const MarginalPlan & plan, MulDimArr *all_maxes) const;
     double _max_over_free_variables(MPLPIndexType, MPLPIndexType, MPLPIndexType, MPLPIndexType, const std::vector<MPLPIndexType> &, std::vector<MPLPIndexType> &) const;
     void _Entropy_over_free_variables(MPLPIndexType, MPLPIndexType, MPLPIndexType, MPLPIndexType, const std::vector<MPLPIndexType> &, const std::vector<MPLPIndexType> &, double &, double &) const;
 };
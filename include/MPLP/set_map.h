@@ -0,0 +1,60 @@
+/*
+ *  set_map.h
+ *  mplp
+ *
+ *  Open-addressing hash map from sets of variables to indices (see MPLPAlg::FindIntersectionSet
+ *  and the triplet sets of the tightening in cycle.h). Sets are given with their variables in
+ *  increasing order. Sets of up to three variables are packed into a single 64-bit key; larger
+ *  ones are hashed and kept in a pool to compare against.
+ *
+ */
+#ifndef MPLP_SET_MAP_H
+#define MPLP_SET_MAP_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <MPLP/mplp_config.h>
+
+namespace mplpLib {
+
+class VarSetMap
+{
+public:
+    static const MPLPIndexType NOT_FOUND = (MPLPIndexType)-1;
+
+    VarSetMap() : m_size(0) {}
+
+    void Clear();
+    MPLPIndexType Size() const {return m_size;}
+
+    // Index of the set vars[0..n-1], or NOT_FOUND
+    MPLPIndexType Find(const MPLPIndexType * vars, MPLPIndexType n) const;
+    MPLPIndexType Find(const std::vector<MPLPIndexType> & vars) const {return Find(vars.empty() ? NULL : &vars[0], vars.size());}
+
+    // Maps the set to value (which may not be NOT_FOUND) unless it is already in the map.
+    // Returns whether it was added.
+    bool Insert(const MPLPIndexType * vars, MPLPIndexType n, MPLPIndexType value);
+    bool Insert(const std::vector<MPLPIndexType> & vars, MPLPIndexType value) {return Insert(vars.empty() ? NULL : &vars[0], vars.size(), value);}
+
+private:
+    struct Slot
+    {
+        uint64_t key;
+        MPLPIndexType value;    // NOT_FOUND if the slot is empty
+        MPLPIndexType pool;     // offset of the set in m_pool, or NOT_FOUND if key is the set itself
+    };
+
+    // Packs the set into key, exactly if it is small enough (then returns true), or else hashes it
+    static bool Key(const MPLPIndexType * vars, MPLPIndexType n, uint64_t & key);
+    bool Matches(const Slot & s, uint64_t key, const MPLPIndexType * vars, MPLPIndexType n) const;
+    void Grow();
+
+    std::vector<Slot> m_slots;              // a power of two of them, at most half full
+    std::vector<MPLPIndexType> m_pool;      // size of every large set followed by its variables
+    MPLPIndexType m_size;
+};
+
+} // namespace mplpLib
+
+#endif
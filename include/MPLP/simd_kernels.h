@@ -0,0 +1,44 @@
+/*
+ *  simd_kernels.h
+ *  mplp
+ *
+ *  Vectorised inner loops used by MulDimArr. The implementation is picked once,
+ *  at the first call, from what the CPU supports (AVX-512, AVX2, SSE4.1, or plain
+ *  scalar code). Setting the environmental MPLP_SIMD to one of "avx512", "avx2",
+ *  "sse4" or "scalar" caps the choice, which is useful for comparing results.
+ *
+ */
+#ifndef MPLP_SIMD_KERNELS_H
+#define MPLP_SIMD_KERNELS_H
+
+#include <MPLP/mplp_config.h>
+
+namespace mplpLib {
+
+#define MPLP_EXP_MIN -708.0  // exp() of anything smaller is taken to be 0 (2^-1022 is the smallest normal double)
+
+struct SimdKernels {
+    const char *name;
+    void (*add)(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n);  // dst += src
+    void (*sub)(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n);  // dst -= src
+    void (*scale)(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n);       // dst *= val
+    void (*fill)(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n);        // dst = val
+    // Returns the maximum of src[0..n-1] and sets max_at to its position. On ties the
+    // last position wins, as in the original scalar loop. n must be positive.
+    MPLPValueType (*argmax)(const MPLPValueType *src, MPLPIndexType n, MPLPIndexType &max_at);
+    // acc[a] += table[idx[a]] for a in 0..n-1, in double (see MPLPAlg::IntValBatch). The vector
+    // versions gather with signed 32-bit offsets, so idx[a] must be below 2^31.
+    void (*gather_add)(double *acc, const MPLPValueType *table, const MPLPCompactIndexType *idx, MPLPIndexType n);
+    // Sum of exp(scale*(src[a] - shift)) for a in 0..n-1, and acc[a] += exp(scale*(src[a] - shift[a])),
+    // in double (see MulDimArr::softmax_into_multiple_subsets). Exponents below MPLP_EXP_MIN give 0.
+    double (*sum_exp)(const MPLPValueType *src, MPLPValueType shift, double scale, MPLPIndexType n);
+    void (*acc_exp)(double *acc, const MPLPValueType *src, const MPLPValueType *shift, double scale, MPLPIndexType n);
+    // acc[a] = std::max(acc[a], row + src[a]) for a in 0..n-1, NaNs and ties included (see scoreTriangle in cycle.h)
+    void (*max_add)(double *acc, double row, const double *src, MPLPIndexType n);
+};
+
+const SimdKernels & GetSimdKernels();
+
+} // namespace mplpLib
+
+#endif
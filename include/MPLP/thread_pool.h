@@ -0,0 +1,72 @@
+/*
+ *  thread_pool.h
+ *  mplp
+ *
+ *  A small pool of worker threads for running loops whose iterations are independent
+ *  (see MPLPAlg::RunMPLP). The calling thread takes part in the work, so a pool of
+ *  size 1 has no workers and runs everything in place. The workers are started at the
+ *  first parallel loop. Copies of a pool have the same size but their own threads.
+ *
+ */
+#ifndef MPLP_THREAD_POOL_H
+#define MPLP_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <ctime>
+
+#include <MPLP/mplp_config.h>
+
+namespace mplpLib {
+
+// Number of threads requested by the environmental MPLP_NUM_THREADS: a positive number, or
+// "0"/"auto" for one per core. Defaults to 1.
+MPLPIndexType DefaultThreadCount();
+
+// Wall-clock time, in clock() ticks from an arbitrary origin. clock() adds up the CPU time of
+// all threads, so the solver measures its time limit and the time spent decoding with this.
+clock_t WallClock();
+
+class ThreadPool
+{
+public:
+    explicit ThreadPool(MPLPIndexType n_threads = DefaultThreadCount());
+    ThreadPool(const ThreadPool & p);
+    ThreadPool & operator=(const ThreadPool & p);
+    ~ThreadPool();
+
+    // Number of threads used by ParallelFor, including the calling one
+    MPLPIndexType Size() const {return m_size;}
+    void Resize(MPLPIndexType n_threads);
+
+    // Calls body(begin, end) on consecutive chunks of [0, n) of about grain iterations each,
+    // and returns when all of them are done. Loops of fewer than two chunks run in place.
+    void ParallelFor(MPLPIndexType n, MPLPIndexType grain, const std::function<void(MPLPIndexType, MPLPIndexType)> & body);
+
+private:
+    void Start();
+    void Stop();
+    void WorkerLoop();
+    void RunChunks();
+
+    MPLPIndexType m_size;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    bool m_quit;
+    unsigned long m_generation;        // bumped for every loop handed to the workers
+    MPLPIndexType m_busy;              // workers still working on the current loop
+
+    // The current loop
+    const std::function<void(MPLPIndexType, MPLPIndexType)> *m_body;
+    MPLPIndexType m_n, m_grain;
+    std::atomic<MPLPIndexType> m_next;
+};
+
+} // namespace mplpLib
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ *  checkpoint.cpp
+ *  mplp
+ *
+ *  See checkpoint.h.
+ *
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <MPLP/checkpoint.h>
+
+using namespace std;
+
+void mplpLib::CheckpointWriter::Start(const string & fname, vector<char> & data)
+{
+    unique_lock<mutex> lock(m_mutex);
+    // An older buffer still waiting is replaced
+    m_pending_fname = fname;
+    m_pending_data.swap(data);
+    data.clear();
+    m_pending = true;
+    if (m_busy)
+        return;
+    m_busy = true;
+    lock.unlock();
+    // The previous thread has nothing left to do, but may not have returned yet
+    if (m_thread.joinable())
+        m_thread.join();
+    m_thread = thread(&CheckpointWriter::Run, this);
+}
+
+void mplpLib::CheckpointWriter::Run()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (m_pending){
+        m_fname.swap(m_pending_fname);
+        m_data.swap(m_pending_data);
+        m_pending = false;
+        lock.unlock();
+        const bool ok = WriteFile(m_fname, m_data);
+        lock.lock();
+        m_ok = ok;
+    }
+    m_busy = false;
+}
+
+bool mplpLib::CheckpointWriter::Wait()
+{
+    // The thread only returns once no buffer is pending
+    if (m_thread.joinable())
+        m_thread.join();
+    return m_ok;
+}
+
+bool mplpLib::CheckpointWriter::WriteFile(const string & fname, const vector<char> & data)
+{
+    const string tmp = fname + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    for (MPLPIndexType done = 0; done < data.size(); ){
+        ssize_t n = write(fd, &data[done], data.size() - done);
+        if (n <= 0){
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        done+= n;
+    }
+    // The data must be on disk before the rename makes it the checkpoint
+    bool ok = fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), fname.c_str()) != 0){
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool mplpLib::MappedFile::Open(const string & fname)
+{
+    Close();
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return false;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    m_data = (char *)p;
+    m_size = st.st_size;
+    return true;
+}
+
+void mplpLib::MappedFile::Close()
+{
+    if (m_data != NULL)
+        munmap(m_data, m_size);
+    m_data = NULL;
+    m_size = 0;
+}
@@ -9,8 +9,13 @@
  *  Notes:
  *  Setting the environmental INF_TIME to the total number of seconds allowed to
  *  run will result in global decoding being called once 1/3 through, and (if turned
- *  on) decimation being called 2/3 through (very helpful for CSP intances).
+ *  on) decimation being called 2/3 through (very helpful for CSP intances). The
+ *  seconds are wall-clock time, whatever the number of threads.
  *  We did not use this for the UAI 2012 paper (i.e., we did not set INF_TIME).
+ *
+ *  Setting the environmental MPLP_CHECKPOINT to a file name makes the solver write a
+ *  checkpoint there after every run of MPLP, and resume from that file if it already
+ *  exists (it must come from the same model and evidence).
  */
 #include <iostream>
 #include <ctime>
@@ -53,7 +58,7 @@ int main( int argc, char *argv[] ){
     double time_elapsed, /*time,*/ time_limit;
     bool LOG_MODE=false; // default
 
-    clock_t start = clock();
+    clock_t start = WallClock();
     // TODO: consider checking INF_TIME and changing parameters as a result
     char *t = getenv("INF_TIME");
     if (!t) {
@@ -71,7 +76,7 @@ int main( int argc, char *argv[] ){
     bool prevGlobalDecodingWas1 = true;
 
     // Keep track of triplets added so far
-    map<vector<MPLPIndexType>, bool> triplet_set;
+    VarSetMap triplet_set;
 
     /*      // We probably do not need to worry about memory limit yet?
 	char *m = getenv("INF_MEMORY");
@@ -113,9 +118,28 @@ int main( int argc, char *argv[] ){
 
     // Load in the MRF and initialize GMPLP state
     MPLPAlg mplp(start, time_limit, input_file, evidence_file, log_file, lookForCSPs);
-
-    if (MPLP_DEBUG_MODE) cout << "Initially running MPLP for " << niter << " iterations" << endl;
-    mplp.RunMPLP(niter, obj_del_thr, int_gap_thr);
+    if (!mplp.Initialized())
+        return 1;
+
+    char *checkpoint = getenv("MPLP_CHECKPOINT");
+    if (checkpoint && mplp.ReadCheckpoint(checkpoint)) {
+        if (MPLP_DEBUG_MODE) cout << "Resuming from checkpoint " << checkpoint << endl;
+        if(LOG_MODE) fprintf(log_file, "I resumed from %s\n", checkpoint);
+
+        // The triplets added by tightening are the regions with no potential of their own
+        for (MPLPIndexType ri=0; ri<mplp.m_all_regions.size(); ++ri) {
+            if (mplp.m_region_lambdas[ri].m_n_prodsize == 0 && mplp.m_all_regions[ri].m_region_inds.size() == 3) {
+                vector<MPLPIndexType> temp(mplp.m_all_regions[ri].m_region_inds.begin(), mplp.m_all_regions[ri].m_region_inds.end());
+                sort(temp.begin(), temp.end());
+                triplet_set.Insert(temp, triplet_set.Size());
+            }
+        }
+        if (mplp.m_all_edge_intersections) addEdgeIntersections = false;
+    } else {
+        if (MPLP_DEBUG_MODE) cout << "Initially running MPLP for " << niter << " iterations" << endl;
+        mplp.RunMPLP(niter, obj_del_thr, int_gap_thr);
+        if (checkpoint) mplp.WriteCheckpoint(checkpoint);
+    }
 
     for(MPLPIndexType iter=1; iter<MPLP_MAX_TIGHT_ITERS; iter++){  // Break when problem is solved
         if(LOG_MODE) fflush(log_file);
@@ -138,7 +162,7 @@ int main( int argc, char *argv[] ){
         }
 
         // Keep track of global decoding time and run this frequently, but at most 20% of total runtime
-        if(doGlobalDecoding && (((double)clock() - mplp.last_global_decoding_end_time)/CLOCKS_PER_SEC >= mplp.last_global_decoding_total_time*4)) {
+        if(doGlobalDecoding && (((double)WallClock() - mplp.last_global_decoding_end_time)/CLOCKS_PER_SEC >= mplp.last_global_decoding_total_time*4)) {
             // Alternate between global decoding methods
             if(prevGlobalDecodingWas1) {
                 mplp.RunGlobalDecoding(false);
@@ -153,7 +177,7 @@ int main( int argc, char *argv[] ){
         // Tighten LP
         if (MPLP_DEBUG_MODE) cout << "Now attempting to tighten LP relaxation..." << endl;
 
-        clock_t tightening_start_time = clock();
+        clock_t tightening_start_time = WallClock();
         double bound=0; double bound2 = 0;
         MPLPIndexType nClustersAdded = 0;
 
@@ -174,7 +198,7 @@ int main( int argc, char *argv[] ){
         if(max(bound, bound2) < MPLP_CLUSTER_THR)
             noprogress = true;
 
-        clock_t tightening_end_time = clock();
+        clock_t tightening_end_time = WallClock();
         double tightening_total_time = (double)(tightening_end_time - tightening_start_time)/CLOCKS_PER_SEC;
         if (MPLP_DEBUG_MODE) {
             cout << " -- Added " << nClustersAdded << " clusters to relaxation. Took " << tightening_total_time << " seconds" << endl;
@@ -184,7 +208,7 @@ int main( int argc, char *argv[] ){
         }
 
         // For CSP instances, 2/3 through run time, start decimation -- OR, when no progress being made
-        if((mplp.CSP_instance || noprogress) && ((double)(clock() - start) / CLOCKS_PER_SEC) > time_limit*2/3)
+        if((mplp.CSP_instance || noprogress) && ((double)(WallClock() - start) / CLOCKS_PER_SEC) > time_limit*2/3)
             force_decimation = true;
 
         /*
@@ -219,10 +243,11 @@ int main( int argc, char *argv[] ){
 
         if (MPLP_DEBUG_MODE) cout << "Running MPLP again for " << niter_later << " more iterations" << endl;
         mplp.RunMPLP(niter_later, obj_del_thr, int_gap_thr);
+        if (checkpoint) mplp.WriteCheckpoint(checkpoint);   // queued if the previous one is still being written
 
         if(UAIsettings) {
             // For UAI competition: time limit can be up to 1 hour, so kill process if still running.
-            time_elapsed = (double)(clock() - start)/ CLOCKS_PER_SEC;
+            time_elapsed = (double)(WallClock() - start)/ CLOCKS_PER_SEC;
             if (time_elapsed > 4000 && time_elapsed > time_limit + 60) {
                 break;    // terminates if alreay running past time limit (this should be very conservative)
             }
@@ -231,6 +256,12 @@ int main( int argc, char *argv[] ){
         if(LOG_MODE) fflush(log_file);
     }
 
+    // The final state, e.g. after decimation, and everything still queued must be on disk
+    if (checkpoint) {
+        mplp.WriteCheckpoint(checkpoint);
+        if (!mplp.WaitCheckpoint()) cerr << "Could not write the checkpoint " << checkpoint << endl;
+    }
+
     if(LOG_MODE) fflush(log_file);
     if(LOG_MODE) fclose(log_file);
 
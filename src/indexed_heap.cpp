@@ -0,0 +1,93 @@
+/*
+ *  indexed_heap.cpp
+ *  mplp
+ *
+ *  See indexed_heap.h.
+ *
+ */
+
+#include <assert.h>
+
+#include <MPLP/indexed_heap.h>
+
+using namespace std;
+
+const mplpLib::MPLPIndexType mplpLib::IndexedMinHeap::NOT_IN_HEAP;
+
+void mplpLib::IndexedMinHeap::Reset(MPLPIndexType n)
+{
+    m_heap.clear();
+    m_pos.assign(n, NOT_IN_HEAP);
+}
+
+void mplpLib::IndexedMinHeap::Push(MPLPIndexType item, double key, unsigned int tie)
+{
+    assert(!Contains(item));
+    Entry e = {key, tie, item};
+    m_heap.push_back(e);
+    m_pos[item] = m_heap.size() - 1;
+    SiftUp(m_heap.size() - 1);
+}
+
+void mplpLib::IndexedMinHeap::Update(MPLPIndexType item, double key)
+{
+    const MPLPIndexType pos = m_pos[item];
+    assert(pos != NOT_IN_HEAP);
+    const double old = m_heap[pos].key;
+    m_heap[pos].key = key;
+    if (key < old)
+        SiftUp(pos);
+    else if (old < key)
+        SiftDown(pos);
+}
+
+void mplpLib::IndexedMinHeap::Pop()
+{
+    Remove(Top());
+}
+
+void mplpLib::IndexedMinHeap::Remove(MPLPIndexType item)
+{
+    const MPLPIndexType pos = m_pos[item];
+    assert(pos != NOT_IN_HEAP);
+    m_pos[item] = NOT_IN_HEAP;
+    const Entry last = m_heap.back();
+    m_heap.pop_back();
+    if (pos == m_heap.size())
+        return;
+    // The last entry fills the hole, and moves whichever way its key sends it
+    Place(pos, last);
+    SiftUp(pos);
+    SiftDown(m_pos[last.item]);
+}
+
+void mplpLib::IndexedMinHeap::SiftUp(MPLPIndexType pos)
+{
+    const Entry e = m_heap[pos];
+    while (pos > 0){
+        const MPLPIndexType parent = (pos - 1) / 2;
+        if (!(e < m_heap[parent]))
+            break;
+        Place(pos, m_heap[parent]);
+        pos = parent;
+    }
+    Place(pos, e);
+}
+
+void mplpLib::IndexedMinHeap::SiftDown(MPLPIndexType pos)
+{
+    const Entry e = m_heap[pos];
+    const MPLPIndexType n = m_heap.size();
+    for (;;){
+        MPLPIndexType child = 2*pos + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && m_heap[child + 1] < m_heap[child])
+            child++;
+        if (!(m_heap[child] < e))
+            break;
+        Place(pos, m_heap[child]);
+        pos = child;
+    }
+    Place(pos, e);
+}
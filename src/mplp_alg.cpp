@@ -11,13 +11,18 @@
 #include <iostream>
 #include <sstream>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <fstream>
 #include <algorithm>
 #include <list>
 #include <queue>
 #include <stack>
+#include <mutex>
 
 #include <MPLP/mplp_alg.h>
+#include <MPLP/simd_kernels.h>
+#include <MPLP/indexed_heap.h>
 
 using namespace std;
 
@@ -26,100 +31,117 @@ using namespace std;
 // Gap used within decoding algorithm. TODO: Better algorithm for choosing this (perhaps iteratively).
 #define MPLP_GAP_THR .001
 
-/////////////////////////////////////////////////////////////////////////////////////
-// Code to implement the Region object.
-/////////////////////////////////////////////////////////////////////////////////////
+// Number of regions handed to a thread at a time when updating a color class in parallel
+#define MPLP_REGIONS_PER_TASK 64
 
-mplpLib::Region::Region(const vector<MPLPIndexType> & region_inds, const vector<vector<MPLPIndexType> > & all_intersects, const vector<MPLPIndexType> & intersect_inds, const vector<MPLPIndexType> & var_sizes, MPLPIndexType region_intersect): m_region_inds(region_inds), m_intersect_inds(intersect_inds), m_region_intersect(region_intersect)
-{
-    // Find the indices of each intersection within the region. Also intialize the message into that intersection
-    for (MPLPIndexType si=0; si<m_intersect_inds.size(); ++si){
-        vector<MPLPIndexType> tmp_inds_of_intersects;
+// With residual scheduling, message changes below this do not wake up the neighbouring regions
+#define MPLP_RESIDUAL_THR 1e-7
+#define MPLP_RESIDUAL_BUCKETS 64
 
-        vector<MPLPIndexType> curr_intersect = all_intersects[m_intersect_inds[si]];
+// Smoothing (see MPLPAlg::m_temperature): the temperature is multiplied by MPLP_ANNEAL_FACTOR once
+// the dual changes by less than MPLP_ANNEAL_DEL times the temperature in an iteration, and set to 0
+// below MPLP_MIN_TEMPERATURE
+#define MPLP_ANNEAL_DEL 1
+#define MPLP_ANNEAL_FACTOR .5
+#define MPLP_MIN_TEMPERATURE .001
 
-        vector<MPLPIndexType> intersect_var_sizes;
-        // Go over all variables in the intersection set
-        for (MPLPIndexType i=0; i< curr_intersect.size(); ++i){
-            MPLPIndexType var_in_intersect = curr_intersect[i];
-            intersect_var_sizes.push_back(var_sizes[var_in_intersect]);
+// Number of assignments scored together by IntValBatch (sized so that the flat indices stay in cache)
+#define MPLP_BATCH_BLOCK 256
+// Largest factor table IntValBatch reads with gather_add, whose offsets are signed 32-bit
+#define MPLP_GATHER_MAX_TABLE 2147483647u
 
-            vector<MPLPIndexType>::iterator iter = find(m_region_inds.begin(), m_region_inds.end(), var_in_intersect);
+// Decoded assignments whose delta-scored value is within this of the best one are scored from scratch
+#define MPLP_RESCORE_TOL 1e-6
+// Potentials larger than this (in absolute value) make delta scoring inexact
+#define MPLP_RESCORE_MAGNITUDE 1e12
 
+// Perturbed decodings run by RunGlobalDecoding3, the last of them exhaustive
+#define MPLP_DECODING_TRIALS 11
 
-            // Verify that the current intersection variable indeed appears in this region, and get the index where it appears
-            if (iter == m_region_inds.end()){
-                cerr << "Intersection set contains variable " << var_in_intersect << " which is not in region" << endl;
-                return;
-            }
-            else{
-                tmp_inds_of_intersects.push_back(iter-m_region_inds.begin());
-            }
-        }
-        m_inds_of_intersects.push_back(tmp_inds_of_intersects);
+// Sweeps after each clamp in the global decoders. With MPLP_DECODING_RADIUS, the sweeps over the
+// regions near the clamp stop early once no message moves by more than MPLP_DECODING_RESIDUAL.
+#define MPLP_DECODING_SWEEPS 10
+#define MPLP_DECODING_RESIDUAL 1e-6
 
-        // This will initialize the message and  set it to zero
-        MulDimArr curr_msg(intersect_var_sizes);
-        curr_msg = 0;
+namespace {
 
-        m_msgs_from_region.push_back(curr_msg);
-    }
-    // Calculate the size of the region state space (although this should already be in the lambda object, so we should
-    // probably avoid this multiplicity)
-    for (MPLPIndexType i=0; i<region_inds.size(); ++i) {
-        m_var_sizes.push_back(var_sizes[region_inds[i]]);
-    }
+unsigned long rand_draws = 0;
+
+} // namespace
+
+int mplpLib::Rand()
+{
+    rand_draws++;
+    return rand();
 }
 
-void mplpLib::Region::AddIntersectionSet(MPLPIndexType intersect_loc, vector<vector<MPLPIndexType> > & all_intersects, vector<MPLPIndexType> & var_sizes){
-    // Find the indices of intersection within the region. Also intialize the message into that intersection
-    vector<MPLPIndexType> tmp_inds_of_intersects;
-    vector<MPLPIndexType> curr_intersect = all_intersects[intersect_loc];
+unsigned long mplpLib::RandDraws()
+{
+    return rand_draws;
+}
 
-    /*
-	if(MPLP_DEBUG_MODE) {
-	  for (MPLPIndexType i=0; i< curr_intersect.size(); ++i){
-	    MPLPIndexType var_in_intersect = curr_intersect[i];
-	    cout << "   " << var_in_intersect;
-	  }
-	  cout << endl;
-	}
-     */
+/////////////////////////////////////////////////////////////////////////////////////
+// Code to implement the Region object.
+/////////////////////////////////////////////////////////////////////////////////////
 
-    vector<MPLPIndexType> intersect_var_sizes;
-    // Go over all variables in the intersection set
-    for (MPLPIndexType i=0; i< curr_intersect.size(); ++i){
-        MPLPIndexType var_in_intersect = curr_intersect[i];
-        intersect_var_sizes.push_back(var_sizes[var_in_intersect]);
+namespace {
 
-        vector<MPLPIndexType>::iterator iter = find(m_region_inds.begin(), m_region_inds.end(), var_in_intersect);
+// Work space of the region updates. Every thread has its own, which keeps its buffer between
+// updates, so that the updates do not allocate once the thread has seen the largest region.
+struct RegionWork
+{
+    // UpdateMsgsGeneric: the region's beliefs, then what each intersection set gets from the other
+    // regions. The specialized updates: the old messages, then a row of beliefs.
+    vector<mplpLib::MPLPValueType> m_values;
+    mplpLib::MulDimArr m_orig;
+    vector<mplpLib::MulDimArr> m_lam_minus_region;
+    vector<double> m_soft_work;
+};
+
+RegionWork & region_work()
+{
+    static thread_local RegionWork work;
+    return work;
+}
 
-        // Verify that the current intersection variable indeed appears in this region, and get the index where it appears
-        if (iter == m_region_inds.end()){
-            cerr << "Intersection set contains variable " << var_in_intersect << " which is not in region" << endl;
-            return;
-        }else{
-            tmp_inds_of_intersects.push_back(iter-m_region_inds.begin());
-        }
-    }
+// Makes arr a table of the n values at p, which stay owned by the caller
+void point_at(mplpLib::MulDimArr & arr, mplpLib::MPLPValueType *p, mplpLib::MPLPIndexType n)
+{
+    arr.m_n_prodsize = n;
+    arr.m_dat = p;
+    arr.m_ep = p + n;
+    arr.m_owns_data = false;
+}
 
-    /*	if(MPLP_DEBUG_MODE) {
-	  cout << "intersection locs: ";
-	  for(MPLPIndexType i=0; i<tmp_inds_of_intersects.size(); i++) {
+} // namespace
 
-	    cout << tmp_inds_of_intersects[i] << " ";
-	  }
-	  cout << endl;
-	  }*/
+mplpLib::Region::Region(const MPLPTopology & topology, MPLPIndexType ri): m_region_intersect(topology.m_region_intersect[ri])
+{
+    AddIntersectionSets(topology, ri);
+}
 
-    // This will initialize the message and	set it to zero
-    MulDimArr curr_msg(intersect_var_sizes);
-    curr_msg = 0;
+void mplpLib::Region::Bind(const MPLPTopology & topology, MPLPIndexType ri)
+{
+    const MPLPIndexType v = topology.m_var_begin[ri], si = topology.m_intersect_begin[ri];
+    m_region_inds = ArrayView<MPLPCompactIndexType>(topology.m_vars.data() + v, topology.m_var_begin[ri+1] - v);
+    m_var_sizes = ArrayView<MPLPLabelType>(topology.m_region_var_sizes.data() + v, topology.m_var_begin[ri+1] - v);
+    m_intersect_inds = ArrayView<MPLPCompactIndexType>(topology.m_intersects.data() + si, topology.m_intersect_begin[ri+1] - si);
+    m_inds_of_intersects = ListsView(topology.m_position_begin.data() + si, topology.m_positions.data(), topology.m_intersect_begin[ri+1] - si);
+}
+
+void mplpLib::Region::AddIntersectionSets(const MPLPTopology & topology, MPLPIndexType ri)
+{
+    Bind(topology, ri);
 
-    // Adds new intersection set
-    m_intersect_inds.push_back(intersect_loc);
-    m_inds_of_intersects.push_back(tmp_inds_of_intersects);
-    m_msgs_from_region.push_back(curr_msg);
+    // The plans are built from copies of the views
+    const vector<MPLPIndexType> var_sizes(m_var_sizes.begin(), m_var_sizes.end());
+    vector<vector<MPLPIndexType> > inds_of_intersects(m_inds_of_intersects.size());
+    for (MPLPIndexType si=0; si<m_inds_of_intersects.size(); ++si)
+        inds_of_intersects[si].assign(m_inds_of_intersects[si].begin(), m_inds_of_intersects[si].end());
+
+    for (MPLPIndexType si=m_expand_plans.size(); si<m_intersect_inds.size(); ++si)
+        m_expand_plans.push_back(ExpandPlan(var_sizes, inds_of_intersects[si]));
+    m_marginal_plan = MarginalPlan(var_sizes, inds_of_intersects);
 }
 
 /*
@@ -130,71 +152,458 @@ void mplpLib::Region::AddIntersectionSet(MPLPIndexType intersect_loc, vector<vec
  * edge->edge messages. This difference is only relevant for
  * tightening (before tightening it is identical to MPLP).
  */
-void mplpLib::Region::UpdateMsgs(vector<MulDimArr> & sum_into_intersects)
+void mplpLib::Region::UpdateMsgs(vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const
+{
+    switch (m_marginal_plan.m_kind)
+    {
+    case MarginalPlan::PAIR:
+        UpdateMsgsPair(sum_into_intersects, msgs);
+        break;
+    case MarginalPlan::TRIPLET:
+        UpdateMsgsTriplet(sum_into_intersects, msgs);
+        break;
+    default:
+        UpdateMsgsGeneric(sum_into_intersects, msgs);
+        break;
+    }
+}
+
+void mplpLib::Region::UpdateMsgsGeneric(vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs, double temperature) const
 {
     /* First do the expansion:
 	1. Take out the message into the intersection set from the current cluster
 	2. Expand it to the size of the region
 	3. Add this for all intersection sets
      */
+    // The tables below live in the work space of the thread
+    RegionWork & work = region_work();
+    MPLPIndexType n_values = sum_into_intersects[m_region_intersect].m_n_prodsize;
+    for (MPLPIndexType si=0; si<m_intersect_inds.size(); ++si)
+        n_values+= msgs[si].m_n_prodsize;
+    if (work.m_values.size() < n_values)
+        work.m_values.resize(n_values);
+
     // Set this to be the region's intersection set value
-    MulDimArr orig(sum_into_intersects[m_region_intersect]);
+    MulDimArr & orig = work.m_orig;
+    point_at(orig, work.m_values.data(), sum_into_intersects[m_region_intersect].m_n_prodsize);
+    memcpy(orig.m_dat, sum_into_intersects[m_region_intersect].m_dat, orig.m_n_prodsize * sizeof(MPLPValueType));
     for (MPLPIndexType si=0; si<m_intersect_inds.size(); ++si){
         // Take out previous message
-        vector<MPLPIndexType> & curr_inds_of_intersect = m_inds_of_intersects[si];
-
-        /*
-		if(MPLP_DEBUG_MODE) {
-		  cout << "Intersection set { ";
-		  for(MPLPIndexType i=0; i < curr_inds_of_intersect.size(); i++) {
-		    cout << curr_inds_of_intersect[i] << " ";
-		  }
-		  cout << "}" << endl;
-		}
-         */
-
-        m_msgs_from_region[si].ExpandAndAdd(orig, curr_inds_of_intersect);
+        msgs[si].ExpandAndAdd(orig, m_expand_plans[si]);
     }
     // Will store the total messages going into the intersection, but not from the Region
-    vector<MulDimArr> lam_minus_region;
-    for (MPLPIndexType si=0; si<m_intersect_inds.size(); ++si){
+    vector<MulDimArr> & lam_minus_region = work.m_lam_minus_region;
+    lam_minus_region.resize(m_intersect_inds.size());
+    for (MPLPIndexType si=0, off=orig.m_n_prodsize; si<m_intersect_inds.size(); off+= msgs[si++].m_n_prodsize){
         MPLPIndexType curr_intersect = m_intersect_inds[si];
 
-        lam_minus_region.push_back(MulDimArr());
-        lam_minus_region.back() = sum_into_intersects[curr_intersect];
-        lam_minus_region.back() -= m_msgs_from_region[si];
-
-        vector<MPLPIndexType> & curr_inds_of_intersect = m_inds_of_intersects[si];
+        point_at(lam_minus_region[si], work.m_values.data() + off, msgs[si].m_n_prodsize);
+        memcpy(lam_minus_region[si].m_dat, sum_into_intersects[curr_intersect].m_dat, msgs[si].m_n_prodsize * sizeof(MPLPValueType));
+        lam_minus_region[si] -= msgs[si];
 
-        // If the intersection has the same size as the region, we assume they are the same, and therefore no need
-        // to expand. NOTE: This may cause problems if the intersection has the same indices but rearranged.
-        if (Get_nVars()==curr_inds_of_intersect.size()){
+        // If the intersection is the region itself there is no need to expand. The plan also takes care
+        // of intersections which have the same variables as the region but in a different order.
+        if (m_expand_plans[si].IsIdentity()){
             sum_into_intersects[m_region_intersect]+= sum_into_intersects[curr_intersect];
         }else{
-            sum_into_intersects[curr_intersect].ExpandAndAdd(sum_into_intersects[m_region_intersect],curr_inds_of_intersect);
+            sum_into_intersects[curr_intersect].ExpandAndAdd(sum_into_intersects[m_region_intersect], m_expand_plans[si]);
         }
     }
     // Update messages
-    sum_into_intersects[m_region_intersect].max_into_multiple_subsets_special(m_inds_of_intersects,m_msgs_from_region); // sets m_msgs_from_region
+    if (temperature > 0)
+        sum_into_intersects[m_region_intersect].softmax_into_multiple_subsets(m_marginal_plan, msgs, temperature, work.m_soft_work);
+    else
+        sum_into_intersects[m_region_intersect].max_into_multiple_subsets(m_marginal_plan, msgs); // sets msgs
     MPLPIndexType sC = m_intersect_inds.size();
     for (MPLPIndexType si=0; si<m_intersect_inds.size(); ++si){
         // Take out previous message
         MPLPIndexType curr_intersect = m_intersect_inds[si];
         // Update message
-        m_msgs_from_region[si]*= 1.0/sC;
+        msgs[si]*= 1.0/sC;
         // Put in current message
-        sum_into_intersects[curr_intersect] = m_msgs_from_region[si];
+        sum_into_intersects[curr_intersect] = msgs[si];
         // Finish updating message
         // msg_new = new - old + msg_old
-        m_msgs_from_region[si] -= lam_minus_region[si];
+        msgs[si] -= lam_minus_region[si];
         // Update region intersection set
-        vector<MPLPIndexType> & curr_inds_of_intersect = m_inds_of_intersects[si];
-        m_msgs_from_region[si].ExpandAndSubtract(orig, curr_inds_of_intersect);
+        msgs[si].ExpandAndSubtract(orig, m_expand_plans[si]);
     }
-    memcpy(sum_into_intersects[m_region_intersect].m_dat, orig.m_dat, orig.m_n_prodsize * sizeof(double));
+    memcpy(sum_into_intersects[m_region_intersect].m_dat, orig.m_dat, orig.m_n_prodsize * sizeof(MPLPValueType));
     return;
 }
 
+/*
+ * The same update for edge regions sending messages to their two variables, and for
+ * triplet regions sending messages to their three edges. Rather than building the
+ * expanded tables, the region beliefs are computed on the fly, so that the update is
+ * two sweeps over the region with no temporaries. Sums are taken in the order of the
+ * intersection sets, as above, so the results are exactly those of UpdateMsgsGeneric.
+ */
+namespace {
+
+using mplpLib::MPLPIndexType;
+using mplpLib::MPLPValueType;
+
+// Adds (then subtracts) the row and column terms in the order in which the region lists them
+template <bool ROW_FIRST> inline MPLPValueType add_in_order(MPLPValueType x, MPLPValueType row, MPLPValueType col)
+{
+    return ROW_FIRST ? (x + row) + col : (x + col) + row;
+}
+
+template <bool ROW_FIRST> inline MPLPValueType sub_in_order(MPLPValueType x, MPLPValueType row, MPLPValueType col)
+{
+    return ROW_FIRST ? (x - row) - col : (x - col) - row;
+}
+
+template <bool ROW_FIRST>
+void update_pair(MPLPValueType *region, MPLPValueType *sum_row, MPLPValueType *sum_col, MPLPValueType *msg_row, MPLPValueType *msg_col, const MPLPValueType *old_row, const MPLPValueType *old_col, MPLPIndexType n_rows, MPLPIndexType n_cols)
+{
+    // Max-marginals of the beliefs into the messages
+    MPLPValueType *p = region;
+    for (MPLPIndexType i=0; i<n_rows; i++, p+= n_cols) {
+        MPLPValueType m = MPLP_MAXMARG_FLOOR;
+        if (i == 0) {
+            for (MPLPIndexType j=0; j<n_cols; j++) {
+                MPLPValueType b = add_in_order<ROW_FIRST>(p[j], sum_row[i], sum_col[j]);
+                m = max(m, b);
+                msg_col[j] = max(b, (MPLPValueType)MPLP_MAXMARG_FLOOR);
+            }
+        }else{
+            for (MPLPIndexType j=0; j<n_cols; j++) {
+                MPLPValueType b = add_in_order<ROW_FIRST>(p[j], sum_row[i], sum_col[j]);
+                m = max(m, b);
+                msg_col[j] = max(msg_col[j], b);
+            }
+        }
+        msg_row[i] = m;
+    }
+
+    // msg_new = new - old + msg_old
+    for (MPLPIndexType i=0; i<n_rows; i++) {
+        MPLPValueType lam = sum_row[i] - old_row[i];
+        sum_row[i] = msg_row[i]*(MPLPValueType)(1.0/2);
+        msg_row[i] = sum_row[i] - lam;
+    }
+    for (MPLPIndexType j=0; j<n_cols; j++) {
+        MPLPValueType lam = sum_col[j] - old_col[j];
+        sum_col[j] = msg_col[j]*(MPLPValueType)(1.0/2);
+        msg_col[j] = sum_col[j] - lam;
+    }
+
+    // Swap the old messages for the new ones in the region's own intersection set
+    p = region;
+    for (MPLPIndexType i=0; i<n_rows; i++, p+= n_cols)
+        for (MPLPIndexType j=0; j<n_cols; j++)
+            p[j] = sub_in_order<ROW_FIRST>(add_in_order<ROW_FIRST>(p[j], old_row[i], old_col[j]), msg_row[i], msg_col[j]);
+}
+
+} // namespace
+
+void mplpLib::Region::UpdateMsgsPair(vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const
+{
+    const MPLPIndexType r = m_marginal_plan.m_slot[0], c = m_marginal_plan.m_slot[1];
+    const MPLPIndexType n_rows = m_var_sizes[0], n_cols = m_var_sizes[1];
+
+    vector<MPLPValueType> & scratch = region_work().m_values;
+    if (scratch.size() < n_rows + n_cols)
+        scratch.resize(n_rows + n_cols);
+    MPLPValueType *old_row = &scratch[0], *old_col = old_row + n_rows;
+    memcpy(old_row, msgs[r].m_dat, n_rows*sizeof(MPLPValueType));
+    memcpy(old_col, msgs[c].m_dat, n_cols*sizeof(MPLPValueType));
+
+    if (r == 0)
+        update_pair<true>(sum_into_intersects[m_region_intersect].m_dat, sum_into_intersects[m_intersect_inds[r]].m_dat, sum_into_intersects[m_intersect_inds[c]].m_dat,
+                msgs[r].m_dat, msgs[c].m_dat, old_row, old_col, n_rows, n_cols);
+    else
+        update_pair<false>(sum_into_intersects[m_region_intersect].m_dat, sum_into_intersects[m_intersect_inds[r]].m_dat, sum_into_intersects[m_intersect_inds[c]].m_dat,
+                msgs[r].m_dat, msgs[c].m_dat, old_row, old_col, n_rows, n_cols);
+}
+
+void mplpLib::Region::UpdateMsgsTriplet(vector<MulDimArr> & sum_into_intersects, MulDimArr *msgs) const
+{
+    const vector<vector<MPLPIndexType> > & st = m_marginal_plan.m_strides;
+    const MPLPIndexType n_i = m_var_sizes[0], n_j = m_var_sizes[1], n_k = m_var_sizes[2];
+
+    // Messages of the three edges in the region's order, followed by a row of beliefs
+    MPLPValueType *sum[3], *msg[3], *old[3];
+    MPLPIndexType n_old = 0;
+    for (MPLPIndexType si=0; si<3; si++)
+        n_old+= msgs[si].m_n_prodsize;
+    vector<MPLPValueType> & scratch = region_work().m_values;
+    if (scratch.size() < n_old + n_k)
+        scratch.resize(n_old + n_k);
+    MPLPValueType *row = &scratch[n_old];
+    for (MPLPIndexType si=0, off=0; si<3; off+= msgs[si].m_n_prodsize, si++) {
+        sum[si] = sum_into_intersects[m_intersect_inds[si]].m_dat;
+        msg[si] = msgs[si].m_dat;
+        old[si] = &scratch[off];
+        memcpy(old[si], msg[si], msgs[si].m_n_prodsize*sizeof(MPLPValueType));
+    }
+
+    // Max-marginals of the beliefs into the messages, as in MulDimArr::max_into_multiple_subsets
+    const MPLPIndexType ij = m_marginal_plan.m_slot[0], jk = m_marginal_plan.m_slot[1], ik = m_marginal_plan.m_slot[2];
+    const MPLPIndexType t0 = st[0][2], t1 = st[1][2], t2 = st[2][2];
+    const MPLPIndexType jk_k = st[jk][2], ik_k = st[ik][2];
+    MPLPValueType *p = sum_into_intersects[m_region_intersect].m_dat;
+    for (MPLPIndexType i=0; i<n_i; i++) {
+        MPLPValueType *ik_row = msg[ik] + i*st[ik][0];
+        for (MPLPIndexType j=0; j<n_j; j++, p+= n_k) {
+            const MPLPValueType *e0 = sum[0] + i*st[0][0] + j*st[0][1];
+            const MPLPValueType *e1 = sum[1] + i*st[1][0] + j*st[1][1];
+            const MPLPValueType *e2 = sum[2] + i*st[2][0] + j*st[2][1];
+            for (MPLPIndexType k=0; k<n_k; k++)
+                row[k] = ((p[k] + e0[k*t0]) + e1[k*t1]) + e2[k*t2];
+
+            MPLPValueType *jk_row = msg[jk] + j*st[jk][1];
+            MPLPValueType m = MPLP_MAXMARG_FLOOR;
+            for (MPLPIndexType k=0; k<n_k; k++) {
+                m = max(m, row[k]);
+                jk_row[k*jk_k] = i == 0 ? max(row[k], (MPLPValueType)MPLP_MAXMARG_FLOOR) : max(jk_row[k*jk_k], row[k]);
+                ik_row[k*ik_k] = j == 0 ? max(row[k], (MPLPValueType)MPLP_MAXMARG_FLOOR) : max(ik_row[k*ik_k], row[k]);
+            }
+            msg[ij][i*st[ij][0] + j*st[ij][1]] = m;
+        }
+    }
+
+    // msg_new = new - old + msg_old
+    for (MPLPIndexType si=0; si<3; si++) {
+        for (MPLPIndexType x=0; x<msgs[si].m_n_prodsize; x++) {
+            MPLPValueType lam = sum[si][x] - old[si][x];
+            sum[si][x] = msg[si][x]*(MPLPValueType)(1.0/3);
+            msg[si][x] = sum[si][x] - lam;
+        }
+    }
+
+    // Swap the old messages for the new ones in the region's own intersection set
+    p = sum_into_intersects[m_region_intersect].m_dat;
+    for (MPLPIndexType i=0; i<n_i; i++) {
+        for (MPLPIndexType j=0; j<n_j; j++, p+= n_k) {
+            MPLPIndexType o0 = i*st[0][0] + j*st[0][1], o1 = i*st[1][0] + j*st[1][1], o2 = i*st[2][0] + j*st[2][1];
+            for (MPLPIndexType k=0; k<n_k; k++)
+                p[k] = (((((p[k] + old[0][o0 + k*t0]) + old[1][o1 + k*t1]) + old[2][o2 + k*t2])
+                        - msg[0][o0 + k*t0]) - msg[1][o1 + k*t1]) - msg[2][o2 + k*t2];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Flat arrays of the region graph.
+////////////////////////////////////////////////////////////////////////////////
+
+void mplpLib::MPLPTopology::Reset(const vector<MPLPIndexType> & var_sizes)
+{
+    m_var_sizes.assign(var_sizes.begin(), var_sizes.end());
+    m_singleton_var.clear();
+    m_intersect_regions.clear();
+
+    m_var_begin.assign(1, 0);
+    m_intersect_begin.assign(1, 0);
+    m_position_begin.assign(1, 0);
+    m_vars.clear();
+    m_region_var_sizes.clear();
+    m_intersects.clear();
+    m_positions.clear();
+    m_region_intersect.clear();
+    m_kind.clear();
+    m_color.clear();
+    m_color_classes.clear();
+    m_in_chain.clear();
+    m_var_chains.assign(m_var_sizes.size(), 0);
+}
+
+bool mplpLib::MPLPTopology::AddRegion(const vector<MPLPIndexType> & region_inds, const vector<MPLPIndexType> & intersect_inds, MPLPIndexType region_intersect, const vector<vector<MPLPIndexType> > & all_intersects)
+{
+    const MPLPCompactIndexType *vars = m_vars.data(), *intersects = m_intersects.data(), *positions = m_positions.data(), *position_begin = m_position_begin.data();
+    const MPLPLabelType *sizes = m_region_var_sizes.data();
+
+    assert(m_vars.size() + region_inds.size() <= MPLP_NOT_SINGLETON);
+    for (MPLPIndexType i=0; i<region_inds.size(); ++i){
+        m_vars.push_back(region_inds[i]);
+        m_region_var_sizes.push_back(m_var_sizes[region_inds[i]]);
+    }
+    m_var_begin.push_back(m_vars.size());
+    for (MPLPIndexType si=0; si<intersect_inds.size(); ++si)
+        AppendIntersectionSet(region_inds, all_intersects[intersect_inds[si]]);
+    m_intersects.insert(m_intersects.end(), intersect_inds.begin(), intersect_inds.end());
+    m_intersect_begin.push_back(m_intersects.size());
+    m_region_intersect.push_back(region_intersect);
+    m_kind.push_back(RegionKind(m_region_intersect.size()-1));
+    ColorRegion(m_region_intersect.size()-1);
+    m_in_chain.push_back(0);
+
+    return vars != m_vars.data() || sizes != m_region_var_sizes.data() || intersects != m_intersects.data() ||
+            positions != m_positions.data() || position_begin != m_position_begin.data();
+}
+
+void mplpLib::MPLPTopology::AddRegionIntersectionSets(const vector<vector<MPLPIndexType> > & added, const vector<vector<MPLPIndexType> > & all_intersects)
+{
+    vector<MPLPCompactIndexType> intersect_begin(1, 0), intersects, position_begin(1, 0), positions;
+    m_positions.swap(positions);
+    m_position_begin.swap(position_begin);
+    m_position_begin.assign(1, 0);
+    for (MPLPIndexType ri=0; ri<m_region_intersect.size(); ++ri){
+        for (MPLPIndexType k=m_intersect_begin[ri]; k<m_intersect_begin[ri+1]; ++k){
+            intersects.push_back(m_intersects[k]);
+            m_positions.insert(m_positions.end(), positions.begin() + position_begin[k], positions.begin() + position_begin[k+1]);
+            m_position_begin.push_back(m_positions.size());
+        }
+        const vector<MPLPIndexType> region_inds(m_vars.begin() + m_var_begin[ri], m_vars.begin() + m_var_begin[ri+1]);
+        for (MPLPIndexType k=0; k<added[ri].size(); ++k){
+            intersects.push_back(added[ri][k]);
+            AppendIntersectionSet(region_inds, all_intersects[added[ri][k]]);
+        }
+        intersect_begin.push_back(intersects.size());
+    }
+    m_intersects.swap(intersects);
+    m_intersect_begin.swap(intersect_begin);
+
+    m_color.clear();
+    m_color_classes.clear();
+    for (MPLPIndexType si=0; si<m_intersect_regions.size(); ++si)
+        m_intersect_regions[si].clear();
+    for (MPLPIndexType ri=0; ri<m_region_intersect.size(); ++ri){
+        m_kind[ri] = RegionKind(ri);
+        ColorRegion(ri);
+    }
+    BuildChains();
+}
+
+void mplpLib::MPLPTopology::AppendIntersectionSet(const vector<MPLPIndexType> & region_inds, const vector<MPLPIndexType> & inds_of_vars)
+{
+    // Find the position where every variable of the intersection set appears in the region
+    for (MPLPIndexType i=0; i<inds_of_vars.size(); ++i){
+        vector<MPLPIndexType>::const_iterator iter = find(region_inds.begin(), region_inds.end(), inds_of_vars[i]);
+        if (iter == region_inds.end())
+            cerr << "Intersection set contains variable " << inds_of_vars[i] << " which is not in region" << endl;
+        else
+            m_positions.push_back(iter - region_inds.begin());
+    }
+    m_position_begin.push_back(m_positions.size());
+}
+
+mplpLib::MPLPIndexType mplpLib::MPLPTopology::RegionKind(MPLPIndexType ri) const
+{
+    const vector<MPLPIndexType> var_sizes(m_region_var_sizes.begin() + m_var_begin[ri], m_region_var_sizes.begin() + m_var_begin[ri+1]);
+    vector<vector<MPLPIndexType> > inds_of_intersects;
+    for (MPLPIndexType k=m_intersect_begin[ri]; k<m_intersect_begin[ri+1]; ++k)
+        inds_of_intersects.push_back(vector<MPLPIndexType>(m_positions.begin() + m_position_begin[k], m_positions.begin() + m_position_begin[k+1]));
+    return MarginalPlan(var_sizes, inds_of_intersects).m_kind;
+}
+
+void mplpLib::MPLPTopology::AddIntersectionSet(const vector<MPLPIndexType> & inds_of_vars)
+{
+    m_singleton_var.push_back(inds_of_vars.size() == 1 ? inds_of_vars[0] : MPLP_NOT_SINGLETON);
+    m_intersect_regions.push_back(vector<MPLPCompactIndexType>());
+}
+
+void mplpLib::MPLPTopology::BuildFactorIndex(const vector<MulDimArr> & region_lambdas)
+{
+    m_factor_begin.assign(m_var_sizes.size() + 1, 0);
+    for (MPLPIndexType ri=0; ri<region_lambdas.size(); ++ri)
+        if (region_lambdas[ri].m_n_prodsize)
+            for (MPLPIndexType k=m_var_begin[ri]; k<m_var_begin[ri+1]; ++k)
+                m_factor_begin[m_vars[k] + 1]++;
+    for (MPLPIndexType v=0; v<m_var_sizes.size(); ++v)
+        m_factor_begin[v+1]+= m_factor_begin[v];
+
+    m_factors.resize(m_factor_begin.back());
+    m_factor_strides.resize(m_factor_begin.back());
+    vector<MPLPCompactIndexType> pos(m_factor_begin.begin(), m_factor_begin.end() - 1);
+    for (MPLPIndexType ri=0; ri<region_lambdas.size(); ++ri){
+        if (!region_lambdas[ri].m_n_prodsize)
+            continue;
+        // Tables are row-major, so the last variable has stride 1
+        MPLPIndexType stride = 1;
+        for (MPLPIndexType k=m_var_begin[ri+1]; k>m_var_begin[ri]; --k){
+            const MPLPIndexType v = m_vars[k-1];
+            m_factors[pos[v]] = ri;
+            m_factor_strides[pos[v]++] = stride;
+            stride*= m_var_sizes[v];
+        }
+    }
+}
+
+/*
+ * Greedy: in each pass, an edge region (i,j) with i<j is linked after the edge into i if no other
+ * edge of the pass leaves i or enters j. The linked edges of a pass form paths along which the
+ * variables increase, the chains; edges that were not linked are left for the next pass. Every
+ * variable touched by a pass is in exactly one of its chains.
+ */
+void mplpLib::MPLPTopology::BuildChains()
+{
+    m_in_chain.assign(m_kind.size(), 0);
+    m_var_chains.assign(m_var_sizes.size(), 0);
+
+    // Only edges sending messages to the singleton intersection sets of their variables
+    vector<MPLPCompactIndexType> todo, left;
+    for (MPLPIndexType ri=0; ri<m_kind.size(); ++ri){
+        if (m_kind[ri] != MarginalPlan::PAIR)
+            continue;
+        const MPLPCompactIndexType *v = &m_vars[m_var_begin[ri]], *si = &m_intersects[m_intersect_begin[ri]];
+        if ((si[0] == v[0] && si[1] == v[1]) || (si[0] == v[1] && si[1] == v[0]))
+            todo.push_back(ri);
+    }
+
+    vector<MPLPCompactIndexType> out(m_var_sizes.size(), MPLP_NOT_SINGLETON);
+    vector<unsigned char> has_in(m_var_sizes.size(), 0);
+    while (!todo.empty()){
+        left.clear();
+        for (MPLPIndexType k=0; k<todo.size(); ++k){
+            const MPLPIndexType ri = todo[k];
+            const MPLPIndexType u = m_vars[m_var_begin[ri]], v = m_vars[m_var_begin[ri]+1];
+            const MPLPIndexType lo = min(u, v), hi = max(u, v);
+            if (out[lo] == MPLP_NOT_SINGLETON && !has_in[hi]){
+                out[lo] = ri;
+                has_in[hi] = 1;
+            }else{
+                left.push_back(ri);
+            }
+        }
+        // A variable is counted through the edge entering it, or else through the one leaving it
+        for (MPLPIndexType k=0; k<todo.size(); ++k){
+            const MPLPIndexType ri = todo[k];
+            const MPLPIndexType lo = min(m_vars[m_var_begin[ri]], m_vars[m_var_begin[ri]+1]);
+            if (out[lo] != ri)
+                continue;
+            m_in_chain[ri] = 1;
+            if (!has_in[lo])
+                ++m_var_chains[lo];
+            ++m_var_chains[max(m_vars[m_var_begin[ri]], m_vars[m_var_begin[ri]+1])];
+        }
+        // Reset the links of this pass
+        for (MPLPIndexType k=0; k<todo.size(); ++k){
+            const MPLPIndexType ri = todo[k];
+            out[min(m_vars[m_var_begin[ri]], m_vars[m_var_begin[ri]+1])] = MPLP_NOT_SINGLETON;
+            has_in[max(m_vars[m_var_begin[ri]], m_vars[m_var_begin[ri]+1])] = 0;
+        }
+        todo.swap(left);
+    }
+}
+
+void mplpLib::MPLPTopology::ColorRegion(MPLPIndexType ri)
+{
+    // Mark the colors of the regions sharing an intersection set with this one
+    vector<bool> used(m_color_classes.size() + 1, false);
+    for (MPLPIndexType k=m_intersect_begin[ri]; k<=m_intersect_begin[ri+1]; ++k){
+        const MPLPIndexType si = k < m_intersect_begin[ri+1] ? m_intersects[k] : m_region_intersect[ri];
+        for (MPLPIndexType n=0; n<m_intersect_regions[si].size(); ++n)
+            used[m_color[m_intersect_regions[si][n]]] = true;
+    }
+    MPLPIndexType c = 0;
+    while (used[c])
+        c++;
+
+    m_color.push_back(c);
+    if (c == m_color_classes.size())
+        m_color_classes.push_back(vector<MPLPCompactIndexType>());
+    m_color_classes[c].push_back(ri);
+    for (MPLPIndexType k=m_intersect_begin[ri]; k<=m_intersect_begin[ri+1]; ++k){
+        const MPLPIndexType si = k < m_intersect_begin[ri+1] ? m_intersects[k] : m_region_intersect[ri];
+        if (m_intersect_regions[si].empty() || m_intersect_regions[si].back() != ri)
+            m_intersect_regions[si].push_back(ri);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Code to read in factor graph and initialize MPLP.
 ////////////////////////////////////////////////////////////////////////////////
@@ -216,20 +625,20 @@ mplpLib::MPLPAlg::MPLPAlg(clock_t start, clock_t time_limit, const std::string m
 
     // We have two input formats.
     if (!tmp.compare("UAI.LG")) {
-        Init2(model_file, evid_file);
+        m_initialized = Init2(model_file, evid_file);
     } else {
-        Init(model_file, evid_file);
+        m_initialized = Init(model_file, evid_file);
     }
 }
 
 mplpLib::MPLPAlg::MPLPAlg(clock_t start, clock_t time_limit, const std::vector<MPLPIndexType>& var_sizes, const std::vector< std::vector<MPLPIndexType> >& all_factors, const std::vector< std::vector<double> >& all_lambdas, FILE *log_file, bool uaiCompetition) : begin(false), m_best_val(-MPLP_huge), last_obj(MPLP_huge), obj_del(MPLP_huge), total_mplp_iterations(0), previous_run_of_global_decoding(0), m_uaiCompetition(uaiCompetition), _res_fname("MPLP_Results.log"), _ofs_res(_res_fname.c_str(), std::ios::out | std::ios::trunc), _log_file(log_file), start(start), time_limit(time_limit) {
     if(MPLP_DEBUG_MODE) std::cout<<"Initializing..."<<std::endl;
 
-    Init(var_sizes, all_factors, all_lambdas);
+    m_initialized = Init(var_sizes, all_factors, all_lambdas);
 
 }
 
-void mplpLib::MPLPAlg::Init(const std::string fn, const std::string evid_fn){
+bool mplpLib::MPLPAlg::Init(const std::string fn, const std::string evid_fn){
     if(MPLP_DEBUG_MODE)
         cout << "Calling Init() code...\n";
 
@@ -241,10 +650,10 @@ void mplpLib::MPLPAlg::Init(const std::string fn, const std::string evid_fn){
     read_model_file(var_sizes, evidence, all_factors, all_lambdas, fn, evid_fn);
 
     std::cout<<"Initializing..."<<std::endl;
-    Init(var_sizes, all_factors, all_lambdas);
+    return Init(var_sizes, all_factors, all_lambdas);
 }
 
-void mplpLib::MPLPAlg::Init2(const std::string fn, const std::string evid_fn){
+bool mplpLib::MPLPAlg::Init2(const std::string fn, const std::string evid_fn){
     if(MPLP_DEBUG_MODE)
         cout << "Calling Init2() code...\n";
 
@@ -255,13 +664,39 @@ void mplpLib::MPLPAlg::Init2(const std::string fn, const std::string evid_fn){
     // NOTE: also accepts stereo files with special Potts potentials
     read_model_file2(var_sizes, evidence, all_factors, all_lambdas, fn, evid_fn);
 
-    Init(var_sizes, all_factors, all_lambdas);
+    return Init(var_sizes, all_factors, all_lambdas);
 }
 
 
-void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vector<vector<MPLPIndexType> > & all_region_inds, const vector<vector<double> > & all_lambdas) {
+bool mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vector<vector<MPLPIndexType> > & all_region_inds, const vector<vector<double> > & all_lambdas) {
+    // Labels are stored as MPLPLabelType
+    for (MPLPIndexType i=0; i<var_sizes.size(); ++i){
+        if (var_sizes[i] > MPLP_MAX_LABELS){
+            cerr << "Variable " << i << " has " << var_sizes[i] << " states; at most " << MPLP_MAX_LABELS << " are supported" << endl;
+            return false;
+        }
+    }
+
+    const char *schedule = getenv("MPLP_SCHEDULE");
+    m_schedule = SWEEP;
+    if (schedule != NULL && !strcmp(schedule, "residual")) m_schedule = RESIDUAL;
+    if (schedule != NULL && !strcmp(schedule, "chains")) m_schedule = CHAINS;
+    const char *smoothing = getenv("MPLP_SMOOTHING");
+    m_temperature = smoothing != NULL ? max(atof(smoothing), 0.0) : 0;
+    const char *radius = getenv("MPLP_DECODING_RADIUS");
+    m_decoding_radius = radius != NULL && atoi(radius) > 0 ? atoi(radius) : 0;
+    m_dual_obj = 0;
+    m_intersect_max_valid = false;
+    m_all_edge_intersections = false;
+    m_undo_count = 0;
+    m_trial_parent = NULL;
+    m_trial_seed = 0;
+    m_triangles_sorted = true;
+    m_intersect_index.Clear();
+
     // Set m_var_sizes
     m_var_sizes = var_sizes;   //invoking copy constructor
+    m_topology.Reset(m_var_sizes);
 
     // Set the intersection sets to be all single nodes and also all regions
     // Initialize sum into intersections.
@@ -269,9 +704,11 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
     // First, add all individual nodes as their own intersection set
     for(MPLPIndexType si=0; si < m_var_sizes.size(); ++si) {
         m_all_intersects.push_back(vector<MPLPIndexType>(1,si));
+        m_topology.AddIntersectionSet(m_all_intersects.back());
+        IndexIntersectionSet(m_all_intersects.size() - 1);
         vector<MPLPIndexType> subset_size(1,m_var_sizes[si]);    // Initialize sum into intersections to zero for these
-        m_sum_into_intersects.push_back(MulDimArr(subset_size) = 0);
-        m_single_node_lambdas.push_back(MulDimArr(subset_size) = 0);
+        m_sum_into_intersects.push_back(MulDimArr(subset_size));
+        m_single_node_lambdas.push_back(MulDimArr(subset_size));
     }
 
     // Next initialize all regions. If not a single node, give them their own intersection set
@@ -292,7 +729,7 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
         if(all_region_inds[ri].size() == 1 && all_lambdas[ri].size() != 0){
             MulDimArr curr_lambda(region_var_sizes);
             for (MPLPIndexType i = 0; i < curr_lambda.m_n_prodsize; ++i){
-                curr_lambda[i] = all_lambdas[ri][i];
+                curr_lambda[i] = max(all_lambdas[ri][i], -MPLP_VALUE_HUGE);
             }
             // Insert the single node potential into sum_into_intersects
             m_sum_into_intersects[all_region_inds[ri][0]] += curr_lambda;
@@ -301,32 +738,21 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
             vector<MPLPIndexType> curr_intersect(all_region_inds[ri]);
             m_all_intersects.push_back(curr_intersect);
             MPLPIndexType curr_intersect_loc = m_all_intersects.size() - 1;
+            m_topology.AddIntersectionSet(curr_intersect);
+            IndexIntersectionSet(curr_intersect_loc);
             if (all_lambdas[ri].size()!=0) {
                 MulDimArr curr_lambda = MulDimArr(region_var_sizes);
 
                 // Assume all_lambdas is given as a "flat" vector and put it into curr_lambda
                 for (MPLPIndexType i=0; i < curr_lambda.m_n_prodsize; ++i){
-                    curr_lambda[i] = all_lambdas[ri][i];
+                    curr_lambda[i] = max(all_lambdas[ri][i], -MPLP_VALUE_HUGE);
                 }
                 m_sum_into_intersects.push_back(curr_lambda);
-
-                Region curr_region(all_region_inds[ri], m_all_intersects, all_region_inds[ri], m_var_sizes, curr_intersect_loc);
-
-                m_all_regions.push_back(curr_region);
-                m_region_lambdas.push_back(MulDimArr(curr_lambda));
+                m_region_lambdas.push_back(std::move(curr_lambda));
             }else{  // Empty constructor
-                Region curr_region(all_region_inds[ri], m_all_intersects, all_region_inds[ri], m_var_sizes, curr_intersect_loc);
-                m_all_regions.push_back(curr_region);
                 m_region_lambdas.push_back(MulDimArr());
             }
-            // If this is an edge, insert into the map
-            if(curr_intersect.size() == 2){
-                // First sort
-                vector<MPLPIndexType> tmp_inds(curr_intersect);
-                sort(tmp_inds.begin(), tmp_inds.end());
-                // Then insert
-                m_intersect_map.insert(pair<pair<MPLPIndexType,MPLPIndexType>,MPLPIndexType>(pair<MPLPIndexType,MPLPIndexType>(tmp_inds[0], tmp_inds[1]), curr_intersect_loc));
-            }
+            PushRegion(all_region_inds[ri], all_region_inds[ri], curr_intersect_loc);
         }
     }
 
@@ -342,6 +768,12 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
         m_best_decoded_res[it->first] = it->second;    //record evidence values
     }
 
+    MarkEvidence();
+    m_topology.BuildChains();
+    m_topology.BuildFactorIndex(m_region_lambdas);
+    m_scored_hash = 0;
+    ResetDecodedScore();
+
     if(m_uaiCompetition) {
 
         // For UAI competition, for some silly reason the all 0's configuration is often a solution of the CSPs.
@@ -373,7 +805,7 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
                     // Randomly perturb
                     for(MPLPIndexType loc=0; loc < m_sum_into_intersects[si].m_n_prodsize; loc++) {
                         // TODO: how to set the scale?
-                        m_sum_into_intersects[si].m_dat[loc] += .01 * rand() / double(RAND_MAX);
+                        m_sum_into_intersects[si].m_dat[loc] += .01 * Rand() / double(RAND_MAX);
                     }
                 }
             }
@@ -383,6 +815,7 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
 
     last_global_decoding_end_time = 0;
     last_global_decoding_total_time = 0;
+    return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -390,27 +823,92 @@ void mplpLib::MPLPAlg::Init(const vector<MPLPIndexType> & var_sizes, const vecto
 ////////////////////////////////////////////////////////////////////////////////
 
 void mplpLib::MPLPAlg::RunMPLP(MPLPIndexType niter, double obj_del_thr, double int_gap_thr){
+    // Tightening may have added regions since the last call
+    PackTables();
+    // ... and the intersection sets may have been changed since the last LocalDecode
+    m_intersect_max_valid = false;
+
+    // Whether the last residual iteration failed to lower the dual by obj_del_thr
+    bool residual_stalled = false;
+
     // Perform the GMPLP updates (Sontag's modified version), not quite as in the GJ NIPS07 paper
     for (MPLPIndexType it=0; it<niter; ++it){
 
-        for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
-            m_all_regions[ri].UpdateMsgs(m_sum_into_intersects);
+        const bool smoothed = m_temperature > 0;
+        bool full_sweep = true;    // whether every region was updated in this iteration
+        if (smoothed){
+            for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+                m_all_regions[ri].UpdateMsgsGeneric(m_sum_into_intersects, Msgs(ri), m_temperature);
+        }else if (m_schedule == RESIDUAL){
+            // As much work as a sweep, spent on the regions whose inputs changed the most. Regions
+            // whose messages keep moving without lowering the dual can hold the front of the queue
+            // for ever, so once that happens the next iteration updates every region in turn.
+            if (residual_stalled){
+                for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+                    UpdateResidualRegion(ri);
+            }else{
+                full_sweep = false;
+                if (RunResidualUpdates(m_all_regions.size()) == 0)
+                    break;    // every region is up to date
+            }
+        }else if (m_schedule == CHAINS){
+            // The sweep leaves the edge beliefs as the tightening expects them (see TightenTriplet)
+            UpdateChains();
+            for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+                m_all_regions[ri].UpdateMsgs(m_sum_into_intersects, Msgs(ri));
+        }else if (m_pool.Size() > 1){
+            // One color class at a time. The regions of a class touch disjoint tables, so updating
+            // them together is the same as updating them one after the other, and each update
+            // still decreases the dual. The result does not depend on the number of threads.
+            for (MPLPIndexType c=0; c<m_topology.m_color_classes.size(); ++c){
+                const vector<MPLPCompactIndexType> & regions = m_topology.m_color_classes[c];
+                m_pool.ParallelFor(regions.size(), MPLP_REGIONS_PER_TASK, [&](MPLPIndexType begin, MPLPIndexType end){
+                    for (MPLPIndexType k=begin; k<end; ++k)
+                        m_all_regions[regions[k]].UpdateMsgs(m_sum_into_intersects, Msgs(regions[k]));
+                });
+            }
+        }else{
+            // Regions are visited in their usual order, but each run of regions of the same kind
+            // is handed to its specialized update in one go
+            for (MPLPIndexType ri=0, end; ri<m_all_regions.size(); ri=end){
+                const unsigned char kind = m_topology.m_kind[ri];
+                for (end=ri+1; end<m_all_regions.size() && m_topology.m_kind[end] == kind; ++end);
+
+                if (kind == MarginalPlan::PAIR){
+                    for (; ri<end; ++ri) m_all_regions[ri].UpdateMsgsPair(m_sum_into_intersects, Msgs(ri));
+                }else if (kind == MarginalPlan::TRIPLET){
+                    for (; ri<end; ++ri) m_all_regions[ri].UpdateMsgsTriplet(m_sum_into_intersects, Msgs(ri));
+                }else{
+                    for (; ri<end; ++ri) m_all_regions[ri].UpdateMsgsGeneric(m_sum_into_intersects, Msgs(ri));
+                }
+            }
         }
 
         total_mplp_iterations++;
 
         double obj, int_gap;
 
-        obj = LocalDecode();
+        // After a sweep every intersection set has changed, so only residual updates are tracked
+        obj = LocalDecode(m_schedule == RESIDUAL && !smoothed);
+        m_intersect_max_valid = true;
         obj_del = last_obj-obj;
         last_obj = obj;
 
+        if (smoothed && fabs(obj_del) < m_temperature*MPLP_ANNEAL_DEL){
+            m_temperature*= MPLP_ANNEAL_FACTOR;
+            if (m_temperature < MPLP_MIN_TEMPERATURE)
+                m_temperature = 0;
+            if (MPLP_DEBUG_MODE)
+                cout << "Temperature lowered to " << m_temperature << endl;
+        }
+
         // Run global decoding at least once, a third of the way through
         if(previous_run_of_global_decoding == 0 &&
-                ((double)(clock() - start) / CLOCKS_PER_SEC) > time_limit/3) {
+                ((double)(WallClock() - start) / CLOCKS_PER_SEC) > time_limit/3) {
             if(MPLP_DEBUG_MODE)
                 cout << "Third of the way! Going to run global decoding once." << endl;
             RunGlobalDecoding(false);
+            m_intersect_max_valid = false;
         }
 
         int_gap = obj - m_best_val;
@@ -419,10 +917,13 @@ void mplpLib::MPLPAlg::RunMPLP(MPLPIndexType niter, double obj_del_thr, double i
             cout << "Iter=" << (it+1) << " Objective=" << obj <<  " Decoded=" << m_best_val << " ObjDel=" <<  obj_del << " IntGap=" << int_gap << endl;
         }
         if(_log_file != 0){
-            fprintf(_log_file, "%.2f %.4f %.4f\n", ((double)(clock()-start)/CLOCKS_PER_SEC), obj, m_best_val);
+            fprintf(_log_file, "%.2f %.4f %.4f\n", ((double)(WallClock()-start)/CLOCKS_PER_SEC), obj, m_best_val);
         }
 
-        if (obj_del<obj_del_thr && it > 16) // TODO: put these choices as parameters to the program
+        // The dual need not decrease while smoothing, so only the usual updates are taken to have converged.
+        // A residual iteration that stalls is followed by a sweep, which has to stall as well.
+        residual_stalled = !full_sweep && obj_del<obj_del_thr;
+        if (obj_del<obj_del_thr && it > 16 && !smoothed && full_sweep) // TODO: put these choices as parameters to the program
             break;
         if (int_gap<int_gap_thr)
             break;
@@ -430,12 +931,214 @@ void mplpLib::MPLPAlg::RunMPLP(MPLPIndexType niter, double obj_del_thr, double i
     return;
 }
 
+namespace {
+
+// Bucket of a residual in the residual queue: 0 for 1 and above, then one per power of two
+inline MPLPIndexType residual_bucket(double residual)
+{
+    int e;
+    frexp(residual, &e);
+    return e > 0 ? 0 : min(MPLPIndexType(1 - e), MPLPIndexType(MPLP_RESIDUAL_BUCKETS - 1));
+}
+
+} // namespace
+
+mplpLib::MPLPIndexType mplpLib::MPLPAlg::RunResidualUpdates(MPLPIndexType max_updates)
+{
+    m_residual_buckets.resize(MPLP_RESIDUAL_BUCKETS);
+
+    // Regions added since the last call (all of them after AddAllEdgeIntersections) go first
+    for (MPLPIndexType ri=m_residual.size(); ri<m_all_regions.size(); ++ri){
+        m_residual.push_back(MPLP_huge);
+        m_residual_buckets[0].push_back(ri);
+    }
+
+    MPLPIndexType n_updates = 0, b = 0;
+    while (n_updates < max_updates){
+        while (b < MPLP_RESIDUAL_BUCKETS && m_residual_buckets[b].empty())
+            b++;
+        if (b == MPLP_RESIDUAL_BUCKETS)
+            break;
+        const MPLPIndexType ri = m_residual_buckets[b].front();
+        m_residual_buckets[b].pop_front();
+        if (m_residual[ri] == 0 || residual_bucket(m_residual[ri]) != b)
+            continue;
+
+        const double change = UpdateResidualRegion(ri);
+        n_updates++;
+        if (change >= MPLP_RESIDUAL_THR)
+            b = min(b, residual_bucket(change));
+    }
+    return n_updates;
+}
+
+double mplpLib::MPLPAlg::UpdateResidualRegion(MPLPIndexType ri)
+{
+    // Regions added since the last RunResidualUpdates are queued there first
+    assert(ri < m_residual.size());
+
+    // Keep the old messages to see how much they move
+    const MPLPIndexType msgs_begin = m_topology.m_intersect_begin[ri], msgs_end = m_topology.m_intersect_begin[ri+1];
+    m_old_msgs.clear();
+    for (MPLPIndexType k=msgs_begin; k<msgs_end; ++k)
+        m_old_msgs.insert(m_old_msgs.end(), m_msgs[k].m_dat, m_msgs[k].m_ep);
+
+    m_all_regions[ri].UpdateMsgs(m_sum_into_intersects, Msgs(ri));
+    for (MPLPIndexType k=msgs_begin; k<msgs_end; ++k)
+        MarkIntersectionChanged(m_topology.m_intersects[k]);
+    MarkIntersectionChanged(m_topology.m_region_intersect[ri]);
+
+    double change = 0;
+    for (MPLPIndexType k=msgs_begin, off=0; k<msgs_end; off+= m_msgs[k++].m_n_prodsize)
+        for (MPLPIndexType x=0; x<m_msgs[k].m_n_prodsize; ++x)
+            change = max(change, (double)fabs(m_msgs[k].m_dat[x] - m_old_msgs[off + x]));
+
+    // The neighbours read the intersection sets this region wrote to. Repeating the update of
+    // the region itself would not change anything.
+    if (change >= MPLP_RESIDUAL_THR){
+        for (MPLPIndexType k=msgs_begin; k<msgs_end; ++k)
+            ScheduleIntersectionSet(m_topology.m_intersects[k], change);
+        ScheduleIntersectionSet(m_topology.m_region_intersect[ri], change);
+    }
+    m_residual[ri] = 0;
+    return change;
+}
+
+void mplpLib::MPLPAlg::ScheduleIntersectionSet(MPLPIndexType si, double residual)
+{
+    const vector<MPLPCompactIndexType> & regions = m_topology.m_intersect_regions[si];
+    for (MPLPIndexType k=0; k<regions.size(); ++k){
+        const MPLPIndexType ri = regions[k];
+        if (ri < m_residual.size() && residual > m_residual[ri]){
+            const MPLPIndexType b = residual_bucket(residual);
+            if (m_residual[ri] == 0 || residual_bucket(m_residual[ri]) != b)
+                m_residual_buckets[b].push_back(ri);
+            m_residual[ri] = residual;
+        }
+    }
+}
+
+/*
+ * Sequential reparametrization along monotonic chains, as in TRW-S. The variables are visited in
+ * increasing and then in decreasing order. At x, the max-marginals of all chain edges of x onto x
+ * are moved into the belief of x, and then a share w(x) of that belief is moved on into each chain
+ * edge leading to a variable not yet visited in this pass. Each of these moves can only lower the
+ * dual. w(x) is one over the number of chains through x, so that x keeps nothing when every one of
+ * its chains goes on, and every chain gets the same share; on a single chain the forward pass
+ * carries the max-product messages to its end.
+ */
+namespace {
+
+// An edge region in a chain: its messages to the variables on its left and right, its belief, and
+// the sizes and strides of the two variables in the belief
+struct ChainEdge
+{
+    mplpLib::MPLPValueType *to_left, *to_right, *sum;
+    mplpLib::MPLPIndexType n_left, n_right, s_left, s_right;
+
+    ChainEdge(const mplpLib::Region & r, mplpLib::MulDimArr *msgs, mplpLib::MPLPIndexType left_var, vector<mplpLib::MulDimArr> & sum_into_intersects)
+    {
+        const bool fwd = r.m_region_inds[0] == left_var;
+        to_left = msgs[r.m_marginal_plan.m_slot[fwd ? 0 : 1]].m_dat;
+        to_right = msgs[r.m_marginal_plan.m_slot[fwd ? 1 : 0]].m_dat;
+        sum = sum_into_intersects[r.m_region_intersect].m_dat;
+        n_left = r.m_var_sizes[fwd ? 0 : 1];
+        n_right = r.m_var_sizes[fwd ? 1 : 0];
+        s_left = fwd ? r.m_var_sizes[1] : 1;
+        s_right = fwd ? 1 : r.m_var_sizes[1];
+    }
+
+    // Moves the max-marginals of the edge onto its left (right) variable into that variable's belief b
+    void PullLeft(mplpLib::MPLPValueType *b)
+    {
+        for (mplpLib::MPLPIndexType x=0; x<n_left; ++x){
+            mplpLib::MPLPValueType m = sum[x*s_left];
+            for (mplpLib::MPLPIndexType y=1; y<n_right; ++y)
+                m = max(m, sum[x*s_left + y*s_right]);
+            for (mplpLib::MPLPIndexType y=0; y<n_right; ++y)
+                sum[x*s_left + y*s_right]-= m;
+            to_left[x]+= m;
+            b[x]+= m;
+        }
+    }
+    void PullRight(mplpLib::MPLPValueType *b)
+    {
+        for (mplpLib::MPLPIndexType y=0; y<n_right; ++y){
+            mplpLib::MPLPValueType m = sum[y*s_right];
+            for (mplpLib::MPLPIndexType x=1; x<n_left; ++x)
+                m = max(m, sum[x*s_left + y*s_right]);
+            for (mplpLib::MPLPIndexType x=0; x<n_left; ++x)
+                sum[x*s_left + y*s_right]-= m;
+            to_right[y]+= m;
+            b[y]+= m;
+        }
+    }
+
+    // Moves the share w of the belief b of the left (right) variable into the edge
+    void PushLeft(mplpLib::MPLPValueType *b, mplpLib::MPLPValueType w)
+    {
+        for (mplpLib::MPLPIndexType x=0; x<n_left; ++x){
+            const mplpLib::MPLPValueType d = w*b[x];
+            for (mplpLib::MPLPIndexType y=0; y<n_right; ++y)
+                sum[x*s_left + y*s_right]+= d;
+            to_left[x]-= d;
+            b[x]-= d;
+        }
+    }
+    void PushRight(mplpLib::MPLPValueType *b, mplpLib::MPLPValueType w)
+    {
+        for (mplpLib::MPLPIndexType y=0; y<n_right; ++y){
+            const mplpLib::MPLPValueType d = w*b[y];
+            for (mplpLib::MPLPIndexType x=0; x<n_left; ++x)
+                sum[x*s_left + y*s_right]+= d;
+            to_right[y]-= d;
+            b[y]-= d;
+        }
+    }
+};
+
+} // namespace
+
+void mplpLib::MPLPAlg::UpdateChains()
+{
+    const MPLPTopology & t = m_topology;
+    const MPLPIndexType nv = m_var_sizes.size();
+    for (int backward=0; backward<2; ++backward){
+        for (MPLPIndexType i=0; i<nv; ++i){
+            const MPLPIndexType x = backward ? nv-1-i : i;
+            if (t.m_var_chains[x] == 0)
+                continue;
+            MPLPValueType *b = m_sum_into_intersects[x].m_dat;
+            const vector<MPLPCompactIndexType> & regions = t.m_intersect_regions[x];
+            for (MPLPIndexType k=0; k<regions.size(); ++k){
+                if (!t.m_in_chain[regions[k]])
+                    continue;
+                const Region & r = m_all_regions[regions[k]];
+                const MPLPIndexType left = min(r.m_region_inds[0], r.m_region_inds[1]);
+                ChainEdge e(r, Msgs(regions[k]), left, m_sum_into_intersects);
+                if (x == left) e.PullLeft(b); else e.PullRight(b);
+            }
+            const MPLPValueType w = (MPLPValueType)1/t.m_var_chains[x];
+            for (MPLPIndexType k=0; k<regions.size(); ++k){
+                if (!t.m_in_chain[regions[k]])
+                    continue;
+                const Region & r = m_all_regions[regions[k]];
+                const MPLPIndexType left = min(r.m_region_inds[0], r.m_region_inds[1]);
+                ChainEdge e(r, Msgs(regions[k]), left, m_sum_into_intersects);
+                if (!backward && x == left) e.PushLeft(b, w);
+                if (backward && x != left) e.PushRight(b, w);
+            }
+        }
+    }
+}
+
 void mplpLib::MPLPAlg::AddAllEdgeIntersections()
 {
 
     if(MPLP_DEBUG_MODE) cout << "Adding all edge intersection sets..." << endl;
 
     // Iterate over all of the regions
+    vector<vector<MPLPIndexType> > added(m_all_regions.size());
     for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
 
         // We only care about the regions with >2 variables
@@ -463,11 +1166,16 @@ void mplpLib::MPLPAlg::AddAllEdgeIntersections()
 
                 // Add intersection set to the region
                 // TODO: Test this more thoroughly.
-                m_all_regions[ri].AddIntersectionSet(ij_intersect_loc, m_all_intersects, m_var_sizes);
+                added[ri].push_back(ij_intersect_loc);
             }
         }
     }
+    AddRegionIntersectionSets(added);
+    m_all_edge_intersections = true;
 
+    // The regions changed, so all of them have to be updated again
+    m_residual.clear();
+    m_residual_buckets.clear();
 }
 
 /*
@@ -477,87 +1185,198 @@ mplpLib::MPLPIndexType mplpLib::MPLPAlg::AddRegion(vector<MPLPIndexType> & inds_
 {
     // No potential to go along with the region
     MPLPIndexType region_intersection_set = AddIntersectionSet(inds_of_vars);
-    Region new_region(inds_of_vars, m_all_intersects, intersect_inds, m_var_sizes, region_intersection_set);
     // This will also initialize the messages to zero, which is what we want
-    m_all_regions.push_back(new_region);
+    PushRegion(inds_of_vars, intersect_inds, region_intersection_set);
     m_region_lambdas.push_back(MulDimArr());
 
     //  return m_all_regions.size()-1;
     return region_intersection_set;
 }
 
+void mplpLib::MPLPAlg::PushRegion(const vector<MPLPIndexType> & region_inds, const vector<MPLPIndexType> & intersect_inds, MPLPIndexType region_intersect)
+{
+    if (m_topology.AddRegion(region_inds, intersect_inds, region_intersect, m_all_intersects))
+        for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+            m_all_regions[ri].Bind(m_topology, ri);
+    m_all_regions.push_back(Region(m_topology, m_all_regions.size()));
+    for (MPLPIndexType i=0; i<intersect_inds.size(); ++i)
+        PushZeroMsg(intersect_inds[i]);
+}
+
+void mplpLib::MPLPAlg::AddRegionIntersectionSets(const vector<vector<MPLPIndexType> > & added)
+{
+    // The messages of a region stay together, so the new ones go in after those of their region
+    vector<MulDimArr> msgs;
+    msgs.swap(m_msgs);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
+        for (MPLPIndexType k=m_topology.m_intersect_begin[ri]; k<m_topology.m_intersect_begin[ri+1]; ++k)
+            m_msgs.push_back(std::move(msgs[k]));
+        for (MPLPIndexType i=0; i<added[ri].size(); ++i)
+            PushZeroMsg(added[ri][i]);
+    }
+    m_topology.AddRegionIntersectionSets(added, m_all_intersects);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        m_all_regions[ri].AddIntersectionSets(m_topology, ri);
+}
+
+void mplpLib::MPLPAlg::PushZeroMsg(MPLPIndexType si)
+{
+    vector<MPLPIndexType> sizes;
+    for (MPLPIndexType i=0; i<m_all_intersects[si].size(); ++i)
+        sizes.push_back(m_var_sizes[m_all_intersects[si][i]]);
+    m_msgs.push_back(MulDimArr(sizes));    // all zero
+}
+
+void mplpLib::MPLPAlg::MarkEvidence()
+{
+    m_is_evidence.assign(m_var_sizes.size(), 0);
+    for (map<MPLPIndexType, MPLPIndexType>::const_iterator it = evidence.begin(); it != evidence.end(); ++it)
+        m_is_evidence[it->first] = 1;
+}
+
 mplpLib::MPLPIndexType mplpLib::MPLPAlg::AddIntersectionSet(vector<MPLPIndexType> & inds_of_vars)
 {
     m_all_intersects.push_back(inds_of_vars);
+    m_topology.AddIntersectionSet(inds_of_vars);
+    IndexIntersectionSet(m_all_intersects.size()-1);
     // Calculate the sizes of the variables in this set
     vector<MPLPIndexType> sizes;
     for (MPLPIndexType i=0; i< inds_of_vars.size(); ++i)
         sizes.push_back(m_var_sizes[inds_of_vars[i]]);
 
-    // If this is an edge, insert into the map
-    if(inds_of_vars.size() == 2)
-    {
-        // First sort
-        vector<MPLPIndexType> tmp_inds(inds_of_vars);
-        sort(tmp_inds.begin(), tmp_inds.end());
-
-        //		if(MPLP_DEBUG_MODE)
-        //		  cout << "adding edge intersection set " << tmp_inds[0] << " " << tmp_inds[1] << endl;
-
-        // Then insert
-        assert(m_all_intersects.size() > 0);
-        m_intersect_map.insert(pair<pair<MPLPIndexType,MPLPIndexType>,MPLPIndexType>(pair<MPLPIndexType,MPLPIndexType>(tmp_inds[0], tmp_inds[1]), m_all_intersects.size()-1));
-    }
-
-    MulDimArr new_arr(sizes);
-    new_arr = 0;
-    m_sum_into_intersects.push_back(new_arr);
+    m_sum_into_intersects.push_back(MulDimArr(sizes));   // all zero
     assert(m_all_intersects.size() > 0);
     return m_all_intersects.size()-1;
 }
 
 /*
- * Returns -1 if the intersection set not found.
+ * Moves the intersection sets, the messages and the region potentials which are not in the arena
+ * yet into it. The singletons go first, then each region's own intersection set followed by its
+ * messages, so that the tables read by one update are close together. If the arena has to grow,
+ * all tables already in it are re-pointed at the same offsets in the new buffer.
  */
-int mplpLib::MPLPAlg::FindIntersectionSet(vector<MPLPIndexType> & inds_of_vars)
+void mplpLib::MPLPAlg::PackTables()
 {
-    // Sort the indices to make lookup and comparison easy
-    vector<MPLPIndexType> tmp_inds_of_vars(inds_of_vars);
-    sort(tmp_inds_of_vars.begin(), tmp_inds_of_vars.end());
+    MPLPIndexType needed = 0;
+    for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si)
+        if (m_sum_into_intersects[si].m_owns_data) needed+= MulDimArrArena::Padded(m_sum_into_intersects[si].m_n_prodsize);
+    for (MPLPIndexType k=0; k<m_msgs.size(); ++k)
+        if (m_msgs[k].m_owns_data) needed+= MulDimArrArena::Padded(m_msgs[k].m_n_prodsize);
+    for (MPLPIndexType ri=0; ri<m_region_lambdas.size(); ++ri)
+        if (m_region_lambdas[ri].m_owns_data) needed+= MulDimArrArena::Padded(m_region_lambdas[ri].m_n_prodsize);
+    if (needed == 0)
+        return;
+
+    MPLPValueType *old_base = m_arena.Reserve(needed);
+    if (old_base != NULL){
+        MPLPValueType *new_base = m_arena.Data();
+        for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si)
+            if (!m_sum_into_intersects[si].m_owns_data) m_sum_into_intersects[si].UseExternalData(new_base + (m_sum_into_intersects[si].m_dat - old_base));
+        for (MPLPIndexType k=0; k<m_msgs.size(); ++k)
+            if (!m_msgs[k].m_owns_data) m_msgs[k].UseExternalData(new_base + (m_msgs[k].m_dat - old_base));
+        for (MPLPIndexType ri=0; ri<m_region_lambdas.size(); ++ri)
+            if (!m_region_lambdas[ri].m_owns_data) m_region_lambdas[ri].UseExternalData(new_base + (m_region_lambdas[ri].m_dat - old_base));
+    }
 
-    // Is this an edge? If so, do map lookup
-    if(tmp_inds_of_vars.size() == 2)
-    {
-        map<pair<MPLPIndexType,MPLPIndexType>, MPLPIndexType>::iterator iter = m_intersect_map.find(pair<MPLPIndexType,MPLPIndexType>(tmp_inds_of_vars[0], tmp_inds_of_vars[1]));
-        if( iter != m_intersect_map.end() ) // If the edge is found
-            return iter->second;
-        else {
-            return -1;
+    MPLPIndexType n_single = min((MPLPIndexType)m_var_sizes.size(), (MPLPIndexType)m_sum_into_intersects.size());
+    for (MPLPIndexType si=0; si<n_single; ++si)
+        if (m_sum_into_intersects[si].m_owns_data) m_arena.Place(m_sum_into_intersects[si]);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
+        MulDimArr & region_sum = m_sum_into_intersects[m_all_regions[ri].m_region_intersect];
+        if (region_sum.m_owns_data && region_sum.m_n_prodsize) m_arena.Place(region_sum);
+        for (MPLPIndexType k=m_topology.m_intersect_begin[ri]; k<m_topology.m_intersect_begin[ri+1]; ++k)
+            if (m_msgs[k].m_owns_data && m_msgs[k].m_n_prodsize) m_arena.Place(m_msgs[k]);
+    }
+    for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si)
+        if (m_sum_into_intersects[si].m_owns_data && m_sum_into_intersects[si].m_n_prodsize) m_arena.Place(m_sum_into_intersects[si]);
+    for (MPLPIndexType ri=0; ri<m_region_lambdas.size(); ++ri)
+        if (m_region_lambdas[ri].m_owns_data && m_region_lambdas[ri].m_n_prodsize) m_arena.Place(m_region_lambdas[ri]);
+}
+
+void mplpLib::MPLPAlg::IndexEdge(MPLPIndexType a, MPLPIndexType b, MPLPIndexType loc)
+{
+    if (m_edge_adjacency.size() <= b)
+        m_edge_adjacency.resize(max(MPLPIndexType(m_var_sizes.size()), b + 1));
+    vector<pair<MPLPIndexType, MPLPIndexType> > & adj_a = m_edge_adjacency[a], & adj_b = m_edge_adjacency[b];
+
+    // Every common neighbour w closes a triangle; its variables are put in the order of MPLPTriangle
+    for (MPLPIndexType x=0, y=0; x<adj_a.size() && y<adj_b.size(); ){
+        if (adj_a[x].first < adj_b[y].first){
+            x++;
+        }else if (adj_b[y].first < adj_a[x].first){
+            y++;
+        }else{
+            const MPLPIndexType w = adj_a[x].first, aw = adj_a[x].second, bw = adj_b[y].second;
+            MPLPTriangle t;
+            if (w < a){
+                t.k = w; t.i = a; t.j = b;
+                t.ij_intersect_loc = loc; t.jk_intersect_loc = bw; t.ki_intersect_loc = aw;
+            }else if (w < b){
+                t.k = a; t.i = w; t.j = b;
+                t.ij_intersect_loc = bw; t.jk_intersect_loc = loc; t.ki_intersect_loc = aw;
+            }else{
+                t.k = a; t.i = b; t.j = w;
+                t.ij_intersect_loc = bw; t.jk_intersect_loc = aw; t.ki_intersect_loc = loc;
+            }
+            m_triangles.push_back(t);
+            m_triangles_sorted = false;
+            x++; y++;
         }
     }
 
-    for(MPLPIndexType i=0; i < m_all_intersects.size(); ++i)
-    {
-        // copy, then sort
-        vector<MPLPIndexType> tmp_inds(m_all_intersects[i]);
-        sort(tmp_inds.begin(), tmp_inds.end());
+    adj_a.insert(lower_bound(adj_a.begin(), adj_a.end(), make_pair(b, MPLPIndexType(0))), make_pair(b, loc));
+    adj_b.insert(lower_bound(adj_b.begin(), adj_b.end(), make_pair(a, MPLPIndexType(0))), make_pair(a, loc));
+}
 
-        if(tmp_inds == tmp_inds_of_vars)
-            return i;
+void mplpLib::MPLPAlg::IndexIntersectionSet(MPLPIndexType si)
+{
+    vector<MPLPIndexType> inds(m_all_intersects[si]);
+    sort(inds.begin(), inds.end());
+    if (m_intersect_index.Insert(inds, si) && inds.size() == 2)
+        IndexEdge(inds[0], inds[1], si);
+}
+
+const vector<mplpLib::MPLPTriangle> & mplpLib::MPLPAlg::Triangles()
+{
+    if (!m_triangles_sorted){
+        sort(m_triangles.begin(), m_triangles.end());
+        m_triangles_sorted = true;
     }
+    return m_triangles;
+}
 
-    return -1;
+/*
+ * Returns -1 if the intersection set not found.
+ */
+int mplpLib::MPLPAlg::FindIntersectionSet(vector<MPLPIndexType> & inds_of_vars)
+{
+    // Sort the indices to look them up in m_intersect_index
+    MPLPIndexType small[3];
+    vector<MPLPIndexType> large;
+    MPLPIndexType *sorted = small;
+    if (inds_of_vars.size() > 3){
+        large = inds_of_vars;
+        sorted = &large[0];
+    } else {
+        copy(inds_of_vars.begin(), inds_of_vars.end(), small);
+    }
+    sort(sorted, sorted + inds_of_vars.size());
+
+    const MPLPIndexType si = m_intersect_index.Find(sorted, inds_of_vars.size());
+    return si == VarSetMap::NOT_FOUND ? -1 : static_cast<int>(si);
 }
 
-double mplpLib::MPLPAlg::IntVal(vector<MPLPIndexType> & assignment) const{
+double mplpLib::MPLPAlg::IntVal(const vector<MPLPLabelType> & assignment) const{
     double int_val = 0;
-    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
+    const MPLPTopology & t = Topology();
+    for (MPLPIndexType ri=0; ri<Regions().size(); ++ri){
         if (m_region_lambdas[ri].m_n_prodsize){
-            vector<MPLPIndexType> tmpvec;
-            for (MPLPIndexType vi = 0; vi < m_all_regions[ri].m_region_inds.size(); ++vi){
-                tmpvec.push_back(assignment[m_all_regions[ri].m_region_inds[vi]]);
+            // Flat index of the assignment in the region's table (as in MulDimArr::GetFlatInd)
+            MPLPIndexType flat = 0;
+            for (MPLPCompactIndexType k = t.m_var_begin[ri]; k < t.m_var_begin[ri+1]; ++k){
+                flat = flat*t.m_var_sizes[t.m_vars[k]] + assignment[t.m_vars[k]];
             }
-            int_val+= m_region_lambdas[ri].GetVal(tmpvec);
+            int_val+= m_region_lambdas[ri][flat];
         }
     }
     //This iterates over all singletons
@@ -567,47 +1386,198 @@ double mplpLib::MPLPAlg::IntVal(vector<MPLPIndexType> & assignment) const{
     return int_val;
 }
 
-double mplpLib::MPLPAlg::LocalDecode(void){
-    double obj=0;
+/*
+ * For every factor, the flat indices of a block of assignments are computed as in IntVal (this loop
+ * vectorizes), then the factor's values are gathered and added to the totals.
+ */
+void mplpLib::MPLPAlg::IntValBatch(const MPLPLabelType *labels, MPLPIndexType n, double *values) const{
+    const SimdKernels & simd = GetSimdKernels();
+    const MPLPTopology & t = Topology();
+    MPLPCompactIndexType flat[MPLP_BATCH_BLOCK];
+
+    for (MPLPIndexType a0=0; a0<n; a0+= MPLP_BATCH_BLOCK){
+        const MPLPIndexType nb = min((MPLPIndexType)MPLP_BATCH_BLOCK, n - a0);
+        double *val = values + a0;
+        for (MPLPIndexType a=0; a<nb; a++)
+            val[a] = 0;
+
+        for (MPLPIndexType ri=0; ri<Regions().size(); ++ri){
+            if (!m_region_lambdas[ri].m_n_prodsize)
+                continue;
+            if (m_region_lambdas[ri].m_n_prodsize > MPLP_GATHER_MAX_TABLE){
+                // Too large for the 32-bit offsets of the gathers, so read one assignment at a time
+                for (MPLPIndexType a=0; a<nb; a++){
+                    MPLPIndexType f = 0;
+                    for (MPLPCompactIndexType k = t.m_var_begin[ri]; k < t.m_var_begin[ri+1]; ++k)
+                        f = f*t.m_var_sizes[t.m_vars[k]] + labels[t.m_vars[k]*n + a0 + a];
+                    val[a]+= m_region_lambdas[ri][f];
+                }
+                continue;
+            }
+            for (MPLPIndexType a=0; a<nb; a++)
+                flat[a] = 0;
+            for (MPLPCompactIndexType k = t.m_var_begin[ri]; k < t.m_var_begin[ri+1]; ++k){
+                const MPLPCompactIndexType size = t.m_var_sizes[t.m_vars[k]];
+                const MPLPLabelType *l = labels + t.m_vars[k]*n + a0;
+                for (MPLPIndexType a=0; a<nb; a++)
+                    flat[a] = flat[a]*size + l[a];
+            }
+            simd.gather_add(val, m_region_lambdas[ri].m_dat, flat, nb);
+        }
+        for (MPLPIndexType ni=0; ni<m_var_sizes.size(); ++ni){
+            const MPLPLabelType *l = labels + ni*n + a0;
+            for (MPLPIndexType a=0; a<nb; a++)
+                flat[a] = l[a];
+            simd.gather_add(val, m_single_node_lambdas[ni].m_dat, flat, nb);
+        }
+    }
+}
+
+namespace {
+
+// Hash of variable var having the given label. The hash of an assignment is the xor of these.
+inline uint64_t label_hash(mplpLib::MPLPIndexType var, mplpLib::MPLPIndexType label)
+{
+    uint64_t z = (((uint64_t)var << 16) | label) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+} // namespace
+
+void mplpLib::MPLPAlg::SetDecodedLabel(MPLPIndexType var, MPLPLabelType label)
+{
+    const MPLPLabelType old = m_decoded_res[var];
+    if (old == label)
+        return;
+    m_decoded_res[var] = label;
+    m_decoded_hash^= label_hash(var, old) ^ label_hash(var, label);
+
+    const MPLPTopology & t = Topology();
+    double before = m_single_node_lambdas[var][old], after = m_single_node_lambdas[var][label];
+    for (MPLPIndexType k=t.m_factor_begin[var]; k<t.m_factor_begin[var+1]; ++k){
+        const MPLPIndexType ri = t.m_factors[k];
+        MPLPIndexType & flat = m_decoded_flat[ri];
+        before+= m_region_lambdas[ri][flat];
+        flat = flat - old*t.m_factor_strides[k] + label*t.m_factor_strides[k];
+        after+= m_region_lambdas[ri][flat];
+    }
+    m_decoded_val+= after - before;
+    // Differences of huge values (log 0 potentials) lose everything else in the sum
+    if (fabs(before) > MPLP_RESCORE_MAGNITUDE || fabs(after) > MPLP_RESCORE_MAGNITUDE)
+        m_decoded_val_exact = false;
+}
+
+void mplpLib::MPLPAlg::ResetDecodedScore()
+{
+    const MPLPTopology & t = Topology();
+    m_decoded_flat.assign(m_region_lambdas.size(), 0);
+    for (MPLPIndexType ri=0; ri<m_region_lambdas.size(); ++ri)
+        for (MPLPCompactIndexType k = t.m_var_begin[ri]; k < t.m_var_begin[ri+1]; ++k)
+            m_decoded_flat[ri] = m_decoded_flat[ri]*t.m_var_sizes[t.m_vars[k]] + m_decoded_res[t.m_vars[k]];
+
+    m_decoded_hash = 0;
+    for (MPLPIndexType v=0; v<m_decoded_res.size(); ++v)
+        m_decoded_hash^= label_hash(v, m_decoded_res[v]);
+    m_decoded_val = IntVal(m_decoded_res);
+    m_decoded_val_exact = true;
+}
+
+double mplpLib::MPLPAlg::LocalDecode(bool only_changed){
     MPLPIndexType max_at;
+    if (only_changed && m_intersect_max_valid){
+        // The other intersection sets kept their maxima, and their singletons their decoding
+        for (MPLPIndexType k=0; k<m_changed_intersects.size(); ++k){
+            const MPLPIndexType si = m_changed_intersects[k];
+            const double m = m_sum_into_intersects[si].Max(max_at);
+            m_dual_obj+= m - m_intersect_max[si];
+            m_intersect_max[si] = m;
+            MPLPCompactIndexType var = Topology().m_singleton_var[si];
+            if (var != MPLP_NOT_SINGLETON && !m_is_evidence[var]){
+                SetDecodedLabel(var, max_at);
+            }
+            m_intersect_changed[si] = 0;
+        }
+        m_changed_intersects.clear();
+        UpdateResult();
+        return m_dual_obj;
+    }
+
+    double obj=0;
+    m_intersect_max.resize(m_sum_into_intersects.size());
     for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si){
-        obj+= m_sum_into_intersects[si].Max(max_at);
+        obj+= (m_intersect_max[si] = m_sum_into_intersects[si].Max(max_at));
         // If this is a singleton, keep its value (so that we also have an integral assignment).
         // NOTE: Here we assume that all singletons are intersection sets. Otherwise, some variables will not be decoded here
-        // evidence.find() is used because we do not want to set the state of a variable whose state
+        // Evidence variables are skipped because we do not want to set the state of a variable whose state
         // is fixed because it is evidence.
-        if (m_all_intersects[si].size()==1 && evidence.find(m_all_intersects[si][0]) == evidence.end()){
-            m_decoded_res[m_all_intersects[si][0]] = max_at;
+        MPLPCompactIndexType var = Topology().m_singleton_var[si];
+        if (var != MPLP_NOT_SINGLETON && !m_is_evidence[var]){
+            SetDecodedLabel(var, max_at);
         }
     }
+    m_dual_obj = obj;
+    m_intersect_changed.assign(m_sum_into_intersects.size(), 0);
+    m_changed_intersects.clear();
     UpdateResult();
     return obj;
 }
 
+void mplpLib::MPLPAlg::MarkIntersectionChanged(MPLPIndexType si)
+{
+    if (si < m_intersect_changed.size() && !m_intersect_changed[si]){
+        m_intersect_changed[si] = 1;
+        m_changed_intersects.push_back(si);
+    }
+}
+
 /*
  * Checks to see if the current integer assignment is better than any found before, and
  * if so writes it to the output file.
  */
 double mplpLib::MPLPAlg::UpdateResult(void){
-    double int_val;
-    if ( (int_val = IntVal(m_decoded_res)) > m_best_val){
+    double int_val = m_decoded_val;
+    if (m_decoded_hash == m_scored_hash){
+        // Nothing new (most of the time, the incumbent again)
+        int_val = m_decoded_val = m_scored_val;
+        m_decoded_val_exact = true;
+    }else if (!m_decoded_val_exact || int_val > m_best_val - MPLP_RESCORE_TOL){
+        // The assignment may beat the incumbent. Score it from scratch, so that the comparison
+        // does not depend on rounding in the delta scoring.
+        int_val = m_decoded_val = m_scored_val = IntVal(m_decoded_res);
+        m_decoded_val_exact = true;
+        m_scored_hash = m_decoded_hash;
+    }
+    if (int_val > m_best_val){
 
         if(MPLP_DEBUG_MODE)
             cout << "int val: " << int_val << endl;
 
-        if (time_limit + (double)(start - clock()) / CLOCKS_PER_SEC > MPLP_MIN_APP_TIME){ // Prevent a partial write
-            Write(/*_res_fname.c_str()*/);
-        }
         m_best_decoded_res.assign(m_decoded_res.begin(), m_decoded_res.end());
         m_best_val = int_val;
+        // A trial keeps its incumbent for RunGlobalDecoding3 to merge
+        if (m_trial_parent == NULL && time_limit + (double)(start - WallClock()) / CLOCKS_PER_SEC > MPLP_MIN_APP_TIME){ // Prevent a partial write
+            Write(/*_res_fname.c_str()*/);
+        }
     }
     return int_val;
 }
 
+void mplpLib::MPLPAlg::MergeIncumbent(const vector<MPLPLabelType> & res, double val)
+{
+    if (val > m_best_val){
+        m_best_decoded_res = res;
+        m_best_val = val;
+        if (time_limit + (double)(start - WallClock()) / CLOCKS_PER_SEC > MPLP_MIN_APP_TIME){ // Prevent a partial write
+            Write();
+        }
+    }
+}
+
 /*
  * Write to output file (containing best MAP assignment found so far).
- * TODO: Modify so that this writes a checkpoint, i.e. the full list of intersection sets, regions (not potentials),
- *       and messages, so we can use in debugging and re-running.
+ * Checkpoints of the full state are written by WriteCheckpoint.
  */
 void mplpLib::MPLPAlg::Write(/*const char *res_fname, const char *msgs_fname, const char *suminto_fname, const char *objhist_fname, const char *inthist_fname, const char *timehist_fname*/)
 {
@@ -623,10 +1593,10 @@ void mplpLib::MPLPAlg::Write(/*const char *res_fname, const char *msgs_fname, co
 
     assert(m_var_sizes.size() > 0);
     for (MPLPIndexType vi=0; vi< m_var_sizes.size()-1; ++vi){
-        s << m_decoded_res[vi] << " ";
+        s << m_best_decoded_res[vi] << " ";
     }
 
-    s << m_decoded_res[m_var_sizes.size()-1];
+    s << m_best_decoded_res[m_var_sizes.size()-1];
 
     //write solution in append mode and avoid writing a partial solution in case of timeout (SIGKILL)
     _ofs_res << s.str();
@@ -635,6 +1605,439 @@ void mplpLib::MPLPAlg::Write(/*const char *res_fname, const char *msgs_fname, co
 }
 
 
+/*
+ * A checkpoint is a CheckpointHeader, then the arrays it counts as 32-bit integers, in the order
+ * of the header, padded to a multiple of 8 bytes, and then n_values values: the tables of all
+ * intersection sets, followed by the messages of every region in the order of its intersection sets.
+ * Numbers are in the byte order of the machine. Region potentials are not stored; they come from
+ * the model, as do the single node potentials.
+ */
+namespace {
+
+using mplpLib::MPLPIndexType;
+using mplpLib::MPLPValueType;
+
+#define MPLP_CHECKPOINT_VERSION 1
+
+struct CheckpointHeader
+{
+    char magic[8];                  // "MPLPCKPT"
+    uint32_t version, value_size;   // MPLP_CHECKPOINT_VERSION, sizeof(MPLPValueType)
+    uint64_t n_vars;                // var_sizes and best_decoded_res
+    uint64_t n_evidence;            // evidence: (variable, label) pairs
+    uint64_t n_intersects, n_intersect_vars;    // intersect_begin (n_intersects+1), intersect_vars
+    uint64_t n_regions, n_region_vars, n_region_intersects;    // region_var_begin, region_vars, region_intersect_begin, region_intersects, region_intersect
+    uint64_t n_values;
+    uint64_t total_mplp_iterations, previous_run_of_global_decoding;
+    double best_val, last_obj, temperature;
+    uint64_t all_edge_intersections;
+    uint64_t rand_draws;            // RandDraws()
+};
+
+template <class T> void append(vector<char> & buf, const T *p, MPLPIndexType n)
+{
+    buf.insert(buf.end(), (const char *)p, (const char *)(p + n));
+}
+
+void append_u32(vector<char> & buf, MPLPIndexType x)
+{
+    uint32_t v = x;
+    append(buf, &v, 1);
+}
+
+// Reads consecutive arrays out of a checkpoint, checking that they fit in the file
+class CheckpointReader
+{
+public:
+    CheckpointReader(const char *p, MPLPIndexType size) : m_begin(p), m_p(p), m_end(p + size) {}
+
+    template <class T> const T *Take(MPLPIndexType n)
+    {
+        if (m_p == NULL || n > MPLPIndexType(m_end - m_p)/sizeof(T)){
+            m_p = NULL;
+            return NULL;
+        }
+        const T *p = (const T *)m_p;
+        m_p+= n*sizeof(T);
+        return p;
+    }
+    // Skips the padding up to the next multiple of to bytes from the start
+    void Align(MPLPIndexType to)
+    {
+        while (m_p != NULL && m_p < m_end && (m_p - m_begin) % to != 0)
+            m_p++;
+    }
+
+private:
+    const char *m_begin, *m_p, *m_end;
+};
+
+// Offsets begin[0..n] into an array of size total
+bool valid_offsets(const uint32_t *begin, MPLPIndexType n, MPLPIndexType total)
+{
+    if (begin[0] != 0 || begin[n] != total)
+        return false;
+    for (MPLPIndexType i=0; i<n; i++)
+        if (begin[i] > begin[i+1])
+            return false;
+    return true;
+}
+
+} // namespace
+
+void mplpLib::MPLPAlg::WriteCheckpoint(const string & fname)
+{
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MPLPCKPT", 8);
+    h.version = MPLP_CHECKPOINT_VERSION;
+    h.value_size = sizeof(MPLPValueType);
+    h.n_vars = m_var_sizes.size();
+    h.n_evidence = evidence.size();
+    h.n_intersects = m_all_intersects.size();
+    h.n_regions = m_all_regions.size();
+    for (MPLPIndexType si=0; si<m_all_intersects.size(); ++si){
+        h.n_intersect_vars+= m_all_intersects[si].size();
+        h.n_values+= m_sum_into_intersects[si].m_n_prodsize;
+    }
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
+        h.n_region_vars+= m_all_regions[ri].m_region_inds.size();
+        h.n_region_intersects+= m_all_regions[ri].m_intersect_inds.size();
+    }
+    for (MPLPIndexType k=0; k<m_msgs.size(); ++k)
+        h.n_values+= m_msgs[k].m_n_prodsize;
+    h.total_mplp_iterations = total_mplp_iterations;
+    h.previous_run_of_global_decoding = previous_run_of_global_decoding;
+    h.best_val = m_best_val;
+    h.last_obj = last_obj;
+    h.temperature = m_temperature;
+    h.all_edge_intersections = m_all_edge_intersections;
+    h.rand_draws = RandDraws();
+
+    // The buffer comes back from the writer, so that its memory is reused
+    vector<char> & buf = m_checkpoint_buf;
+    buf.clear();
+    buf.reserve(sizeof(h) + 4*(2*h.n_vars + 2*h.n_evidence + h.n_intersects + h.n_intersect_vars + 3*h.n_regions + h.n_region_vars + h.n_region_intersects + 3) + 8 + h.n_values*sizeof(MPLPValueType));
+    append(buf, &h, 1);
+    for (MPLPIndexType v=0; v<m_var_sizes.size(); ++v)
+        append_u32(buf, m_var_sizes[v]);
+    for (map<MPLPIndexType, MPLPIndexType>::const_iterator it = evidence.begin(); it != evidence.end(); ++it){
+        append_u32(buf, it->first);
+        append_u32(buf, it->second);
+    }
+    for (MPLPIndexType v=0; v<m_var_sizes.size(); ++v)
+        append_u32(buf, m_best_decoded_res[v]);
+
+    MPLPIndexType n = 0;
+    append_u32(buf, n);
+    for (MPLPIndexType si=0; si<m_all_intersects.size(); ++si)
+        append_u32(buf, n+= m_all_intersects[si].size());
+    for (MPLPIndexType si=0; si<m_all_intersects.size(); ++si)
+        for (MPLPIndexType k=0; k<m_all_intersects[si].size(); ++k)
+            append_u32(buf, m_all_intersects[si][k]);
+
+    append_u32(buf, n = 0);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        append_u32(buf, n+= m_all_regions[ri].m_region_inds.size());
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        for (MPLPIndexType k=0; k<m_all_regions[ri].m_region_inds.size(); ++k)
+            append_u32(buf, m_all_regions[ri].m_region_inds[k]);
+    append_u32(buf, n = 0);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        append_u32(buf, n+= m_all_regions[ri].m_intersect_inds.size());
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        for (MPLPIndexType k=0; k<m_all_regions[ri].m_intersect_inds.size(); ++k)
+            append_u32(buf, m_all_regions[ri].m_intersect_inds[k]);
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        append_u32(buf, m_all_regions[ri].m_region_intersect);
+
+    buf.resize((buf.size() + 7) & ~MPLPIndexType(7), 0);
+    for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si)
+        append(buf, m_sum_into_intersects[si].m_dat, m_sum_into_intersects[si].m_n_prodsize);
+    for (MPLPIndexType k=0; k<m_msgs.size(); ++k)
+        append(buf, m_msgs[k].m_dat, m_msgs[k].m_n_prodsize);
+
+    m_checkpoint_writer.Start(fname, buf);
+}
+
+bool mplpLib::MPLPAlg::WaitCheckpoint()
+{
+    return m_checkpoint_writer.Wait();
+}
+
+bool mplpLib::MPLPAlg::ReadCheckpoint(const string & fname)
+{
+    MappedFile file;
+    if (!file.Open(fname))
+        return false;
+    CheckpointReader in(file.Data(), file.Size());
+    const CheckpointHeader *h = in.Take<CheckpointHeader>(1);
+    if (h == NULL || memcmp(h->magic, "MPLPCKPT", 8) || h->version != MPLP_CHECKPOINT_VERSION || h->value_size != sizeof(MPLPValueType) ||
+            h->n_vars != m_var_sizes.size() || h->n_intersects < m_all_intersects.size() || h->n_regions < m_all_regions.size() ||
+            h->n_intersects >= MPLP_NOT_SINGLETON || h->n_regions >= MPLP_NOT_SINGLETON){
+        cerr << fname << " is not a checkpoint of this model" << endl;
+        return false;
+    }
+    const uint32_t *var_sizes = in.Take<uint32_t>(h->n_vars);
+    const uint32_t *evid = in.Take<uint32_t>(2*h->n_evidence);
+    const uint32_t *best = in.Take<uint32_t>(h->n_vars);
+    const uint32_t *intersect_begin = in.Take<uint32_t>(h->n_intersects + 1);
+    const uint32_t *intersect_vars = in.Take<uint32_t>(h->n_intersect_vars);
+    const uint32_t *region_var_begin = in.Take<uint32_t>(h->n_regions + 1);
+    const uint32_t *region_vars = in.Take<uint32_t>(h->n_region_vars);
+    const uint32_t *region_intersect_begin = in.Take<uint32_t>(h->n_regions + 1);
+    const uint32_t *region_intersects = in.Take<uint32_t>(h->n_region_intersects);
+    const uint32_t *region_intersect = in.Take<uint32_t>(h->n_regions);
+    in.Align(8);
+    const MPLPValueType *values = in.Take<MPLPValueType>(h->n_values);
+    bool ok = values != NULL && valid_offsets(intersect_begin, h->n_intersects, h->n_intersect_vars) &&
+            valid_offsets(region_var_begin, h->n_regions, h->n_region_vars) && valid_offsets(region_intersect_begin, h->n_regions, h->n_region_intersects);
+
+    // Everything is checked before anything is changed
+    for (MPLPIndexType v=0; ok && v<m_var_sizes.size(); ++v)
+        ok = var_sizes[v] == m_var_sizes[v] && best[v] < m_var_sizes[v];
+    for (MPLPIndexType k=0; ok && k<h->n_evidence; ++k)
+        ok = evid[2*k] < m_var_sizes.size() && evid[2*k+1] < m_var_sizes[evid[2*k]];
+    for (map<MPLPIndexType, MPLPIndexType>::const_iterator it = evidence.begin(); ok && it != evidence.end(); ++it){
+        ok = false;    // the evidence of the model must still be there
+        for (MPLPIndexType k=0; k<h->n_evidence && !ok; ++k)
+            ok = evid[2*k] == it->first && evid[2*k+1] == it->second;
+    }
+    for (MPLPIndexType k=0; ok && k<h->n_intersect_vars; ++k)
+        ok = intersect_vars[k] < m_var_sizes.size();
+    for (MPLPIndexType k=0; ok && k<h->n_region_vars; ++k)
+        ok = region_vars[k] < m_var_sizes.size();
+    for (MPLPIndexType k=0; ok && k<h->n_region_intersects; ++k)
+        ok = region_intersects[k] < h->n_intersects;
+    for (MPLPIndexType ri=0; ok && ri<h->n_regions; ++ri)
+        ok = region_intersect[ri] < h->n_intersects;
+
+    // The intersection sets and regions of the model come first. Only intersection sets can have been
+    // added to them since (by AddAllEdgeIntersections).
+    for (MPLPIndexType si=0; ok && si<m_all_intersects.size(); ++si)
+        ok = m_all_intersects[si].size() == intersect_begin[si+1] - intersect_begin[si] &&
+                equal(m_all_intersects[si].begin(), m_all_intersects[si].end(), intersect_vars + intersect_begin[si]);
+    for (MPLPIndexType ri=0; ok && ri<m_all_regions.size(); ++ri){
+        const Region & region = m_all_regions[ri];
+        ok = region.m_region_intersect == region_intersect[ri] && region.m_region_inds.size() == region_var_begin[ri+1] - region_var_begin[ri] &&
+                equal(region.m_region_inds.begin(), region.m_region_inds.end(), region_vars + region_var_begin[ri]) &&
+                region.m_intersect_inds.size() <= region_intersect_begin[ri+1] - region_intersect_begin[ri] &&
+                equal(region.m_intersect_inds.begin(), region.m_intersect_inds.end(), region_intersects + region_intersect_begin[ri]);
+    }
+
+    // The number of values must match the tables these describe
+    MPLPIndexType n_values = 0;
+    vector<MPLPIndexType> intersect_size(ok ? h->n_intersects : 0, 1);
+    for (MPLPIndexType si=0; si<intersect_size.size(); ++si){
+        for (MPLPIndexType k=intersect_begin[si]; k<intersect_begin[si+1]; ++k)
+            intersect_size[si]*= m_var_sizes[intersect_vars[k]];
+        n_values+= intersect_size[si];
+    }
+    for (MPLPIndexType k=0; ok && k<h->n_region_intersects; ++k)
+        n_values+= intersect_size[region_intersects[k]];
+    if (!ok || n_values != h->n_values){
+        cerr << fname << " is not a checkpoint of this model" << endl;
+        return false;
+    }
+
+    // Rebuild the relaxation
+    for (MPLPIndexType si=m_all_intersects.size(); si<h->n_intersects; ++si){
+        vector<MPLPIndexType> inds(intersect_vars + intersect_begin[si], intersect_vars + intersect_begin[si+1]);
+        AddIntersectionSet(inds);
+    }
+    vector<vector<MPLPIndexType> > added(m_all_regions.size());
+    for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri)
+        added[ri].assign(region_intersects + region_intersect_begin[ri] + m_all_regions[ri].m_intersect_inds.size(), region_intersects + region_intersect_begin[ri+1]);
+    AddRegionIntersectionSets(added);
+    for (MPLPIndexType ri=m_all_regions.size(); ri<h->n_regions; ++ri){
+        vector<MPLPIndexType> inds(region_vars + region_var_begin[ri], region_vars + region_var_begin[ri+1]);
+        vector<MPLPIndexType> intersect_inds(region_intersects + region_intersect_begin[ri], region_intersects + region_intersect_begin[ri+1]);
+        PushRegion(inds, intersect_inds, region_intersect[ri]);
+        m_region_lambdas.push_back(MulDimArr());
+    }
+    evidence.clear();
+    for (MPLPIndexType k=0; k<h->n_evidence; ++k)
+        evidence[evid[2*k]] = evid[2*k+1];
+    MarkEvidence();
+    m_topology.BuildChains();
+    m_all_edge_intersections = h->all_edge_intersections != 0;
+
+    // ... and the dual solution
+    const MPLPValueType *p = values;
+    for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); p+= m_sum_into_intersects[si++].m_n_prodsize)
+        memcpy(m_sum_into_intersects[si].m_dat, p, m_sum_into_intersects[si].m_n_prodsize*sizeof(MPLPValueType));
+    for (MPLPIndexType k=0; k<m_msgs.size(); p+= m_msgs[k++].m_n_prodsize)
+        memcpy(m_msgs[k].m_dat, p, m_msgs[k].m_n_prodsize*sizeof(MPLPValueType));
+    m_residual.clear();
+    m_residual_buckets.clear();
+    m_intersect_max_valid = false;
+
+    total_mplp_iterations = h->total_mplp_iterations;
+    previous_run_of_global_decoding = h->previous_run_of_global_decoding;
+    last_obj = h->last_obj;
+    m_temperature = h->temperature;
+    // The caller seeded rand() as for the run that wrote the checkpoint
+    while (RandDraws() < h->rand_draws)
+        Rand();
+
+    // The incumbent goes into the (new) result file again
+    m_best_decoded_res.assign(best, best + m_var_sizes.size());
+    m_decoded_res = m_best_decoded_res;
+    ResetDecodedScore();
+    m_best_val = h->best_val;
+    if (m_best_val > -MPLP_huge)
+        Write();
+    return true;
+}
+
+void mplpLib::MPLPAlg::BeginUndo()
+{
+    if (m_undo_levels.empty())
+        m_undo_stamp.assign(m_sum_into_intersects.size() + Regions().size(), 0);
+    m_undo_levels.push_back(make_pair(MPLPIndexType(m_undo_entries.size()), ++m_undo_count));
+}
+
+void mplpLib::MPLPAlg::TouchIntersectionSet(MPLPIndexType si)
+{
+    if (m_undo_levels.empty() || m_undo_stamp[si] == m_undo_levels.back().second)
+        return;
+    UndoEntry e = {si, m_undo_values.size(), m_undo_stamp[si]};
+    m_undo_entries.push_back(e);
+    m_undo_values.insert(m_undo_values.end(), m_sum_into_intersects[si].m_dat, m_sum_into_intersects[si].m_dat + m_sum_into_intersects[si].m_n_prodsize);
+    m_undo_stamp[si] = m_undo_levels.back().second;
+}
+
+void mplpLib::MPLPAlg::TouchRegion(MPLPIndexType ri)
+{
+    if (m_undo_levels.empty())
+        return;
+    const MPLPIndexType table = m_sum_into_intersects.size() + ri;
+    if (m_undo_stamp[table] != m_undo_levels.back().second){
+        UndoEntry e = {table, m_undo_values.size(), m_undo_stamp[table]};
+        m_undo_entries.push_back(e);
+        for (MPLPIndexType k=Topology().m_intersect_begin[ri]; k<Topology().m_intersect_begin[ri+1]; ++k)
+            m_undo_values.insert(m_undo_values.end(), m_msgs[k].m_dat, m_msgs[k].m_ep);
+        m_undo_stamp[table] = m_undo_levels.back().second;
+    }
+    const Region & region = Regions()[ri];
+    TouchIntersectionSet(region.m_region_intersect);
+    for (MPLPIndexType k=0; k<region.m_intersect_inds.size(); ++k)
+        TouchIntersectionSet(region.m_intersect_inds[k]);
+}
+
+void mplpLib::MPLPAlg::Undo()
+{
+    assert(!m_undo_levels.empty());
+    const MPLPIndexType first = m_undo_levels.back().first;
+    for (MPLPIndexType k=first; k<m_undo_entries.size(); ++k){
+        const UndoEntry & e = m_undo_entries[k];
+        const MPLPValueType *p = &m_undo_values[0] + e.offset;
+        if (e.table < m_sum_into_intersects.size()){
+            memcpy(m_sum_into_intersects[e.table].m_dat, p, m_sum_into_intersects[e.table].m_n_prodsize*sizeof(MPLPValueType));
+        }else{
+            const MPLPIndexType ri = e.table - m_sum_into_intersects.size();
+            for (MPLPIndexType j=Topology().m_intersect_begin[ri]; j<Topology().m_intersect_begin[ri+1]; p+= m_msgs[j++].m_n_prodsize)
+                memcpy(m_msgs[j].m_dat, p, m_msgs[j].m_n_prodsize*sizeof(MPLPValueType));
+        }
+        m_undo_stamp[e.table] = e.prev_stamp;
+    }
+    if (first < m_undo_entries.size())
+        m_undo_values.resize(m_undo_entries[first].offset);
+    m_undo_entries.resize(first);
+    m_undo_levels.pop_back();
+    m_intersect_max_valid = false;
+}
+
+mplpLib::MPLPIndexType mplpLib::MPLPAlg::PropagateClamps(const vector<MPLPIndexType> & clamped)
+{
+    const vector<Region> & regions = Regions();
+    m_propagated.clear();
+    if (m_decoding_radius == 0){
+        for (MPLPIndexType it=0; it<MPLP_DECODING_SWEEPS; ++it){
+            for (MPLPIndexType ri=0; ri<regions.size(); ++ri){
+                TouchRegion(ri);
+                regions[ri].UpdateMsgs(m_sum_into_intersects, Msgs(ri));
+            }
+
+            // Re-run local decoding, as some of the unfixed variables' assignments may have changed
+            LocalDecode();
+            UpdateResult();
+        }
+        for (MPLPIndexType ri=0; ri<regions.size(); ++ri)
+            m_propagated.push_back(ri);
+        return MPLP_DECODING_SWEEPS;
+    }
+
+    // Regions within m_decoding_radius steps of the clamped variables, a step going from an intersection
+    // set to the regions touching it and on to their other intersection sets
+    const MPLPTopology & t = Topology();
+    m_propagate_mark.resize(regions.size(), 0);
+    for (MPLPIndexType j=0; j<clamped.size(); ++j){
+        const vector<MPLPCompactIndexType> & touching = t.m_intersect_regions[clamped[j]];
+        for (MPLPIndexType k=0; k<touching.size(); ++k)
+            if (!m_propagate_mark[touching[k]]){
+                m_propagate_mark[touching[k]] = 1;
+                m_propagated.push_back(touching[k]);
+            }
+    }
+    for (MPLPIndexType d=1, begin=0; d<m_decoding_radius; ++d){
+        const MPLPIndexType end = m_propagated.size();
+        for (MPLPIndexType j=begin; j<end; ++j){
+            const MPLPIndexType ri = m_propagated[j];
+            for (MPLPIndexType k=t.m_intersect_begin[ri]; k<=t.m_intersect_begin[ri+1]; ++k){
+                const MPLPIndexType si = k < t.m_intersect_begin[ri+1] ? t.m_intersects[k] : t.m_region_intersect[ri];
+                const vector<MPLPCompactIndexType> & touching = t.m_intersect_regions[si];
+                for (MPLPIndexType r=0; r<touching.size(); ++r)
+                    if (!m_propagate_mark[touching[r]]){
+                        m_propagate_mark[touching[r]] = 1;
+                        m_propagated.push_back(touching[r]);
+                    }
+            }
+        }
+        begin = end;
+    }
+    for (MPLPIndexType j=0; j<m_propagated.size(); ++j)
+        m_propagate_mark[m_propagated[j]] = 0;
+    // Updated in the order of a sweep
+    sort(m_propagated.begin(), m_propagated.end());
+
+    // Only the beliefs written below need to be decoded again
+    if (!m_intersect_max_valid){
+        LocalDecode();
+        m_intersect_max_valid = true;
+    }
+    for (MPLPIndexType j=0; j<clamped.size(); ++j)
+        MarkIntersectionChanged(clamped[j]);
+
+    MPLPIndexType it = 0;
+    while (it < MPLP_DECODING_SWEEPS){
+        double change = 0;
+        for (MPLPIndexType j=0; j<m_propagated.size(); ++j){
+            const MPLPIndexType ri = m_propagated[j];
+            TouchRegion(ri);
+            m_old_msgs.clear();
+            for (MPLPIndexType k=t.m_intersect_begin[ri]; k<t.m_intersect_begin[ri+1]; ++k)
+                m_old_msgs.insert(m_old_msgs.end(), m_msgs[k].m_dat, m_msgs[k].m_ep);
+
+            regions[ri].UpdateMsgs(m_sum_into_intersects, Msgs(ri));
+            for (MPLPIndexType k=t.m_intersect_begin[ri]; k<t.m_intersect_begin[ri+1]; ++k)
+                MarkIntersectionChanged(t.m_intersects[k]);
+            MarkIntersectionChanged(t.m_region_intersect[ri]);
+
+            for (MPLPIndexType k=t.m_intersect_begin[ri], off=0; k<t.m_intersect_begin[ri+1]; off+= m_msgs[k++].m_n_prodsize)
+                for (MPLPIndexType x=0; x<m_msgs[k].m_n_prodsize; ++x)
+                    change = max(change, (double)fabs(m_msgs[k].m_dat[x] - m_old_msgs[off + x]));
+        }
+        it++;
+
+        LocalDecode(true);
+        UpdateResult();
+        if (change < MPLP_DECODING_RESIDUAL)
+            break;
+    }
+    return it;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //
 // The below code is not used in UAI '12 paper, but rather was used in the UAI
@@ -651,10 +2054,8 @@ void mplpLib::MPLPAlg::RunGlobalDecoding(bool exhaustive){
     }
 
     std::set<MPLPIndexType> not_decoded;
-    double global_decoding_start_time = (double)clock();
+    double global_decoding_start_time = (double)WallClock();
 
-    std::vector< std::vector< std::vector<double> > > tmp_msgs;
-    std::vector< std::vector<double> > tmp_sums;
     std::map<MPLPIndexType, MPLPIndexType> tmp_evid = evidence;//, max_at;
     //std::map<int, double> gap_vals;
     MPLPIndexType *max_at = new MPLPIndexType[m_var_sizes.size()];
@@ -662,22 +2063,8 @@ void mplpLib::MPLPAlg::RunGlobalDecoding(bool exhaustive){
 
     MPLPIndexType num_mplp_iters_global_decoding = 0;
 
-    for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-        tmp_msgs.push_back(std::vector< std::vector<double> >());
-        for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-            tmp_msgs[i].push_back(std::vector<double>());
-            for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                tmp_msgs[i][j].push_back(m_all_regions[i].m_msgs_from_region[j].m_dat[k]);
-            }
-        }
-    }
-
-    for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-        tmp_sums.push_back(std::vector<double>());
-        for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-            tmp_sums[i].push_back(m_sum_into_intersects[i].m_dat[j]);
-        }
-    }
+    // Everything changed from here on is put back at the end
+    BeginUndo();
 
     // Initialize all variables as not yet decoded
     for (MPLPIndexType i = 0; i < m_var_sizes.size(); ++i){
@@ -687,6 +2074,7 @@ void mplpLib::MPLPAlg::RunGlobalDecoding(bool exhaustive){
     }
 
     MPLPIndexType m;
+    std::vector<MPLPIndexType> clamped;
     while (!not_decoded.empty()){
         double biggest_gap = -MPLP_huge;
         for (std::set<MPLPIndexType>::iterator s_it = not_decoded.begin(); s_it != not_decoded.end(); ++s_it){
@@ -705,59 +2093,49 @@ void mplpLib::MPLPAlg::RunGlobalDecoding(bool exhaustive){
         }
 
         // Iterative over nodes not yet decoded (TODO: use a reasonable gap criterion)
-        for (std::set<MPLPIndexType>::iterator s_it = not_decoded.begin(); s_it != not_decoded.end(); s_it++){
-            if (gap_vals[*s_it] >= biggest_gap){   //gap stores argmax of reparametrized local potential in max_at
+        // (the node is erased only after its last use, and the iterator is moved past it first)
+        for (std::set<MPLPIndexType>::iterator s_it = not_decoded.begin(); s_it != not_decoded.end(); ){
+            MPLPIndexType v = *s_it;
+            if (gap_vals[v] >= biggest_gap){   //gap stores argmax of reparametrized local potential in max_at
 
-                evidence[*s_it] = max_at[*s_it];   //note: this is not permanent
+                evidence[v] = max_at[v];   //note: this is not permanent
 
-                m_decoded_res[*s_it] = max_at[*s_it];
-                not_decoded.erase(*s_it);
+                m_is_evidence[v] = 1;
 
+                SetDecodedLabel(v, max_at[v]);
+                not_decoded.erase(s_it++);
+                clamped.push_back(v);
+
+                TouchIntersectionSet(v);
                 MPLPIndexType i;
-                for (i = 0; i < max_at[*s_it]; ++i){
-                    m_sum_into_intersects[*s_it][i] = -MPLP_huge;
+                for (i = 0; i < max_at[v]; ++i){
+                    m_sum_into_intersects[v][i] = -MPLP_VALUE_HUGE;
                 }
-                while (++i < m_var_sizes[*s_it]){
-                    m_sum_into_intersects[*s_it][i] = -MPLP_huge;
+                while (++i < m_var_sizes[v]){
+                    m_sum_into_intersects[v][i] = -MPLP_VALUE_HUGE;
                 }
 
                 if(exhaustive)
                     break;
             }
+            else
+                ++s_it;
         }
 
-        for (MPLPIndexType it=0; it<10; ++it){
-            for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
-                m_all_regions[ri].UpdateMsgs(m_sum_into_intersects);
-            }
-            num_mplp_iters_global_decoding++;
-
-            // Re-run local decoding, as some of the unfixed variables' assignments may have changed
-            LocalDecode();
-            UpdateResult();
-        }
+        num_mplp_iters_global_decoding+= PropagateClamps(clamped);
+        clamped.clear();
 
         // Give up after 100 rounds (1000 total MPLP iterations)
         //		if(!exhaustive && num_mplp_iters_global_decoding >= 1000)
         //		  break;
     }
 
-    for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-        for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-            for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                m_all_regions[i].m_msgs_from_region[j].m_dat[k] = tmp_msgs[i][j][k];
-            }
-        }
-    }
-    for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-        for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-            m_sum_into_intersects[i].m_dat[j] = tmp_sums[i][j];
-        }
-    }
+    Undo();
     evidence = tmp_evid;
+    MarkEvidence();
 
     previous_run_of_global_decoding = total_mplp_iterations;
-    last_global_decoding_end_time = (double)clock();
+    last_global_decoding_end_time = (double)WallClock();
     last_global_decoding_total_time = (last_global_decoding_end_time - global_decoding_start_time)/CLOCKS_PER_SEC;
 
     delete [] max_at;
@@ -771,60 +2149,36 @@ void mplpLib::MPLPAlg::RunGlobalDecoding2(bool exhaustive){
         cout << "Running global decoding2..." << endl;
     }
 
-    std::set<MPLPIndexType> not_decoded;
-    double global_decoding_start_time = (double)clock();
+    double global_decoding_start_time = (double)WallClock();
 
     //int m, i, j;
-    std::vector< std::vector< std::vector<double> > > tmp_msgs;
-    std::vector< std::vector<double> > tmp_sums;
     std::map<MPLPIndexType, MPLPIndexType> tmp_evid = evidence;//, max_at;
     MPLPIndexType *max_at = new MPLPIndexType[m_var_sizes.size()];
-    double *gap_vals = new double [m_var_sizes.size()];
 
     MPLPIndexType num_mplp_iters_global_decoding = 0;
 
-    //saving current mplp state
-    for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-        tmp_msgs.push_back(std::vector< std::vector<double> >());
-        for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-            tmp_msgs[i].push_back(std::vector<double>());
-            for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                tmp_msgs[i][j].push_back(m_all_regions[i].m_msgs_from_region[j].m_dat[k]);
-            }
-        }
-    }
+    // Everything changed from here on is put back at the end
+    BeginUndo();
 
-    for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-        tmp_sums.push_back(std::vector<double>());
-        for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-            tmp_sums[i].push_back(m_sum_into_intersects[i].m_dat[j]);
-        }
-    }
-
-    // find all variables that are not yet decoded
+    // The variables not yet decoded, by gap. Tied nodes come out in a random order (their ties are
+    // drawn here). A gap is recomputed only when the beliefs of its variable are written by one of
+    // the regions updated by PropagateClamps, which are marked in gap_dirty.
+    IndexedMinHeap not_decoded;
+    not_decoded.Reset(m_var_sizes.size());
+    std::vector<unsigned char> gap_dirty(m_var_sizes.size(), 0);
+    std::vector<MPLPIndexType> dirty_vars;
+    MPLPIndexType m;
     for (MPLPIndexType i = 0; i < m_var_sizes.size(); ++i){
         if (evidence.find(i) == evidence.end()){
-            not_decoded.insert(i);
+            not_decoded.Push(i, gap(i, m), TrialRand());
+            max_at[i] = m;
         }
     }
 
-    MPLPIndexType m;
-    while (!not_decoded.empty()){
-        double smallest_gap = MPLP_huge;
-        MPLPIndexType index_smallest = 0;
-        for (std::set<MPLPIndexType>::iterator s_it = not_decoded.begin(); s_it != not_decoded.end(); ++s_it){
-            if( ( gap_vals[*s_it] = gap(*s_it, m) ) < smallest_gap) {
-                smallest_gap = gap_vals[*s_it];
-                index_smallest = *s_it;
-            }else if (gap_vals[*s_it] == smallest_gap){
-                if (rand() % 2){   //some randomness for tied nodes (but this may still not be uniform)
-                    if(MPLP_DEBUG_MODE)
-                        cout << "Adding some randomness to globaldecoding2" << endl;
-                    index_smallest = *s_it;
-                }
-            }
-            max_at[*s_it] = m;
-        }
+    const MPLPTopology & t = Topology();
+    while (!not_decoded.Empty()){
+        const MPLPIndexType index_smallest = not_decoded.Top();
+        const double smallest_gap = not_decoded.TopKey();
         // Stopping criterion
         if(!exhaustive && smallest_gap > MPLP_GAP_THR)
             break;
@@ -834,27 +2188,39 @@ void mplpLib::MPLPAlg::RunGlobalDecoding2(bool exhaustive){
 
         // Fix one at a time
         evidence[index_smallest] = max_at[index_smallest];   //note: this is not permanent
-        m_decoded_res[index_smallest] = max_at[index_smallest];
-        not_decoded.erase(index_smallest);
+        m_is_evidence[index_smallest] = 1;
+        SetDecodedLabel(index_smallest, max_at[index_smallest]);
+        not_decoded.Pop();
 
+        TouchIntersectionSet(index_smallest);
         MPLPIndexType i;
         for (i = 0; i < max_at[index_smallest]; ++i){
-            m_sum_into_intersects[index_smallest][i] = -MPLP_huge;
+            m_sum_into_intersects[index_smallest][i] = -MPLP_VALUE_HUGE;
         }
         while (++i < m_var_sizes[index_smallest]){
-            m_sum_into_intersects[index_smallest][i] = -MPLP_huge;
+            m_sum_into_intersects[index_smallest][i] = -MPLP_VALUE_HUGE;
         }
 
-        for (MPLPIndexType it=0; it<10; ++it){
-            for (MPLPIndexType ri=0; ri<m_all_regions.size(); ++ri){
-                m_all_regions[ri].UpdateMsgs(m_sum_into_intersects);
-            }
-            num_mplp_iters_global_decoding++;
+        num_mplp_iters_global_decoding+= PropagateClamps(std::vector<MPLPIndexType>(1, index_smallest));
 
-            // Re-run local decoding, as some of the unfixed variables' assignments may have changed
-            LocalDecode();
-            UpdateResult();
+        for (MPLPIndexType j = 0; j < m_propagated.size(); ++j){
+            const MPLPIndexType ri = m_propagated[j];
+            for (MPLPIndexType k = t.m_intersect_begin[ri]; k <= t.m_intersect_begin[ri+1]; ++k){
+                const MPLPIndexType si = k < t.m_intersect_begin[ri+1] ? t.m_intersects[k] : t.m_region_intersect[ri];
+                const MPLPCompactIndexType var = t.m_singleton_var[si];
+                if (var != MPLP_NOT_SINGLETON && !gap_dirty[var] && not_decoded.Contains(var)){
+                    gap_dirty[var] = 1;
+                    dirty_vars.push_back(var);
+                }
+            }
         }
+        for (MPLPIndexType k = 0; k < dirty_vars.size(); ++k){
+            const MPLPIndexType var = dirty_vars[k];
+            not_decoded.Update(var, gap(var, m));
+            max_at[var] = m;
+            gap_dirty[var] = 0;
+        }
+        dirty_vars.clear();
 
         //		if(MPLP_DEBUG_MODE){
         //		  cout << "new int sol = " << m_best_val << endl;
@@ -868,29 +2234,77 @@ void mplpLib::MPLPAlg::RunGlobalDecoding2(bool exhaustive){
             break;
         }
     }
-    for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-        for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-            for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                m_all_regions[i].m_msgs_from_region[j].m_dat[k] = tmp_msgs[i][j][k];
-            }
-        }
-    }
-    for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-        for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-            m_sum_into_intersects[i].m_dat[j] = tmp_sums[i][j];
-        }
-    }
+    Undo();
     evidence = tmp_evid;
+    MarkEvidence();
 
     previous_run_of_global_decoding = total_mplp_iterations;
-    last_global_decoding_end_time = (double)clock();
+    last_global_decoding_end_time = (double)WallClock();
     last_global_decoding_total_time = (last_global_decoding_end_time - global_decoding_start_time)/CLOCKS_PER_SEC;
 
     delete [] max_at;
-    delete [] gap_vals;
 }
 
 
+void mplpLib::MPLPAlg::InitTrial(MPLPAlg & parent, unsigned int seed, double best_val)
+{
+    m_trial_parent = &parent;
+    m_trial_seed = seed;
+    start = parent.start;
+    time_limit = parent.time_limit;
+    m_best_val = best_val;
+    total_mplp_iterations = parent.total_mplp_iterations;
+    m_uaiCompetition = parent.m_uaiCompetition;
+    CSP_instance = parent.CSP_instance;
+
+    m_initialized = true;
+    m_var_sizes = parent.m_var_sizes;
+    evidence = parent.evidence;
+    m_is_evidence = parent.m_is_evidence;
+
+    // The regions and the topology are only read, through Regions() and Topology(). The trial
+    // changes its own copy of the beliefs and the messages, which is put in one buffer.
+    MPLPIndexType needed = 0;
+    for (MPLPIndexType si=0; si<parent.m_sum_into_intersects.size(); ++si)
+        needed+= MulDimArrArena::Padded(parent.m_sum_into_intersects[si].m_n_prodsize);
+    for (MPLPIndexType k=0; k<parent.m_msgs.size(); ++k)
+        needed+= MulDimArrArena::Padded(parent.m_msgs[k].m_n_prodsize);
+    m_trial_arena.Reserve(needed);
+    m_sum_into_intersects.resize(parent.m_sum_into_intersects.size());
+    for (MPLPIndexType si=0; si<m_sum_into_intersects.size(); ++si)
+        m_trial_arena.PlaceCopy(m_sum_into_intersects[si], parent.m_sum_into_intersects[si]);
+    m_msgs.resize(parent.m_msgs.size());
+    for (MPLPIndexType k=0; k<m_msgs.size(); ++k)
+        m_trial_arena.PlaceCopy(m_msgs[k], parent.m_msgs[k]);
+
+    // The potentials are only read, so the trial uses the tables of the parent
+    m_region_lambdas.resize(parent.m_region_lambdas.size());
+    for (MPLPIndexType ri=0; ri<m_region_lambdas.size(); ++ri){
+        m_region_lambdas[ri].m_n_prodsize = parent.m_region_lambdas[ri].m_n_prodsize;
+        if (m_region_lambdas[ri].m_n_prodsize) m_region_lambdas[ri].UseExternalData(parent.m_region_lambdas[ri].m_dat);
+    }
+    m_single_node_lambdas.resize(parent.m_single_node_lambdas.size());
+    for (MPLPIndexType ni=0; ni<m_single_node_lambdas.size(); ++ni){
+        m_single_node_lambdas[ni].m_n_prodsize = parent.m_single_node_lambdas[ni].m_n_prodsize;
+        if (m_single_node_lambdas[ni].m_n_prodsize) m_single_node_lambdas[ni].UseExternalData(parent.m_single_node_lambdas[ni].m_dat);
+    }
+
+    m_decoded_res = parent.m_decoded_res;
+    m_decoded_val = parent.m_decoded_val;
+    m_decoded_val_exact = parent.m_decoded_val_exact;
+    m_decoded_flat = parent.m_decoded_flat;
+    m_decoded_hash = parent.m_decoded_hash;
+    m_scored_hash = parent.m_scored_hash;
+    m_scored_val = parent.m_scored_val;
+    m_intersect_max_valid = false;
+    m_decoding_radius = parent.m_decoding_radius;
+}
+
+int mplpLib::MPLPAlg::TrialRand()
+{
+    return m_trial_parent != NULL ? rand_r(&m_trial_seed) : Rand();
+}
+
 // Do large numbers of random objective permutations, run 10 iterations of MPLP, restore
 void mplpLib::MPLPAlg::RunGlobalDecoding3(void){
 
@@ -898,59 +2312,65 @@ void mplpLib::MPLPAlg::RunGlobalDecoding3(void){
         cout << "Running global decoding3..." << endl;
     }
 
-    //saving current mplp state
-    std::vector< std::vector< std::vector<double> > > tmp_msgs;
-    std::vector< std::vector<double> > tmp_sums;
-    for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-        tmp_msgs.push_back(std::vector< std::vector<double> >());
-        for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-            tmp_msgs[i].push_back(std::vector<double>());
-            for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                tmp_msgs[i][j].push_back(m_all_regions[i].m_msgs_from_region[j].m_dat[k]);
-            }
-        }
-    }
-    for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-        tmp_sums.push_back(std::vector<double>());
-        for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-            tmp_sums[i].push_back(m_sum_into_intersects[i].m_dat[j]);
-        }
-    }
-
-    // Do large numbers of random objective permutations, run 4 iterations of MPLP, restore
-    for(MPLPIndexType trial=0; trial <= 10; trial++) {
-
-        for(MPLPIndexType si=0; si < m_var_sizes.size(); ++si) {
-            // Randomly perturb single node potentials
-            for(MPLPIndexType loc=0; loc < m_sum_into_intersects[si].m_n_prodsize; loc++) {
-                // TODO: how to set the scale?  perhaps look at objective value.
-                // For GRIDS, 10*.01 works well
-                //   -- does this just come from the randomness in decoding?
-                m_sum_into_intersects[si].m_dat[loc] += 10*.01 * rand() / double(RAND_MAX);
-            }
-        }
+    // The seeds of the trials are drawn in order, so that the run does not depend on the threads
+    std::vector<unsigned int> seeds(MPLP_DECODING_TRIALS);
+    for(MPLPIndexType trial=0; trial < MPLP_DECODING_TRIALS; trial++)
+        seeds[trial] = Rand();
+
+    // Each trial perturbs the beliefs of its own copy of the mplp state, decodes, and drops the copy.
+    // The exhaustive trial takes the longest and is handed out first. A trial keeps what beats the
+    // incumbent from before the trials.
+    const double best_val = m_best_val;
+    std::vector<std::vector<MPLPLabelType> > trial_res(MPLP_DECODING_TRIALS);
+    std::vector<double> trial_val(MPLP_DECODING_TRIALS, -MPLP_huge);
+    double last_trial_time = 0;
+    // Results are merged in the order the trials are handed out, so that ties go to the same trial on
+    // any number of threads (and to the trial that found it first on one thread). A finished trial
+    // merges its own result and the waiting results of the trials after it, once all trials before
+    // it are done, so that the incumbent is written as soon as it is known.
+    std::mutex merge_mutex;
+    std::vector<unsigned char> trial_done(MPLP_DECODING_TRIALS, 0);
+    MPLPIndexType next_merge = 0;
+    m_pool.ParallelFor(MPLP_DECODING_TRIALS, 1, [&](MPLPIndexType begin, MPLPIndexType end){
+        for (MPLPIndexType k=begin; k<end; ++k){
+            const MPLPIndexType trial = MPLP_DECODING_TRIALS - 1 - k;
+            MPLPAlg t;
+            t.InitTrial(*this, seeds[trial], best_val);
 
-        bool exhaustive = false;
-        if(trial == 10)
-            exhaustive = true;
-
-        RunGlobalDecoding(exhaustive);
-        RunGlobalDecoding2(exhaustive);
-
-        // Restoring MPLP state
-        for (MPLPIndexType i = 0; i < m_all_regions.size(); ++i){
-            for (MPLPIndexType j = 0; j < m_all_regions[i].m_msgs_from_region.size(); ++j){
-                for (MPLPIndexType k = 0; k < m_all_regions[i].m_msgs_from_region[j].m_n_prodsize; ++k){
-                    m_all_regions[i].m_msgs_from_region[j].m_dat[k] = tmp_msgs[i][j][k];
+            for(MPLPIndexType si=0; si < m_var_sizes.size(); ++si) {
+                // Randomly perturb single node potentials
+                for(MPLPIndexType loc=0; loc < t.m_sum_into_intersects[si].m_n_prodsize; loc++) {
+                    // TODO: how to set the scale?  perhaps look at objective value.
+                    // For GRIDS, 10*.01 works well
+                    //   -- does this just come from the randomness in decoding?
+                    t.m_sum_into_intersects[si].m_dat[loc] += 10*.01 * t.TrialRand() / double(RAND_MAX);
                 }
             }
-        }
-        for (MPLPIndexType i = 0; i < m_sum_into_intersects.size(); ++i){
-            for (MPLPIndexType j = 0; j < m_sum_into_intersects[i].m_n_prodsize; ++j){
-                m_sum_into_intersects[i].m_dat[j] = tmp_sums[i][j];
+
+            bool exhaustive = false;
+            if(trial == MPLP_DECODING_TRIALS - 1)
+                exhaustive = true;
+
+            t.RunGlobalDecoding(exhaustive);
+            t.RunGlobalDecoding2(exhaustive);
+            if (exhaustive)
+                last_trial_time = t.last_global_decoding_total_time;
+            if (t.m_best_val > best_val){
+                trial_res[k].swap(t.m_best_decoded_res);
+                trial_val[k] = t.m_best_val;
             }
+
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            trial_done[k] = 1;
+            for (; next_merge < MPLP_DECODING_TRIALS && trial_done[next_merge]; ++next_merge)
+                if (!trial_res[next_merge].empty())
+                    MergeIncumbent(trial_res[next_merge], trial_val[next_merge]);
         }
-    }
+    });
+
+    previous_run_of_global_decoding = total_mplp_iterations;
+    last_global_decoding_end_time = (double)WallClock();
+    last_global_decoding_total_time = last_trial_time;
 }
 
 
@@ -991,14 +2411,17 @@ bool mplpLib::MPLPAlg::RunDecimation(void){
             fixed_node = true;
 
             evidence[*s_it] = max_at[*s_it];   //note: this is permanently fixed for the current instance of MPLP
-            m_decoded_res[*s_it] = max_at[*s_it];
+
+            m_is_evidence[*s_it] = 1;
+            SetDecodedLabel(*s_it, max_at[*s_it]);
+            ScheduleIntersectionSet(*s_it, MPLP_huge);
 
             MPLPIndexType i;
             for (i = 0; i < max_at[*s_it]; ++i){
-                m_sum_into_intersects[*s_it][i] = -MPLP_huge;
+                m_sum_into_intersects[*s_it][i] = -MPLP_VALUE_HUGE;
             }
             while (++i < m_var_sizes[*s_it]){
-                m_sum_into_intersects[*s_it][i] = -MPLP_huge;
+                m_sum_into_intersects[*s_it][i] = -MPLP_VALUE_HUGE;
             }
         }
     }
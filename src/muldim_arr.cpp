@@ -10,8 +10,10 @@
 #include <math.h>
 #include <float.h>
 #include <cassert>
+#include <algorithm>
 
 #include <MPLP/muldim_arr.h>
+#include <MPLP/simd_kernels.h>
 
 using namespace std;
 
@@ -28,7 +30,8 @@ mplpLib::MulDimArr::MulDimArr(vector<MPLPIndexType> & base_sizes)
     m_n_prodsize = 1;
     for (MPLPIndexType i=0; i<base_sizes.size(); i++)
         m_n_prodsize*= base_sizes[i];
-    m_dat= new double[m_n_prodsize];
+    m_dat= new MPLPValueType[m_n_prodsize];
+    m_owns_data = true;
 
     // Initialize array to zero
     for(MPLPIndexType i=0; i< m_n_prodsize; i++)
@@ -41,9 +44,71 @@ mplpLib::MulDimArr::MulDimArr(const MulDimArr & v)
 {
     m_base_sizes = v.m_base_sizes;
     m_n_prodsize = v.m_n_prodsize;
-    m_dat= new double[m_n_prodsize];
+    m_dat= new MPLPValueType[m_n_prodsize];
     m_ep = &m_dat[m_n_prodsize];	
-    memcpy(m_dat,v.m_dat,m_n_prodsize*sizeof(double));
+    m_owns_data = true;
+    memcpy(m_dat,v.m_dat,m_n_prodsize*sizeof(MPLPValueType));
+}
+
+void mplpLib::MulDimArr::UseExternalData(MPLPValueType *p)
+{
+    if (m_owns_data && m_dat!=NULL){
+        memcpy(p, m_dat, m_n_prodsize*sizeof(MPLPValueType));
+        delete [] m_dat;
+    }
+    m_dat = p;
+    m_ep = &m_dat[m_n_prodsize];
+    m_owns_data = false;
+}
+
+mplpLib::MPLPIndexType mplpLib::MulDimArrArena::Padded(MPLPIndexType n)
+{
+    const MPLPIndexType line = 64/sizeof(MPLPValueType);
+    return n >= line ? n + line - 1 : n;
+}
+
+mplpLib::MPLPValueType * mplpLib::MulDimArrArena::Reserve(MPLPIndexType n)
+{
+    if (m_size + n <= m_capacity)
+        return NULL;
+
+    // Grow geometrically, since tightening keeps adding regions
+    MPLPIndexType capacity = max(2*m_capacity, m_size + n);
+    char *raw = new char[capacity*sizeof(MPLPValueType) + 63];
+    MPLPValueType *base = (MPLPValueType *)(((size_t)raw + 63) & ~(size_t)63);
+    if (m_size)
+        memcpy(base, m_base, m_size*sizeof(MPLPValueType));
+
+    MPLPValueType *old_base = m_base;
+    delete [] m_raw;
+    m_raw = raw;
+    m_base = base;
+    m_capacity = capacity;
+    return old_base;
+}
+
+void mplpLib::MulDimArrArena::Place(MulDimArr & arr)
+{
+    const MPLPIndexType line = 64/sizeof(MPLPValueType);
+    if (arr.m_n_prodsize >= line)
+        m_size = (m_size + line - 1)/line*line;
+    assert(m_size + arr.m_n_prodsize <= m_capacity);
+    arr.UseExternalData(m_base + m_size);
+    m_size+= arr.m_n_prodsize;
+}
+
+void mplpLib::MulDimArrArena::PlaceCopy(MulDimArr & arr, const MulDimArr & from)
+{
+    assert(arr.m_dat == NULL);
+    arr.m_base_sizes = from.m_base_sizes;
+    arr.m_n_prodsize = from.m_n_prodsize;
+    const MPLPIndexType line = 64/sizeof(MPLPValueType);
+    if (arr.m_n_prodsize >= line)
+        m_size = (m_size + line - 1)/line*line;
+    assert(m_size + arr.m_n_prodsize <= m_capacity);
+    arr.UseExternalData(m_base + m_size);
+    if (arr.m_n_prodsize) memcpy(arr.m_dat, from.m_dat, arr.m_n_prodsize*sizeof(MPLPValueType));
+    m_size+= arr.m_n_prodsize;
 }
 
 void mplpLib::MulDimArr::print(void) const
@@ -75,13 +140,36 @@ void mplpLib::MulDimArr::print_with_inds(void) const
 
 mplpLib::MulDimArr & mplpLib::MulDimArr::operator=(const MulDimArr & v)
 {
+    if (this == &v)
+        return (*this);
     m_base_sizes = v.m_base_sizes;
-    m_n_prodsize = v.m_n_prodsize;
-    if (m_dat!=NULL)
+    if (m_dat == NULL || m_n_prodsize != v.m_n_prodsize){
+        if (m_dat!=NULL && m_owns_data)
+            delete [] m_dat;
+        m_n_prodsize = v.m_n_prodsize;
+        m_dat= new MPLPValueType[m_n_prodsize];
+        m_ep = &m_dat[m_n_prodsize];
+        m_owns_data = true;
+    }
+    memcpy(m_dat,v.m_dat,m_n_prodsize*sizeof(MPLPValueType));
+    return (*this);
+}
+
+mplpLib::MulDimArr & mplpLib::MulDimArr::operator=(MulDimArr && v) noexcept
+{
+    if (this == &v)
+        return (*this);
+    if (m_dat!=NULL && m_owns_data)
         delete [] m_dat;
-    m_dat= new double[m_n_prodsize];
-    m_ep = &m_dat[m_n_prodsize];
-    memcpy(m_dat,v.m_dat,m_n_prodsize*sizeof(double));
+    m_base_sizes = std::move(v.m_base_sizes);
+    m_n_prodsize = v.m_n_prodsize;
+    m_dat = v.m_dat;
+    m_ep = v.m_ep;
+    m_owns_data = v.m_owns_data;
+    v.m_n_prodsize = 0;
+    v.m_dat = NULL;
+    v.m_ep = NULL;
+    v.m_owns_data = true;
     return (*this);
 }
 
@@ -148,6 +236,98 @@ inline void mplpLib::MulDimArr::BaseInc(vector<MPLPIndexType> & inds) const{
 }
 
 
+mplpLib::ExpandPlan::ExpandPlan(const vector<MPLPIndexType> & var_sizes_big, const vector<MPLPIndexType> & inds_of_small_in_big)
+{
+    MPLPIndexType nx = var_sizes_big.size();
+    assert(nx > 0 && nx <= MPLP_MAX_PLAN_DIMS);
+
+    // Stride of every big dimension in the small array (last variable of the small array moves fastest)
+    vector<MPLPIndexType> strides(nx, 0);
+    MPLPIndexType fact = 1;
+    for (MPLPIndexType i=inds_of_small_in_big.size(); i>0; i--) {
+        strides[inds_of_small_in_big[i-1]] = fact;
+        fact*= var_sizes_big[inds_of_small_in_big[i-1]];
+    }
+    m_small_prodsize = fact;
+
+    m_big_prodsize = 1;
+    for (MPLPIndexType i=0; i<nx; i++)
+        m_big_prodsize*= var_sizes_big[i];
+
+    // Merge adjacent dimensions which are laid out contiguously in both arrays (or not at all in the
+    // small one), and drop dimensions of size one. We go from the fastest moving dimension outwards.
+    for (MPLPIndexType i=nx; i>0; i--) {
+        MPLPIndexType size = var_sizes_big[i-1], stride = strides[i-1];
+        if (size == 1)
+            continue;
+        if (!m_sizes.empty() && stride == m_strides.back()*m_sizes.back()) {
+            m_sizes.back()*= size;
+            continue;
+        }
+        m_sizes.push_back(size);
+        m_strides.push_back(stride);
+    }
+    if (m_sizes.empty()) {
+        m_sizes.push_back(1);
+        m_strides.push_back(1);
+    }
+    reverse(m_sizes.begin(), m_sizes.end());
+    reverse(m_strides.begin(), m_strides.end());
+}
+
+namespace {
+
+using mplpLib::MPLPIndexType;
+using mplpLib::MPLPValueType;
+
+struct ExpandAddOp { inline void operator()(MPLPValueType & big, MPLPValueType small) const {big+= small;} };
+struct ExpandSubOp { inline void operator()(MPLPValueType & big, MPLPValueType small) const {big-= small;} };
+struct ExpandSetOp { inline void operator()(MPLPValueType & big, MPLPValueType small) const {big = small;} };
+
+/*
+ * Go over the big array in flat order, applying op(big[vi], small[ind]) where ind is the flat index
+ * in the small array of the sub-assignment corresponding to vi. The innermost dimension is done as a
+ * tight loop; the outer dimensions are walked with an odometer which keeps track of the small offset.
+ */
+template <class Op>
+void expand_walk(MPLPValueType *big, const MPLPValueType *small, const mplpLib::ExpandPlan & plan, Op op)
+{
+
+    const MPLPIndexType nd = plan.m_sizes.size();
+    const MPLPIndexType inner = plan.m_sizes[nd-1];
+    const MPLPIndexType inner_stride = plan.m_strides[nd-1];
+    MPLPIndexType ctr[MPLP_MAX_PLAN_DIMS] = {0};
+    MPLPIndexType off = 0;
+
+    for (MPLPValueType *big_end = big + plan.m_big_prodsize; big < big_end; big+= inner) {
+        if (inner_stride == 0) {
+            const MPLPValueType v = small[off];
+            for (MPLPIndexType i=0; i<inner; i++)
+                op(big[i], v);
+        }else if (inner_stride == 1) {
+            const MPLPValueType *p = small + off;
+            for (MPLPIndexType i=0; i<inner; i++)
+                op(big[i], p[i]);
+        }else{
+            const MPLPValueType *p = small + off;
+            for (MPLPIndexType i=0; i<inner; i++, p+= inner_stride)
+                op(big[i], *p);
+        }
+
+        // Move to the next row of the big array
+        for (MPLPIndexType d=nd-1; d>0; d--) {
+            off+= plan.m_strides[d-1];
+            if (++ctr[d-1] < plan.m_sizes[d-1])
+                break;
+            off-= plan.m_strides[d-1]*plan.m_sizes[d-1];
+            ctr[d-1] = 0;
+        }
+    }
+}
+
+} // namespace
+
+
 /* 
  *	Expand the current vector into a new (larger) multi dimensional vector.
  *   inds_in_big gives the indices of the small array variables in the big array
@@ -155,31 +335,14 @@ inline void mplpLib::MulDimArr::BaseInc(vector<MPLPIndexType> & inds) const{
  */
 void mplpLib::MulDimArr::ExpandAndAdd(MulDimArr & big_to_add_to, vector<MPLPIndexType> & inds_of_small_in_big)
 {
-    // TODO: Verify that var_sizes_big agrees with the var_sizes of the smaller (this) array
-    //	MulDimArr big_arr(var_sizes_big);
-    // This will index the big array
-    vector<MPLPIndexType> inds_for_big;
-
-    // Initialize vector of indices for big array to zeros.
-    for (MPLPIndexType i=0; i<big_to_add_to.m_base_sizes.size(); i++)
-        inds_for_big.push_back(0);
+    ExpandAndAdd(big_to_add_to, ExpandPlan(big_to_add_to.m_base_sizes, inds_of_small_in_big));
+}
 
-    // We now go over the big indices one by one, and for each, take the value from the indices
-    // corresponding to the small (this) array
-    double *big_dat = &big_to_add_to.m_dat[0];
-    for (MPLPIndexType vi=0; vi<big_to_add_to.m_n_prodsize; vi++)
-    {
-        // Get the flat index in the small array
-        MPLPIndexType ind = GetFlatIndFromBigSpecial(inds_for_big,inds_of_small_in_big);
-        // Put value in big array (note that the "safe" way to do this would be to translate inds_for_big into a flat index, but
-        // we don't do this to save computation
-        //		big_to_add_to.m_dat[vi] += m_dat[ind];
-        (*big_dat)+=m_dat[ind];
-        big_dat++;
-        // Move to the next indices for big (note again that we assume this corresponds to a flat index of vi+1)
-        big_to_add_to.BaseIncSpecial(inds_for_big);
-    }
-}	
+void mplpLib::MulDimArr::ExpandAndAdd(MulDimArr & big_to_add_to, const ExpandPlan & plan) const
+{
+    assert(plan.m_big_prodsize == big_to_add_to.m_n_prodsize && plan.m_small_prodsize == m_n_prodsize);
+    expand_walk(big_to_add_to.m_dat, m_dat, plan, ExpandAddOp());
+}
 
 
 /* 
@@ -189,31 +352,14 @@ void mplpLib::MulDimArr::ExpandAndAdd(MulDimArr & big_to_add_to, vector<MPLPInde
  */
 void mplpLib::MulDimArr::ExpandAndSubtract(MulDimArr & big_to_sub_from, vector<MPLPIndexType> & inds_of_small_in_big)
 {
-    // TODO: Verify that var_sizes_big agrees with the var_sizes of the smaller (this) array
-    //	MulDimArr big_arr(var_sizes_big);
-    // This will index the big array
-    vector<MPLPIndexType> inds_for_big;
-
-    // Initialize vector of indices for big array to zeros.
-    for (MPLPIndexType i=0; i<big_to_sub_from.m_base_sizes.size(); i++)
-        inds_for_big.push_back(0);
+    ExpandAndSubtract(big_to_sub_from, ExpandPlan(big_to_sub_from.m_base_sizes, inds_of_small_in_big));
+}
 
-    // We now go over the big indices one by one, and for each, take the value from the indices
-    // corresponding to the small (this) array
-    double *big_dat = &big_to_sub_from.m_dat[0];
-    for (MPLPIndexType vi=0; vi<big_to_sub_from.m_n_prodsize; vi++)
-    {
-        // Get the flat index in the small array
-        MPLPIndexType ind = GetFlatIndFromBigSpecial(inds_for_big,inds_of_small_in_big);
-        // Put value in big array (note that the "safe" way to do this would be to translate inds_for_big into a flat index, but
-        // we don't do this to save computation
-        //		big_to_sub_from.m_dat[vi] += m_dat[ind];
-        (*big_dat)-=m_dat[ind];
-        big_dat++;
-        // Move to the next indices for big (note again that we assume this corresponds to a flat index of vi+1)
-        big_to_sub_from.BaseIncSpecial(inds_for_big);
-    }
-}	
+void mplpLib::MulDimArr::ExpandAndSubtract(MulDimArr & big_to_sub_from, const ExpandPlan & plan) const
+{
+    assert(plan.m_big_prodsize == big_to_sub_from.m_n_prodsize && plan.m_small_prodsize == m_n_prodsize);
+    expand_walk(big_to_sub_from.m_dat, m_dat, plan, ExpandSubOp());
+}
 
 
 /* 
@@ -223,76 +369,46 @@ void mplpLib::MulDimArr::ExpandAndSubtract(MulDimArr & big_to_sub_from, vector<M
  */
 mplpLib::MulDimArr mplpLib::MulDimArr::Expand(vector<MPLPIndexType> & var_sizes_big, vector<MPLPIndexType> & inds_of_small_in_big)
 {
-    // TODO: Verify that var_sizes_big agrees with the var_sizes of the smaller (this) array
-    MulDimArr big_arr(var_sizes_big);
-    // This will index the big array
-    vector<MPLPIndexType> inds_for_big;
-
-    // Initialize vector of indices for big array to zeros.
-    for (MPLPIndexType i=0; i<var_sizes_big.size(); i++)
-        inds_for_big.push_back(0);
-
-    // We now go over the big indices one by one, and for each, take the value from the indices
-    // corresponding to the small (this) array
-    for (MPLPIndexType vi=0; vi<big_arr.m_n_prodsize; vi++)
-    {
-        // Get the flat index in the small array
-        MPLPIndexType ind = GetFlatIndFromBigSpecial(inds_for_big,inds_of_small_in_big);
-        // Put value in big array (note that the "safe" way to do this would be to translate inds_for_big into a flat index, but
-        // we don't do this to save computation
-        big_arr.m_dat[vi] = m_dat[ind];
-        // Move to the next indices for big (note again that we assume this corresponds to a flat index of vi+1)
-        big_arr.BaseIncSpecial(inds_for_big);
-    }
+    return Expand(var_sizes_big, ExpandPlan(var_sizes_big, inds_of_small_in_big));
+}
 
+mplpLib::MulDimArr mplpLib::MulDimArr::Expand(vector<MPLPIndexType> & var_sizes_big, const ExpandPlan & plan) const
+{
+    MulDimArr big_arr(var_sizes_big);
+    assert(plan.m_big_prodsize == big_arr.m_n_prodsize && plan.m_small_prodsize == m_n_prodsize);
+    expand_walk(big_arr.m_dat, m_dat, plan, ExpandSetOp());
     return big_arr;
-}	
+}
 
 
 mplpLib::MulDimArr & mplpLib::MulDimArr::operator*=(double val)
         {
-    double *p;
-    for (p=m_dat; p<m_ep; p++)
-        (*p)*=val;
+    GetSimdKernels().scale(m_dat, val, m_n_prodsize);
     return (*this);
         }
 
 mplpLib::MulDimArr & mplpLib::MulDimArr::operator=(double val)
 {
-    double *p;
-    for (p=m_dat; p<m_ep; p++)
-        (*p)=val;
+    GetSimdKernels().fill(m_dat, val, m_n_prodsize);
     return (*this);
 }
 
 mplpLib::MulDimArr & mplpLib::MulDimArr::operator+=(MulDimArr & v)
         {
-    double *p,*pv;
-    for (p=m_dat, pv=v.m_dat; p<m_ep; p++, pv++)
-        (*p)+=(*pv);
+    GetSimdKernels().add(m_dat, v.m_dat, m_n_prodsize);
     return (*this);
         }
 
 mplpLib::MulDimArr & mplpLib::MulDimArr::operator-=(MulDimArr & v)
         {
-    double *p,*pv;
-    for (p=m_dat, pv=v.m_dat; p<m_ep; p++, pv++)
-        (*p)-=(*pv);
+    GetSimdKernels().sub(m_dat, v.m_dat, m_n_prodsize);
     return (*this);
         }
 
+// Ties go to the last index
 double mplpLib::MulDimArr::Max(MPLPIndexType &max_at) const
 {
-    double m = m_dat[0];
-    max_at = 0;
-    for (MPLPIndexType i=1;i<m_n_prodsize; i++) {
-        if (m_dat[i]>=m)
-        {
-            max_at = i;
-            m=m_dat[i];
-        }
-    }
-    return m;
+    return GetSimdKernels().argmax(m_dat, m_n_prodsize, max_at);
 }
 
 
@@ -378,55 +494,302 @@ double mplpLib::MulDimArr::gap_over_free_variables(const vector<MPLPIndexType> &
         base += max_assignment[l] * fact;
         fact *= m_base_sizes[l];
     }
-    return HUGE;   //all variables are fixed
+    return HUGE_VAL;   //all variables are fixed
+}
+
+mplpLib::MarginalPlan::MarginalPlan(const vector<MPLPIndexType> & var_sizes_big, const vector<vector<MPLPIndexType> > & all_subset_inds) : m_kind(GENERIC), m_sizes(var_sizes_big)
+{
+    MPLPIndexType nx = var_sizes_big.size(), nSubsets = all_subset_inds.size();
+    // Regions whose variables are all evidence have no variables (and no intersection sets)
+    assert(nx <= MPLP_MAX_PLAN_DIMS);
+
+    for (MPLPIndexType si=0; si<nSubsets; si++) {
+        const vector<MPLPIndexType> & inds = all_subset_inds[si];
+        vector<MPLPIndexType> strides(nx, 0);
+        MPLPIndexType fact = 1;
+        bool in_order = inds.size() == nx;
+        for (MPLPIndexType i=inds.size(); i>0; i--) {
+            strides[inds[i-1]] = fact;
+            fact*= var_sizes_big[inds[i-1]];
+            in_order = in_order && inds[i-1] == i-1;
+        }
+        m_strides.push_back(strides);
+        m_is_copy.push_back(in_order);
+    }
+
+    // Edge regions which send messages to their two variables
+    if (nx == 2 && nSubsets == 2 && all_subset_inds[0].size() == 1 && all_subset_inds[1].size() == 1 && all_subset_inds[0][0] != all_subset_inds[1][0]) {
+        m_kind = PAIR;
+        m_slot[all_subset_inds[0][0]] = 0;
+        m_slot[all_subset_inds[1][0]] = 1;
+    }
+
+    // Triplet regions which send messages to their three edges, in any order and orientation
+    if (nx == 3 && nSubsets == 3) {
+        bool seen[3] = {false, false, false};
+        for (MPLPIndexType si=0; si<nSubsets; si++) {
+            if (all_subset_inds[si].size() != 2)
+                break;
+            MPLPIndexType a = min(all_subset_inds[si][0], all_subset_inds[si][1]), b = max(all_subset_inds[si][0], all_subset_inds[si][1]);
+            MPLPIndexType edge = (a == 0 && b == 1) ? 0 : (a == 1 && b == 2) ? 1 : (a == 0 && b == 2) ? 2 : 3;
+            if (edge == 3 || seen[edge])
+                break;
+            seen[edge] = true;
+            m_slot[edge] = si;
+        }
+        if (seen[0] && seen[1] && seen[2])
+            m_kind = TRIPLET;
+    }
 }
 
 // For a given subset of variables, for any assignment to the subset maximize over
 // the value of all variables outside the subset
-// TODO: Do this for multiple subsets simultaneously. Should be much more efficient!!
 void mplpLib::MulDimArr::max_into_multiple_subsets_special(vector<vector<MPLPIndexType> > & all_subset_inds, vector<MulDimArr> & all_max_res) const
 {
-    // Prepare a MulDimArr into which we'll maximize
-    // First set its size
-    MPLPIndexType nSubsets = all_subset_inds.size();
-
-    bool *b_need_max = new bool[nSubsets];
+    max_into_multiple_subsets(MarginalPlan(m_base_sizes, all_subset_inds), all_max_res.data());
+}
 
-    for (MPLPIndexType si=0; si<nSubsets; si++)
+// Same as above, but all of the subsets are filled in during a single sweep over the (this) array.
+// As before, values below MPLP_MAXMARG_FLOOR are reported as MPLP_MAXMARG_FLOOR.
+void mplpLib::MulDimArr::max_into_multiple_subsets(const MarginalPlan & plan, MulDimArr *all_max_res) const
+{
+    if (plan.m_strides.empty())
+        return;
+    switch (plan.m_kind)
     {
-        // If the subset equals the big array	then maximizing would give us the subset (assuming there is no reordering, which I think we can)
-        if (all_subset_inds[si].size()==m_base_sizes.size())
-        {
-            all_max_res[si] = (*this);
-            b_need_max[si] = 0;
+    case MarginalPlan::PAIR:
+        _max_into_pair(plan, all_max_res);
+        break;
+    case MarginalPlan::TRIPLET:
+        _max_into_triplet_edges(plan, all_max_res);
+        break;
+    default:
+        _max_into_generic(plan, all_max_res);
+        break;
+    }
+}
+
+// Row and column maxima of an edge table
+void mplpLib::MulDimArr::_max_into_pair(const MarginalPlan & plan, MulDimArr *all_max_res) const
+{
+    const MPLPIndexType n_rows = plan.m_sizes[0], n_cols = plan.m_sizes[1];
+    MPLPValueType *row_max = all_max_res[plan.m_slot[0]].m_dat;
+    MPLPValueType *col_max = all_max_res[plan.m_slot[1]].m_dat;
+    const MPLPValueType *p = m_dat;
+
+    // First row initializes the column maxima
+    MPLPValueType m = MPLP_MAXMARG_FLOOR;
+    for (MPLPIndexType j=0; j<n_cols; j++) {
+        m = max(m, p[j]);
+        col_max[j] = max(p[j], (MPLPValueType)MPLP_MAXMARG_FLOOR);
+    }
+    row_max[0] = m;
+
+    for (MPLPIndexType i=1; i<n_rows; i++) {
+        p+= n_cols;
+        m = MPLP_MAXMARG_FLOOR;
+        for (MPLPIndexType j=0; j<n_cols; j++) {
+            m = max(m, p[j]);
+            col_max[j] = max(col_max[j], p[j]);
         }
-        else
-        {
-            all_max_res[si] = -1e9;
-            b_need_max[si] = 1;
+        row_max[i] = m;
+    }
+}
+
+// Maxima of a triplet table into its three edges. Every entry of an edge table is written the
+// first time it is reached, so the outputs need not be reset beforehand.
+void mplpLib::MulDimArr::_max_into_triplet_edges(const MarginalPlan & plan, MulDimArr *all_max_res) const
+{
+    const MPLPIndexType n_i = plan.m_sizes[0], n_j = plan.m_sizes[1], n_k = plan.m_sizes[2];
+    const vector<MPLPIndexType> & s_ij = plan.m_strides[plan.m_slot[0]];
+    const vector<MPLPIndexType> & s_jk = plan.m_strides[plan.m_slot[1]];
+    const vector<MPLPIndexType> & s_ik = plan.m_strides[plan.m_slot[2]];
+    MPLPValueType *ij = all_max_res[plan.m_slot[0]].m_dat;
+    MPLPValueType *jk = all_max_res[plan.m_slot[1]].m_dat;
+    MPLPValueType *ik = all_max_res[plan.m_slot[2]].m_dat;
+    const MPLPIndexType jk_k = s_jk[2], ik_k = s_ik[2];
+    const MPLPValueType *p = m_dat;
+
+    for (MPLPIndexType i=0; i<n_i; i++) {
+        MPLPValueType *ik_row = ik + i*s_ik[0];
+        for (MPLPIndexType j=0; j<n_j; j++, p+= n_k) {
+            MPLPValueType *jk_row = jk + j*s_jk[1];
+            MPLPValueType m = MPLP_MAXMARG_FLOOR;
+            if (i == 0 && j == 0) {
+                for (MPLPIndexType k=0; k<n_k; k++) {
+                    m = max(m, p[k]);
+                    jk_row[k*jk_k] = max(p[k], (MPLPValueType)MPLP_MAXMARG_FLOOR);
+                    ik_row[k*ik_k] = max(p[k], (MPLPValueType)MPLP_MAXMARG_FLOOR);
+                }
+            }else if (i == 0) {
+                for (MPLPIndexType k=0; k<n_k; k++) {
+                    m = max(m, p[k]);
+                    jk_row[k*jk_k] = max(p[k], (MPLPValueType)MPLP_MAXMARG_FLOOR);
+                    ik_row[k*ik_k] = max(ik_row[k*ik_k], p[k]);
+                }
+            }else if (j == 0) {
+                for (MPLPIndexType k=0; k<n_k; k++) {
+                    m = max(m, p[k]);
+                    jk_row[k*jk_k] = max(jk_row[k*jk_k], p[k]);
+                    ik_row[k*ik_k] = max(p[k], (MPLPValueType)MPLP_MAXMARG_FLOOR);
+                }
+            }else{
+                for (MPLPIndexType k=0; k<n_k; k++) {
+                    m = max(m, p[k]);
+                    jk_row[k*jk_k] = max(jk_row[k*jk_k], p[k]);
+                    ik_row[k*ik_k] = max(ik_row[k*ik_k], p[k]);
+                }
+            }
+            ij[i*s_ij[0] + j*s_ij[1]] = m;
         }
     }
-    // Go over all values of the big array (this). For each check if its
-    // value on the subset is larger than the current max
-    // NOTE: We make the same assumption here as in the Expand function, regaring
-    // the correspondence between the flat index (vi) and the the index vector inds_for_big
-    vector<MPLPIndexType> inds_for_big;
-    for (MPLPIndexType i=0; i< m_base_sizes.size(); i++)
-        inds_for_big.push_back(0);
+}
 
-    for (MPLPIndexType vi=0; vi<m_n_prodsize; vi++)
-    {
-        for (MPLPIndexType si=0; si<nSubsets; si++)
-        {
-            if (!b_need_max[si])
-                continue;
-            MPLPIndexType flat_subind = all_max_res[si].GetFlatIndFromBigSpecial(inds_for_big,all_subset_inds[si]);
-            all_max_res[si][flat_subind] = max(all_max_res[si][flat_subind],m_dat[vi]);
+// Any region and any intersection sets. The region is walked once in flat order, keeping the
+// offset into every intersection set up to date; the innermost variable is done as a tight loop.
+void mplpLib::MulDimArr::_max_into_generic(const MarginalPlan & plan, MulDimArr *all_max_res) const
+{
+    const MPLPIndexType nx = plan.m_sizes.size(), nSubsets = plan.m_strides.size();
+    const MPLPIndexType inner = plan.m_sizes[nx-1];
+
+    // Subsets still to be maximized into, and the current offset into each of them. Regions with
+    // few intersection sets (the usual case) keep these on the stack.
+    MPLPIndexType todo_buf[MPLP_MAX_PLAN_DIMS], offs_buf[MPLP_MAX_PLAN_DIMS];
+    vector<MPLPIndexType> todo_vec, offs_vec;
+    MPLPIndexType *todo = todo_buf, *offs = offs_buf, n_todo = 0;
+    if (nSubsets > MPLP_MAX_PLAN_DIMS) {
+        todo_vec.resize(nSubsets);
+        offs_vec.resize(nSubsets);
+        todo = &todo_vec[0];
+        offs = &offs_vec[0];
+    }
+
+    // If the subset equals the big array then maximizing would give us the subset
+    for (MPLPIndexType si=0; si<nSubsets; si++) {
+        if (plan.m_is_copy[si]) {
+            memcpy(all_max_res[si].m_dat, m_dat, m_n_prodsize*sizeof(MPLPValueType));
+        }else{
+            all_max_res[si] = MPLP_MAXMARG_FLOOR;
+            offs[n_todo] = 0;
+            todo[n_todo++] = si;
+        }
+    }
+    if (n_todo == 0)
+        return;
+
+    MPLPIndexType ctr[MPLP_MAX_PLAN_DIMS] = {0};
+
+    for (const MPLPValueType *p = m_dat; p < m_ep; p+= inner) {
+        MPLPValueType row_max = MPLP_MAXMARG_FLOOR;
+        bool have_row_max = false;
+        for (MPLPIndexType t=0; t<n_todo; t++) {
+            MPLPValueType *out = all_max_res[todo[t]].m_dat + offs[t];
+            const MPLPIndexType stride = plan.m_strides[todo[t]][nx-1];
+            if (stride == 0) {
+                if (!have_row_max) {
+                    for (MPLPIndexType k=0; k<inner; k++)
+                        row_max = max(row_max, p[k]);
+                    have_row_max = true;
+                }
+                *out = max(*out, row_max);
+            }else if (stride == 1) {
+                for (MPLPIndexType k=0; k<inner; k++)
+                    out[k] = max(out[k], p[k]);
+            }else{
+                for (MPLPIndexType k=0; k<inner; k++)
+                    out[k*stride] = max(out[k*stride], p[k]);
+            }
+        }
+
+        // Move to the next row, updating the offsets into the subsets
+        for (MPLPIndexType d=nx-1; d>0; d--) {
+            for (MPLPIndexType t=0; t<n_todo; t++)
+                offs[t]+= plan.m_strides[todo[t]][d-1];
+            if (++ctr[d-1] < plan.m_sizes[d-1])
+                break;
+            for (MPLPIndexType t=0; t<n_todo; t++)
+                offs[t]-= plan.m_strides[todo[t]][d-1]*plan.m_sizes[d-1];
+            ctr[d-1] = 0;
         }
-        BaseIncSpecial(inds_for_big);
     }
+}
 
-    delete [] b_need_max;
+// The maxima are computed first and taken out of the exponents, so that the sums of exponentials
+// are at least 1 and nothing overflows. The region is then walked as in _max_into_generic, summing
+// exp((x - max)/temperature) into a double per entry of every subset.
+void mplpLib::MulDimArr::softmax_into_multiple_subsets(const MarginalPlan & plan, MulDimArr *all_max_res, double temperature, vector<double> & work) const
+{
+    if (plan.m_strides.empty())
+        return;
+    max_into_multiple_subsets(plan, all_max_res);
+
+    const MPLPIndexType nx = plan.m_sizes.size(), nSubsets = plan.m_strides.size();
+    const MPLPIndexType inner = plan.m_sizes[nx-1];
+
+    // Subsets to sum into (copies of the region are already done), the current offset into each,
+    // and where its sums start in work
+    MPLPIndexType todo_buf[MPLP_MAX_PLAN_DIMS], offs_buf[MPLP_MAX_PLAN_DIMS], base_buf[MPLP_MAX_PLAN_DIMS];
+    vector<MPLPIndexType> todo_vec, offs_vec, base_vec;
+    MPLPIndexType *todo = todo_buf, *offs = offs_buf, *base = base_buf, n_todo = 0, n_sums = 0;
+    if (nSubsets > MPLP_MAX_PLAN_DIMS) {
+        todo_vec.resize(nSubsets);
+        offs_vec.resize(nSubsets);
+        base_vec.resize(nSubsets);
+        todo = &todo_vec[0];
+        offs = &offs_vec[0];
+        base = &base_vec[0];
+    }
+    for (MPLPIndexType si=0; si<nSubsets; si++) {
+        if (!plan.m_is_copy[si]) {
+            offs[n_todo] = 0;
+            base[n_todo] = n_sums;
+            todo[n_todo++] = si;
+            n_sums+= all_max_res[si].m_n_prodsize;
+        }
+    }
+    if (n_todo == 0)
+        return;
+    work.assign(n_sums, 0.0);
+
+    const SimdKernels & kernels = GetSimdKernels();
+    const double scale = 1.0/temperature;
+    MPLPIndexType ctr[MPLP_MAX_PLAN_DIMS] = {0};
+
+    for (const MPLPValueType *p = m_dat; p < m_ep; p+= inner) {
+        for (MPLPIndexType t=0; t<n_todo; t++) {
+            const MPLPValueType *m = all_max_res[todo[t]].m_dat + offs[t];
+            double *sum = &work[base[t] + offs[t]];
+            const MPLPIndexType stride = plan.m_strides[todo[t]][nx-1];
+            if (stride == 0) {
+                *sum+= kernels.sum_exp(p, *m, scale, inner);
+            }else if (stride == 1) {
+                kernels.acc_exp(sum, p, m, scale, inner);
+            }else{
+                for (MPLPIndexType k=0; k<inner; k++)
+                    if (scale*(p[k] - m[k*stride]) >= MPLP_EXP_MIN)
+                        sum[k*stride]+= exp(scale*(p[k] - m[k*stride]));
+            }
+        }
+
+        for (MPLPIndexType d=nx-1; d>0; d--) {
+            for (MPLPIndexType t=0; t<n_todo; t++)
+                offs[t]+= plan.m_strides[todo[t]][d-1];
+            if (++ctr[d-1] < plan.m_sizes[d-1])
+                break;
+            for (MPLPIndexType t=0; t<n_todo; t++)
+                offs[t]-= plan.m_strides[todo[t]][d-1]*plan.m_sizes[d-1];
+            ctr[d-1] = 0;
+        }
+    }
+
+    // Entries whose maximum was raised to MPLP_MAXMARG_FLOOR may have nothing to add
+    for (MPLPIndexType t=0; t<n_todo; t++) {
+        MPLPValueType *out = all_max_res[todo[t]].m_dat;
+        const double *sum = &work[base[t]];
+        for (MPLPIndexType y=0; y<all_max_res[todo[t]].m_n_prodsize; y++)
+            if (sum[y] > 0)
+                out[y]+= temperature*log(sum[y]);
+    }
 }
 
 void mplpLib::MulDimArr::Write(ofstream & ofs)
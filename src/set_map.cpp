@@ -0,0 +1,131 @@
+/*
+ *  set_map.cpp
+ *  mplp
+ *
+ *  See set_map.h.
+ *
+ */
+
+#include <assert.h>
+
+#include <MPLP/set_map.h>
+
+using namespace std;
+
+const mplpLib::MPLPIndexType mplpLib::VarSetMap::NOT_FOUND;
+
+namespace {
+
+const uint64_t TAG_SHIFT = 62;
+
+// Final mixing step of splitmix64, to spread the packed keys over the slots
+inline uint64_t Mix(uint64_t x)
+{
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+} // namespace
+
+bool mplpLib::VarSetMap::Key(const MPLPIndexType * vars, MPLPIndexType n, uint64_t & key)
+{
+    // The top two bits hold the size of a packed set, and are 0 for a hashed one
+    if (n == 1 && uint64_t(vars[0]) < (uint64_t(1) << TAG_SHIFT)){
+        key = (uint64_t(1) << TAG_SHIFT) | vars[0];
+        return true;
+    }
+    if (n == 2 && uint64_t(vars[1]) < (uint64_t(1) << 31)){
+        key = (uint64_t(2) << TAG_SHIFT) | (uint64_t(vars[0]) << 31) | vars[1];
+        return true;
+    }
+    if (n == 3 && uint64_t(vars[2]) < (uint64_t(1) << 20)){
+        key = (uint64_t(3) << TAG_SHIFT) | (uint64_t(vars[0]) << 40) | (uint64_t(vars[1]) << 20) | vars[2];
+        return true;
+    }
+    uint64_t h = n;
+    for (MPLPIndexType k=0; k<n; ++k)
+        h = Mix(h ^ vars[k]);
+    key = h & ((uint64_t(1) << TAG_SHIFT) - 1);
+    return false;
+}
+
+bool mplpLib::VarSetMap::Matches(const Slot & s, uint64_t key, const MPLPIndexType * vars, MPLPIndexType n) const
+{
+    if (s.key != key)
+        return false;
+    if (s.pool == NOT_FOUND)
+        return true;
+    if (m_pool[s.pool] != n)
+        return false;
+    for (MPLPIndexType k=0; k<n; ++k)
+        if (m_pool[s.pool + 1 + k] != vars[k])
+            return false;
+    return true;
+}
+
+void mplpLib::VarSetMap::Clear()
+{
+    m_slots.clear();
+    m_pool.clear();
+    m_size = 0;
+}
+
+mplpLib::MPLPIndexType mplpLib::VarSetMap::Find(const MPLPIndexType * vars, MPLPIndexType n) const
+{
+    if (m_slots.empty())
+        return NOT_FOUND;
+    uint64_t key;
+    Key(vars, n, key);
+    const MPLPIndexType mask = m_slots.size() - 1;
+    for (MPLPIndexType pos = Mix(key) & mask; m_slots[pos].value != NOT_FOUND; pos = (pos + 1) & mask){
+        if (Matches(m_slots[pos], key, vars, n))
+            return m_slots[pos].value;
+    }
+    return NOT_FOUND;
+}
+
+bool mplpLib::VarSetMap::Insert(const MPLPIndexType * vars, MPLPIndexType n, MPLPIndexType value)
+{
+    assert(value != NOT_FOUND);
+    if (2*(m_size + 1) > m_slots.size())
+        Grow();
+    uint64_t key;
+    const bool packed = Key(vars, n, key);
+    const MPLPIndexType mask = m_slots.size() - 1;
+    MPLPIndexType pos = Mix(key) & mask;
+    for (; m_slots[pos].value != NOT_FOUND; pos = (pos + 1) & mask){
+        if (Matches(m_slots[pos], key, vars, n))
+            return false;
+    }
+    Slot & s = m_slots[pos];
+    s.key = key;
+    s.value = value;
+    s.pool = NOT_FOUND;
+    if (!packed){
+        s.pool = m_pool.size();
+        m_pool.push_back(n);
+        m_pool.insert(m_pool.end(), vars, vars + n);
+    }
+    ++m_size;
+    return true;
+}
+
+void mplpLib::VarSetMap::Grow()
+{
+    vector<Slot> old;
+    old.swap(m_slots);
+    Slot empty = {0, NOT_FOUND, NOT_FOUND};
+    m_slots.assign(old.empty() ? 16 : 2*old.size(), empty);
+    // The keys stay the same, so the slots are just placed again
+    const MPLPIndexType mask = m_slots.size() - 1;
+    for (MPLPIndexType k=0; k<old.size(); ++k){
+        if (old[k].value == NOT_FOUND)
+            continue;
+        MPLPIndexType pos = Mix(old[k].key) & mask;
+        while (m_slots[pos].value != NOT_FOUND)
+            pos = (pos + 1) & mask;
+        m_slots[pos] = old[k];
+    }
+}
@@ -0,0 +1,369 @@
+/*
+ *  simd_kernels.cpp
+ *  mplp
+ *
+ *  See simd_kernels.h. Each instruction set gets its own copy of the kernels,
+ *  compiled with a GCC target attribute so that the rest of the library does not
+ *  need to be built with -mavx2 etc.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include <MPLP/simd_kernels.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MPLP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+using mplpLib::MPLPIndexType;
+using mplpLib::MPLPValueType;
+using mplpLib::MPLPCompactIndexType;
+
+// Finds the last position holding m, the maximum over src[0..n-1]
+inline MPLPIndexType last_index_of(const MPLPValueType *src, MPLPIndexType n, MPLPValueType m)
+{
+    MPLPIndexType i = n;
+    while (i > 1 && src[i-1] != m)
+        i--;
+    return i-1;
+}
+
+void add_scalar(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        dst[i]+= src[i];
+}
+
+void sub_scalar(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        dst[i]-= src[i];
+}
+
+void scale_scalar(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        dst[i]*= val;
+}
+
+void fill_scalar(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        dst[i] = val;
+}
+
+MPLPValueType argmax_scalar(const MPLPValueType *src, MPLPIndexType n, MPLPIndexType &max_at)
+{
+    MPLPValueType m = src[0];
+    max_at = 0;
+    for (MPLPIndexType i=1; i<n; i++) {
+        if (src[i]>=m)
+        {
+            max_at = i;
+            m=src[i];
+        }
+    }
+    return m;
+}
+
+void gather_add_scalar(double *acc, const MPLPValueType *table, const MPLPCompactIndexType *idx, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        acc[i]+= table[idx[i]];
+}
+
+inline double exp_or_zero(double x)
+{
+    return x < MPLP_EXP_MIN ? 0 : exp(x);
+}
+
+double sum_exp_scalar(const MPLPValueType *src, MPLPValueType shift, double scale, MPLPIndexType n)
+{
+    double sum = 0;
+    for (MPLPIndexType i=0; i<n; i++)
+        sum+= exp_or_zero(scale*(src[i] - shift));
+    return sum;
+}
+
+void acc_exp_scalar(double *acc, const MPLPValueType *src, const MPLPValueType *shift, double scale, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        acc[i]+= exp_or_zero(scale*(src[i] - shift[i]));
+}
+
+void max_add_scalar(double *acc, double row, const double *src, MPLPIndexType n)
+{
+    for (MPLPIndexType i=0; i<n; i++)
+        acc[i] = max(acc[i], row + src[i]);
+}
+
+#ifdef MPLP_SIMD_X86
+
+// Generates the five kernels for one instruction set. VEC is the register type, W the
+// number of values it holds, and LOAD/STORE/SET1/ADD/SUB/MUL/MAX the intrinsics.
+// The maximum is found with vector max operations, then its last position is looked
+// up with a backward scan, which keeps the "last index wins" behaviour.
+#define MPLP_SIMD_KERNELS(SUFFIX, TARGET, VEC, W, LOAD, STORE, SET1, ADD, SUB, MUL, MAX) \
+__attribute__((target(TARGET))) void add_##SUFFIX(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n) \
+{ \
+    MPLPIndexType i = 0; \
+    for (; i+W<=n; i+=W) \
+        STORE(dst+i, ADD(LOAD(dst+i), LOAD(src+i))); \
+    for (; i<n; i++) \
+        dst[i]+= src[i]; \
+} \
+__attribute__((target(TARGET))) void sub_##SUFFIX(MPLPValueType *dst, const MPLPValueType *src, MPLPIndexType n) \
+{ \
+    MPLPIndexType i = 0; \
+    for (; i+W<=n; i+=W) \
+        STORE(dst+i, SUB(LOAD(dst+i), LOAD(src+i))); \
+    for (; i<n; i++) \
+        dst[i]-= src[i]; \
+} \
+__attribute__((target(TARGET))) void scale_##SUFFIX(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n) \
+{ \
+    VEC v = SET1(val); \
+    MPLPIndexType i = 0; \
+    for (; i+W<=n; i+=W) \
+        STORE(dst+i, MUL(LOAD(dst+i), v)); \
+    for (; i<n; i++) \
+        dst[i]*= val; \
+} \
+__attribute__((target(TARGET))) void fill_##SUFFIX(MPLPValueType *dst, MPLPValueType val, MPLPIndexType n) \
+{ \
+    VEC v = SET1(val); \
+    MPLPIndexType i = 0; \
+    for (; i+W<=n; i+=W) \
+        STORE(dst+i, v); \
+    for (; i<n; i++) \
+        dst[i] = val; \
+} \
+__attribute__((target(TARGET))) MPLPValueType argmax_##SUFFIX(const MPLPValueType *src, MPLPIndexType n, MPLPIndexType &max_at) \
+{ \
+    if (n < 2*W) \
+        return argmax_scalar(src, n, max_at); \
+    VEC vm = LOAD(src); \
+    MPLPIndexType i = W; \
+    for (; i+W<=n; i+=W) \
+        vm = MAX(vm, LOAD(src+i)); \
+    MPLPValueType lanes[W]; \
+    STORE(lanes, vm); \
+    MPLPValueType m = lanes[0]; \
+    for (MPLPIndexType k=1; k<W; k++) \
+        if (lanes[k] > m) m = lanes[k]; \
+    for (; i<n; i++) \
+        if (src[i] > m) m = src[i]; \
+    max_at = last_index_of(src, n, m); \
+    return src[max_at]; \
+}
+
+#ifdef MPLP_FLOAT_MESSAGES
+MPLP_SIMD_KERNELS(sse4, "sse4.1", __m128, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_max_ps)
+MPLP_SIMD_KERNELS(avx2, "avx2", __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_max_ps)
+MPLP_SIMD_KERNELS(avx512, "avx512f", __m512, 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_max_ps)
+#else
+MPLP_SIMD_KERNELS(sse4, "sse4.1", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_max_pd)
+MPLP_SIMD_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_max_pd)
+MPLP_SIMD_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_max_pd)
+#endif
+
+#undef MPLP_SIMD_KERNELS
+
+// Gathers use 32-bit signed offsets, which is plenty for a single factor table. SSE4.1 has no
+// gather, so it uses the scalar loop.
+__attribute__((target("avx2"))) void gather_add_avx2(double *acc, const MPLPValueType *table, const MPLPCompactIndexType *idx, MPLPIndexType n)
+{
+    MPLPIndexType i = 0;
+    for (; i+4<=n; i+=4) {
+        __m128i vi = _mm_loadu_si128((const __m128i *)(idx+i));
+#ifdef MPLP_FLOAT_MESSAGES
+        __m256d v = _mm256_cvtps_pd(_mm_i32gather_ps(table, vi, 4));
+#else
+        __m256d v = _mm256_i32gather_pd(table, vi, 8);
+#endif
+        _mm256_storeu_pd(acc+i, _mm256_add_pd(_mm256_loadu_pd(acc+i), v));
+    }
+    for (; i<n; i++)
+        acc[i]+= table[idx[i]];
+}
+
+__attribute__((target("avx512f"))) void gather_add_avx512(double *acc, const MPLPValueType *table, const MPLPCompactIndexType *idx, MPLPIndexType n)
+{
+    MPLPIndexType i = 0;
+    for (; i+8<=n; i+=8) {
+        __m256i vi = _mm256_loadu_si256((const __m256i *)(idx+i));
+#ifdef MPLP_FLOAT_MESSAGES
+        __m512d v = _mm512_cvtps_pd(_mm256_i32gather_ps(table, vi, 4));
+#else
+        __m512d v = _mm512_i32gather_pd(vi, table, 8);
+#endif
+        _mm512_storeu_pd(acc+i, _mm512_add_pd(_mm512_loadu_pd(acc+i), v));
+    }
+    for (; i<n; i++)
+        acc[i]+= table[idx[i]];
+}
+
+/*
+ * exp() of 4 (AVX2) or 8 (AVX-512) doubles, as in the Cephes library: x = n log(2) + r with
+ * |r| <= log(2)/2, a rational approximation of exp(r), and 2^n put into the exponent bits.
+ * Accurate to about 1e-16 relative. Lanes below MPLP_EXP_MIN give 0; x must be below 709.
+ * SSE4.1 uses the scalar loops, which call exp().
+ */
+#define MPLP_EXP_REDUCE(SET1, ADD, SUB, MUL, DIV, MAX, ROUND) \
+    VEC xc = MAX(x, SET1(MPLP_EXP_MIN)); \
+    VEC n = ROUND(MUL(xc, SET1(1.4426950408889634074))); \
+    VEC r = SUB(SUB(xc, MUL(n, SET1(6.93145751953125E-1))), MUL(n, SET1(1.42860682030941723212E-6))); \
+    VEC rr = MUL(r, r); \
+    VEC px = MUL(r, ADD(MUL(ADD(MUL(SET1(1.26177193074810590878E-4), rr), SET1(3.02994407707441961300E-2)), rr), SET1(9.99999999999999999910E-1))); \
+    VEC qx = ADD(MUL(ADD(MUL(ADD(MUL(SET1(3.00198505138664455042E-6), rr), SET1(2.52448340349684104192E-3)), rr), SET1(2.27265548208155028766E-1)), rr), SET1(2.00000000000000000009E0)); \
+    VEC e = ADD(SET1(1.0), MUL(SET1(2.0), DIV(px, SUB(qx, px))));
+
+__attribute__((target("avx2"))) inline __m256d exp_avx2(__m256d x)
+{
+    typedef __m256d VEC;
+#define MPLP_ROUND_AVX2(v) _mm256_round_pd(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+    MPLP_EXP_REDUCE(_mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd, _mm256_max_pd, MPLP_ROUND_AVX2)
+#undef MPLP_ROUND_AVX2
+    __m256i bits = _mm256_slli_epi64(_mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n)), _mm256_set1_epi64x(1023)), 52);
+    e = _mm256_mul_pd(e, _mm256_castsi256_pd(bits));
+    return _mm256_and_pd(e, _mm256_cmp_pd(x, _mm256_set1_pd(MPLP_EXP_MIN), _CMP_GE_OQ));
+}
+
+__attribute__((target("avx512f"))) inline __m512d exp_avx512(__m512d x)
+{
+    typedef __m512d VEC;
+#define MPLP_ROUND_AVX512(v) _mm512_roundscale_pd(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+    MPLP_EXP_REDUCE(_mm512_set1_pd, _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd, _mm512_max_pd, MPLP_ROUND_AVX512)
+#undef MPLP_ROUND_AVX512
+    e = _mm512_scalef_pd(e, n);
+    return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(x, _mm512_set1_pd(MPLP_EXP_MIN), _CMP_GE_OQ), e);
+}
+
+#undef MPLP_EXP_REDUCE
+
+// Loads 4 or 8 values as doubles
+#ifdef MPLP_FLOAT_MESSAGES
+#define MPLP_LOAD4_PD(p) _mm256_cvtps_pd(_mm_loadu_ps(p))
+#define MPLP_LOAD8_PD(p) _mm512_cvtps_pd(_mm256_loadu_ps(p))
+#else
+#define MPLP_LOAD4_PD(p) _mm256_loadu_pd(p)
+#define MPLP_LOAD8_PD(p) _mm512_loadu_pd(p)
+#endif
+
+__attribute__((target("avx2"))) double sum_exp_avx2(const MPLPValueType *src, MPLPValueType shift, double scale, MPLPIndexType n)
+{
+    const __m256d vs = _mm256_set1_pd(shift), vk = _mm256_set1_pd(scale);
+    __m256d acc = _mm256_setzero_pd();
+    MPLPIndexType i = 0;
+    for (; i+4<=n; i+=4)
+        acc = _mm256_add_pd(acc, exp_avx2(_mm256_mul_pd(vk, _mm256_sub_pd(MPLP_LOAD4_PD(src+i), vs))));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i<n; i++)
+        sum+= exp_or_zero(scale*(src[i] - shift));
+    return sum;
+}
+
+__attribute__((target("avx2"))) void acc_exp_avx2(double *acc, const MPLPValueType *src, const MPLPValueType *shift, double scale, MPLPIndexType n)
+{
+    const __m256d vk = _mm256_set1_pd(scale);
+    MPLPIndexType i = 0;
+    for (; i+4<=n; i+=4)
+        _mm256_storeu_pd(acc+i, _mm256_add_pd(_mm256_loadu_pd(acc+i), exp_avx2(_mm256_mul_pd(vk, _mm256_sub_pd(MPLP_LOAD4_PD(src+i), MPLP_LOAD4_PD(shift+i))))));
+    for (; i<n; i++)
+        acc[i]+= exp_or_zero(scale*(src[i] - shift[i]));
+}
+
+__attribute__((target("avx512f"))) double sum_exp_avx512(const MPLPValueType *src, MPLPValueType shift, double scale, MPLPIndexType n)
+{
+    const __m512d vs = _mm512_set1_pd(shift), vk = _mm512_set1_pd(scale);
+    __m512d acc = _mm512_setzero_pd();
+    MPLPIndexType i = 0;
+    for (; i+8<=n; i+=8)
+        acc = _mm512_add_pd(acc, exp_avx512(_mm512_mul_pd(vk, _mm512_sub_pd(MPLP_LOAD8_PD(src+i), vs))));
+    double sum = _mm512_reduce_add_pd(acc);
+    for (; i<n; i++)
+        sum+= exp_or_zero(scale*(src[i] - shift));
+    return sum;
+}
+
+__attribute__((target("avx512f"))) void acc_exp_avx512(double *acc, const MPLPValueType *src, const MPLPValueType *shift, double scale, MPLPIndexType n)
+{
+    const __m512d vk = _mm512_set1_pd(scale);
+    MPLPIndexType i = 0;
+    for (; i+8<=n; i+=8)
+        _mm512_storeu_pd(acc+i, _mm512_add_pd(_mm512_loadu_pd(acc+i), exp_avx512(_mm512_mul_pd(vk, _mm512_sub_pd(MPLP_LOAD8_PD(src+i), MPLP_LOAD8_PD(shift+i))))));
+    for (; i<n; i++)
+        acc[i]+= exp_or_zero(scale*(src[i] - shift[i]));
+}
+
+#undef MPLP_LOAD4_PD
+#undef MPLP_LOAD8_PD
+
+// MAX(a, b) returns b when the two are equal or either is a NaN, as std::max(b, a) does
+#define MPLP_MAX_ADD_KERNEL(SUFFIX, TARGET, VEC, W, LOAD, STORE, SET1, ADD, MAX) \
+__attribute__((target(TARGET))) void max_add_##SUFFIX(double *acc, double row, const double *src, MPLPIndexType n) \
+{ \
+    const VEC vr = SET1(row); \
+    MPLPIndexType i = 0; \
+    for (; i+W<=n; i+=W) \
+        STORE(acc+i, MAX(ADD(vr, LOAD(src+i)), LOAD(acc+i))); \
+    for (; i<n; i++) \
+        acc[i] = max(acc[i], row + src[i]); \
+}
+
+MPLP_MAX_ADD_KERNEL(sse4, "sse4.1", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_max_pd)
+MPLP_MAX_ADD_KERNEL(avx2, "avx2", __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_max_pd)
+MPLP_MAX_ADD_KERNEL(avx512, "avx512f", __m512d, 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, _mm512_add_pd, _mm512_max_pd)
+
+#undef MPLP_MAX_ADD_KERNEL
+
+#endif // MPLP_SIMD_X86
+
+const mplpLib::SimdKernels scalar_kernels = {"scalar", add_scalar, sub_scalar, scale_scalar, fill_scalar, argmax_scalar, gather_add_scalar, sum_exp_scalar, acc_exp_scalar, max_add_scalar};
+#ifdef MPLP_SIMD_X86
+const mplpLib::SimdKernels sse4_kernels = {"sse4", add_sse4, sub_sse4, scale_sse4, fill_sse4, argmax_sse4, gather_add_scalar, sum_exp_scalar, acc_exp_scalar, max_add_sse4};
+const mplpLib::SimdKernels avx2_kernels = {"avx2", add_avx2, sub_avx2, scale_avx2, fill_avx2, argmax_avx2, gather_add_avx2, sum_exp_avx2, acc_exp_avx2, max_add_avx2};
+const mplpLib::SimdKernels avx512_kernels = {"avx512", add_avx512, sub_avx512, scale_avx512, fill_avx512, argmax_avx512, gather_add_avx512, sum_exp_avx512, acc_exp_avx512, max_add_avx512};
+#endif
+
+const mplpLib::SimdKernels * select_kernels()
+{
+#ifdef MPLP_SIMD_X86
+    // Highest level allowed by the environment (default: no limit)
+    int cap = 3;
+    char *s = getenv("MPLP_SIMD");
+    if (s != NULL) {
+        if (!strcmp(s, "scalar")) cap = 0;
+        else if (!strcmp(s, "sse4")) cap = 1;
+        else if (!strcmp(s, "avx2")) cap = 2;
+    }
+
+    __builtin_cpu_init();
+    if (cap >= 3 && __builtin_cpu_supports("avx512f"))
+        return &avx512_kernels;
+    if (cap >= 2 && __builtin_cpu_supports("avx2"))
+        return &avx2_kernels;
+    if (cap >= 1 && __builtin_cpu_supports("sse4.1"))
+        return &sse4_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+} // namespace
+
+const mplpLib::SimdKernels & mplpLib::GetSimdKernels()
+{
+    static const SimdKernels *kernels = select_kernels();
+    return *kernels;
+}
@@ -0,0 +1,141 @@
+/*
+ *  thread_pool.cpp
+ *  mplp
+ *
+ *  See thread_pool.h.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include <MPLP/thread_pool.h>
+
+using namespace std;
+
+mplpLib::MPLPIndexType mplpLib::DefaultThreadCount()
+{
+    char *s = getenv("MPLP_NUM_THREADS");
+    if (s == NULL)
+        return 1;
+    if (!strcmp(s, "auto") || !strcmp(s, "0")) {
+        MPLPIndexType n = thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+    return atoi(s) > 0 ? atoi(s) : 1;
+}
+
+clock_t mplpLib::WallClock()
+{
+    const chrono::steady_clock::duration d = chrono::steady_clock::now().time_since_epoch();
+    return (clock_t)(chrono::duration_cast<chrono::microseconds>(d).count() * (CLOCKS_PER_SEC / 1e6));
+}
+
+mplpLib::ThreadPool::ThreadPool(MPLPIndexType n_threads) : m_size(n_threads > 0 ? n_threads : 1), m_quit(false), m_generation(0), m_busy(0), m_body(NULL), m_n(0), m_grain(1), m_next(0)
+{
+}
+
+mplpLib::ThreadPool::ThreadPool(const ThreadPool & p) : m_size(p.m_size), m_quit(false), m_generation(0), m_busy(0), m_body(NULL), m_n(0), m_grain(1), m_next(0)
+{
+}
+
+mplpLib::ThreadPool & mplpLib::ThreadPool::operator=(const ThreadPool & p)
+{
+    if (this != &p)
+        Resize(p.m_size);
+    return *this;
+}
+
+mplpLib::ThreadPool::~ThreadPool()
+{
+    Stop();
+}
+
+void mplpLib::ThreadPool::Resize(MPLPIndexType n_threads)
+{
+    Stop();
+    m_size = n_threads > 0 ? n_threads : 1;
+}
+
+void mplpLib::ThreadPool::Start()
+{
+    m_quit = false;
+    for (MPLPIndexType i=1; i<m_size; i++)
+        m_workers.push_back(thread(&ThreadPool::WorkerLoop, this));
+}
+
+void mplpLib::ThreadPool::Stop()
+{
+    if (m_workers.empty())
+        return;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+    for (MPLPIndexType i=0; i<m_workers.size(); i++)
+        m_workers[i].join();
+    m_workers.clear();
+}
+
+void mplpLib::ThreadPool::RunChunks()
+{
+    for (;;) {
+        MPLPIndexType begin = m_next.fetch_add(m_grain);
+        if (begin >= m_n)
+            break;
+        (*m_body)(begin, min(begin + m_grain, m_n));
+    }
+}
+
+void mplpLib::ThreadPool::WorkerLoop()
+{
+    unsigned long seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_wake.wait(lock, [&]{return m_quit || m_generation != seen;});
+            if (m_quit)
+                return;
+            seen = m_generation;
+        }
+        RunChunks();
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (--m_busy == 0)
+                m_done.notify_one();
+        }
+    }
+}
+
+void mplpLib::ThreadPool::ParallelFor(MPLPIndexType n, MPLPIndexType grain, const function<void(MPLPIndexType, MPLPIndexType)> & body)
+{
+    if (grain == 0)
+        grain = 1;
+    if (m_size <= 1 || n < 2*grain) {
+        if (n > 0)
+            body(0, n);
+        return;
+    }
+    if (m_workers.empty())
+        Start();
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_body = &body;
+        m_n = n;
+        m_grain = grain;
+        m_next = 0;
+        m_busy = m_workers.size();
+        m_generation++;
+    }
+    m_wake.notify_all();
+    RunChunks();
+
+    // The loop is finished only when every worker has seen it, so that none of them is
+    // still reading m_body when the next one is handed out
+    unique_lock<mutex> lock(m_mutex);
+    m_done.wait(lock, [&]{return m_busy == 0;});
+    m_body = NULL;
+}